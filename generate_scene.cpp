@@ -0,0 +1,524 @@
+/* CS/CNS 171
+ * Scene generator
+ *
+ * Writes scene files and OBJ meshes of any size in the formats 'opengl'
+ * reads, to measure how load time, memory and frame time grow with the
+ * number of triangles, instances, lights and materials. The same options and
+ * seed always give the same files, so measurements can be repeated.
+ *
+ * Each mesh is a bumpy torus, which is closed and has exactly two triangles
+ * per grid cell, so any triangle count can be met to within one ring. Its
+ * vertices and faces are written while they are computed, so a mesh of 100
+ * million triangles needs no more memory than a small one.
+ */
+
+#include <math.h>
+#define _USE_MATH_DEFINES
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+/* Number formatting and file output */
+#include <charconv>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+/* Timing the whole run */
+#include <chrono>
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* What to generate; see 'usage' */
+struct Options
+{
+    string scene_filename;
+    uint64_t triangles = 100000;
+    int meshes = 1;
+    uint64_t instances = 100;
+    int lights = 4;
+    int materials = 8;
+    uint64_t seed = 1;
+    bool normals = true;
+};
+
+/* A random number generator (splitmix64) whose output does not depend on
+ * the standard library, so a seed gives the same scene on every machine.
+ */
+struct Random
+{
+    uint64_t state;
+
+    uint64_t next()
+    {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    /* A float in [lo, hi) */
+    float uniform(float lo, float hi)
+    {
+        return lo + (hi - lo) * (float) ((next() >> 40) * (1.0 / (1 << 24)));
+    }
+};
+
+/* Collects output in a large buffer and writes it out when it fills up,
+ * formatting numbers with 'to_chars' rather than the slower 'printf'.
+ */
+struct Output
+{
+    FILE *file = NULL;
+    string filename;
+    vector<char> buffer;
+    size_t used = 0;
+
+    explicit Output(const string &name) : filename(name), buffer(1 << 22)
+    {
+        file = fopen(name.c_str(), "wb");
+        if (file == NULL) {
+            throw invalid_argument("Could not write file '" + name + "'.");
+        }
+    }
+
+    ~Output()
+    {
+        if (file != NULL) {
+            fclose(file);
+        }
+    }
+
+    /* Makes room for at least 'size' more bytes */
+    void reserve(size_t size)
+    {
+        if (used + size > buffer.size()) {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        if (used > 0 && fwrite(buffer.data(), 1, used, file) != used) {
+            throw invalid_argument("Could not write file '" + filename + "'.");
+        }
+        used = 0;
+    }
+
+    void text(const char *s)
+    {
+        size_t length = strlen(s);
+        reserve(length);
+        memcpy(buffer.data() + used, s, length);
+        used += length;
+    }
+
+    void integer(uint64_t value)
+    {
+        reserve(24);
+        used = to_chars(buffer.data() + used, buffer.data() + buffer.size(), value).ptr
+               - buffer.data();
+    }
+
+    /* Writes a number with 5 decimals, dropping trailing zeros */
+    void number(float value)
+    {
+        reserve(32);
+        char *start = buffer.data() + used;
+        char *end = to_chars(start, buffer.data() + buffer.size(), value,
+                             chars_format::fixed, 5).ptr;
+        while (end[-1] == '0') {
+            --end;
+        }
+        if (end[-1] == '.') {
+            --end;
+        }
+        if (end - start == 2 && start[0] == '-' && start[1] == '0') {
+            start[0] = '0';
+            --end;
+        }
+        used = end - buffer.data();
+    }
+
+    /* Writes 'count' numbers separated by spaces */
+    void numbers(const float *values, int count)
+    {
+        for (int i = 0; i < count; ++i) {
+            text(i == 0 ? "" : " ");
+            number(values[i]);
+        }
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* The following function prototypes are for the helper functions that write
+ * the files. Details of the functions are given in their implementations
+ * further below.
+ */
+
+uint64_t write_torus(const string &filename, uint64_t triangles, bool normals, Random &random);
+void write_scene(const Options &options, const vector<string> &mesh_files, Random &random);
+void usage(void);
+template <typename T> T number_argument(const char *text);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* 'write_torus' function:
+ *
+ * Writes an OBJ file with a torus of about the given number of triangles,
+ * centered on the origin and fitting in the unit sphere. The surface is
+ * pushed in and out along its normal by a product of two sine waves, whose
+ * frequencies come from 'random', so that meshes from different seeds look
+ * different. With 'normals', every vertex gets its exact normal and faces
+ * are written as "v//vn"; otherwise 'opengl' generates the normals.
+ *
+ * Returns the number of triangles written.
+ *
+ * @throws invalid_argument if it fails to write the file
+ */
+uint64_t write_torus(const string &filename, uint64_t triangles, bool normals, Random &random)
+{
+    /* The grid has 'rings' steps around the torus and 'sides' steps around
+     * its tube, and two triangles per cell. The tube has a radius of 0.3
+     * and goes around a ring of radius 0.65, so cells come out about square
+     * with 2.2 times as many rings as sides.
+     */
+    const double ring_radius = 0.65, tube_radius = 0.3;
+    uint64_t cells = max<uint64_t>(triangles / 2, 9);
+    uint64_t sides = max<uint64_t>(3, llround(sqrt(cells / 2.2)));
+    uint64_t rings = max<uint64_t>(3, (cells + sides / 2) / sides);
+
+    /* The bumps: 'amplitude' * sin(a u + p) * sin(b v + q), with whole
+     * frequencies so that they meet up around the torus.
+     */
+    const double amplitude = 0.04;
+    int a = 3 + random.next() % 12, b = 2 + random.next() % 6;
+    double p = random.uniform(0.0f, 2 * M_PI), q = random.uniform(0.0f, 2 * M_PI);
+
+    /* Everything that depends on just one of the two angles is computed
+     * once per ring or side.
+     */
+    vector<double> cos_u(rings), sin_u(rings), bump_u(rings), slope_u(rings);
+    for (uint64_t i = 0; i < rings; ++i) {
+        double u = 2 * M_PI * i / rings;
+        cos_u[i] = cos(u);
+        sin_u[i] = sin(u);
+        bump_u[i] = sin(a * u + p);
+        slope_u[i] = a * cos(a * u + p);
+    }
+    vector<double> cos_v(sides), sin_v(sides), bump_v(sides), slope_v(sides);
+    for (uint64_t j = 0; j < sides; ++j) {
+        double v = 2 * M_PI * j / sides;
+        cos_v[j] = cos(v);
+        sin_v[j] = sin(v);
+        bump_v[j] = sin(b * v + q);
+        slope_v[j] = b * cos(b * v + q);
+    }
+
+    Output out(filename);
+    out.text("# ");
+    out.integer(2 * rings * sides);
+    out.text(" triangles, written by generate_scene\n");
+    for (int pass = 0; pass < (normals ? 2 : 1); ++pass) {
+        for (uint64_t i = 0; i < rings; ++i) {
+            for (uint64_t j = 0; j < sides; ++j) {
+                /* The point is at distance 'radius' from the center of the
+                 * tube; 'radius_u' and 'radius_v' are how fast that changes.
+                 */
+                double radius = tube_radius + amplitude * bump_u[i] * bump_v[j];
+                double radius_u = amplitude * slope_u[i] * bump_v[j];
+                double radius_v = amplitude * bump_u[i] * slope_v[j];
+                double across = ring_radius + radius * cos_v[j];
+                float values[3];
+                if (pass == 0) {
+                    values[0] = across * cos_u[i];
+                    values[1] = radius * sin_v[j];
+                    values[2] = across * sin_u[i];
+                    out.text("v ");
+                } else {
+                    /* The cross product of the derivatives along v and u */
+                    double du[3] = {-across * sin_u[i] + radius_u * cos_v[j] * cos_u[i],
+                                    radius_u * sin_v[j],
+                                    across * cos_u[i] + radius_u * cos_v[j] * sin_u[i]};
+                    double tangent = -radius * sin_v[j] + radius_v * cos_v[j];
+                    double dv[3] = {tangent * cos_u[i],
+                                    radius * cos_v[j] + radius_v * sin_v[j],
+                                    tangent * sin_u[i]};
+                    double n[3] = {dv[1] * du[2] - dv[2] * du[1],
+                                   dv[2] * du[0] - dv[0] * du[2],
+                                   dv[0] * du[1] - dv[1] * du[0]};
+                    double length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                    for (int k = 0; k < 3; ++k) {
+                        values[k] = n[k] / length;
+                    }
+                    out.text("vn ");
+                }
+                out.numbers(values, 3);
+                out.text("\n");
+            }
+        }
+    }
+
+    /* Two triangles per cell, counter-clockwise seen from outside */
+    for (uint64_t i = 0; i < rings; ++i) {
+        uint64_t next_i = (i + 1) % rings;
+        for (uint64_t j = 0; j < sides; ++j) {
+            uint64_t next_j = (j + 1) % sides;
+            uint64_t corners[2][3] = {{i * sides + j, next_i * sides + next_j, next_i * sides + j},
+                                      {i * sides + j, i * sides + next_j, next_i * sides + next_j}};
+            for (int t = 0; t < 2; ++t) {
+                out.text("f");
+                for (int k = 0; k < 3; ++k) {
+                    out.text(" ");
+                    out.integer(corners[t][k] + 1);
+                    if (normals) {
+                        out.text("//");
+                        out.integer(corners[t][k] + 1);
+                    }
+                }
+                out.text("\n");
+            }
+        }
+    }
+    out.flush();
+    return 2 * rings * sides;
+}
+
+/* 'write_scene' function:
+ *
+ * Writes the scene file. The instances stand on a cubic grid three units
+ * apart, above the viewer's ground, each turned and scaled at random and
+ * using the meshes in turn. Materials are drawn from a palette of
+ * 'options.materials' random colors, and the lights are scattered over the
+ * grid with their attenuation set so that each reaches a few cells. The
+ * camera looks down at the whole grid from in front of it.
+ *
+ * @throws invalid_argument if it fails to write the file
+ */
+void write_scene(const Options &options, const vector<string> &mesh_files, Random &random)
+{
+    const float spacing = 3.0f;
+    uint64_t side = max<uint64_t>(1, ceil(cbrt((double) options.instances) - 1e-9));
+    while (side * side * side < options.instances) {
+        ++side;
+    }
+    float extent = spacing * side;
+
+    /* The camera is tilted down by 'pitch' and backed away from the center
+     * of the grid until a sphere around the grid fits in its view, which
+     * spans atan(0.5) on each side.
+     */
+    const float pitch = 0.45f;
+    float center[3] = {0.0f, 0.5f * (extent - spacing) - 1.5f, -0.5f * (extent - spacing)};
+    float radius = 0.87f * extent;
+    float distance = radius / sin(atan(0.5f)) + 1.0f;
+    float position[3] = {center[0], center[1] + distance * sin(pitch),
+                         center[2] + distance * cos(pitch)};
+    Output out(options.scene_filename);
+    out.text("camera:\nposition ");
+    out.numbers(position, 3);
+    out.text("\norientation 1 0 0 ");
+    out.number(-pitch);
+    out.text("\nnear 1\nfar ");
+    out.number(distance + radius + 1.0f);
+    out.text("\nleft -0.5\nright 0.5\ntop 0.5\nbottom -0.5\n\n");
+
+    /* Few lights light everything; many only reach the cells around them */
+    float reach = options.lights <= 8 ? 0.0f : 8.0f * spacing;
+    for (int i = 0; i < options.lights; ++i) {
+        float values[7] = {random.uniform(-0.5f, 0.5f) * extent,
+                           random.uniform(0.0f, 1.0f) * extent,
+                           random.uniform(-1.0f, 0.0f) * extent,
+                           0.5f + 0.5f * (random.next() % 2),
+                           0.5f + 0.5f * (random.next() % 2),
+                           0.5f + 0.5f * (random.next() % 2),
+                           reach > 0 ? 255.0f / (reach * reach) : 0.0f};
+        out.text("light ");
+        out.numbers(values, 3);
+        out.text(" , ");
+        out.numbers(values + 3, 3);
+        out.text(" , ");
+        out.number(values[6]);
+        out.text("\n");
+    }
+
+    out.text("\nobjects:\n");
+    for (size_t m = 0; m < mesh_files.size(); ++m) {
+        string file = mesh_files[m].substr(mesh_files[m].find_last_of('/') + 1);
+        out.text("mesh");
+        out.integer(m);
+        out.text(" ");
+        out.text(file.c_str());
+        out.text("\n");
+    }
+
+    /* Each material is an ambient, diffuse and specular color and a
+     * shininess.
+     */
+    vector<float> palette(options.materials * 10);
+    for (int m = 0; m < options.materials; ++m) {
+        float *material = &palette[m * 10];
+        for (int k = 0; k < 3; ++k) {
+            float color = random.uniform(0.1f, 1.0f);
+            material[k] = 0.2f * color;
+            material[3 + k] = 0.8f * color;
+        }
+        float specular = random.uniform(0.0f, 0.6f);
+        material[6] = material[7] = material[8] = specular;
+        material[9] = random.uniform(1.0f, 40.0f);
+    }
+
+    const char *properties[4] = {"ambient ", "diffuse ", "specular ", "shininess "};
+    for (uint64_t i = 0; i < options.instances; ++i) {
+        out.text("\nmesh");
+        out.integer(i % mesh_files.size());
+        out.text("\n");
+
+        const float *material = &palette[(random.next() % options.materials) * 10];
+        for (int k = 0; k < 4; ++k) {
+            out.text(properties[k]);
+            out.numbers(material + 3 * k, k < 3 ? 3 : 1);
+            out.text("\n");
+        }
+
+        float scale = random.uniform(0.6f, 1.0f);
+        float axis[3] = {random.uniform(-1.0f, 1.0f), random.uniform(-1.0f, 1.0f),
+                         random.uniform(-1.0f, 1.0f)};
+        float length = sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+        float rotation[4] = {0.0f, 1.0f, 0.0f, random.uniform(0.0f, 2 * M_PI)};
+        if (length > 0.01f) {
+            copy(axis, axis + 3, rotation);
+            for (int k = 0; k < 3; ++k) {
+                rotation[k] /= length;
+            }
+        }
+        uint64_t x = i % side, y = i / side / side, z = i / side % side;
+        float translation[3] = {spacing * (x - 0.5f * (side - 1)),
+                                spacing * y - 1.5f,
+                                -spacing * z};
+        float scaling[3] = {scale, scale, scale};
+        out.text("s ");
+        out.numbers(scaling, 3);
+        out.text("\nr ");
+        out.numbers(rotation, 4);
+        out.text("\nt ");
+        out.numbers(translation, 3);
+        out.text("\n");
+    }
+    out.flush();
+}
+
+void usage(void)
+{
+    cerr << "Enter input in the form: generate_scene scene.txt [options]\n\t"
+            "writes scene.txt and its meshes, scene_mesh0.obj, ..., next to it\n"
+            "Options:\n\t"
+            "-triangles n   triangles in each mesh (18 to 100000000, default 100000)\n\t"
+            "-meshes n      number of different meshes (default 1)\n\t"
+            "-instances n   number of instances, using the meshes in turn (default 100)\n\t"
+            "-lights n      number of point lights (default 4)\n\t"
+            "-materials n   number of different materials (default 8)\n\t"
+            "-seed n        seed of the random numbers (default 1)\n\t"
+            "-no_normals    leave the normals for the viewer to generate\n";
+    exit(1);
+}
+
+/* 'number_argument' function:
+ *
+ * Reads a whole command line argument as a number of type T, calling 'usage'
+ * if it is anything else or does not fit.
+ */
+template <typename T>
+T number_argument(const char *text)
+{
+    T value;
+    const char *end = text + strlen(text);
+    from_chars_result result = from_chars(text, end, value);
+    if (result.ec != errc() || result.ptr != end) {
+        usage();
+    }
+    return value;
+}
+
+/* The 'main' function:
+ *
+ * Reads the options, writes the meshes and then the scene, and prints what
+ * was written.
+ */
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argv[1][0] == '-') {
+        usage();
+    }
+    Options options;
+    options.scene_filename = argv[1];
+    for (int i = 2; i < argc; ++i) {
+        string option = argv[i];
+        bool has_value = i + 1 < argc;
+        if (option == "-triangles" && has_value) {
+            options.triangles = number_argument<uint64_t>(argv[++i]);
+            if (options.triangles < 18 || options.triangles > 100000000) {
+                usage();
+            }
+        } else if (option == "-meshes" && has_value) {
+            options.meshes = number_argument<int>(argv[++i]);
+        } else if (option == "-instances" && has_value) {
+            options.instances = number_argument<uint64_t>(argv[++i]);
+        } else if (option == "-lights" && has_value) {
+            options.lights = number_argument<int>(argv[++i]);
+        } else if (option == "-materials" && has_value) {
+            options.materials = number_argument<int>(argv[++i]);
+        } else if (option == "-seed" && has_value) {
+            options.seed = number_argument<uint64_t>(argv[++i]);
+        } else if (option == "-no_normals") {
+            options.normals = false;
+        } else {
+            usage();
+        }
+    }
+    if (options.meshes <= 0 || options.instances == 0 || options.lights < 0
+        || options.materials <= 0) {
+        usage();
+    }
+
+    string base = options.scene_filename;
+    if (base.size() < 4 || base.compare(base.size() - 4, 4, ".txt") != 0) {
+        usage();
+    }
+    base.erase(base.size() - 4);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    Random random = {options.seed};
+    vector<string> mesh_files;
+    uint64_t mesh_triangles = 0;
+    try {
+        for (int m = 0; m < options.meshes; ++m) {
+            mesh_files.push_back(base + "_mesh" + to_string(m) + ".obj");
+            mesh_triangles += write_torus(mesh_files.back(), options.triangles,
+                                          options.normals, random);
+        }
+        write_scene(options, mesh_files, random);
+    } catch (const exception &error) {
+        cerr << error.what() << "\n";
+        return 1;
+    }
+
+    /* Every instance draws its mesh's triangles */
+    uint64_t drawn = 0;
+    for (int m = 0; m < options.meshes; ++m) {
+        uint64_t users = options.instances / options.meshes
+                         + ((uint64_t) m < options.instances % options.meshes ? 1 : 0);
+        drawn += users * (mesh_triangles / options.meshes);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Wrote " << options.scene_filename << " with " << options.meshes << " mesh(es) of "
+         << mesh_triangles / options.meshes << " triangles, " << options.instances
+         << " instances (" << drawn << " triangles in all), " << options.lights
+         << " lights and " << options.materials << " materials in " << seconds << " s\n";
+    return 0;
+}
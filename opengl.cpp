@@ -63,14 +63,83 @@
 #include <fstream>
 #include <sstream>
 
+/* Column widths for the benchmark results printed by '-bench' */
+#include <iomanip>
+
 /* Map library used to store objects by name */
 #include <map>
 
+/* Sorting, fixed-width integers, and memcpy used to deduplicate wireframe
+ * edges and to build the sort keys of the render queue
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+/* Arenas for memory that is all freed at once, like a scene's instances */
+#include <memory_resource>
+
+/* Threads used to bin lights into screen tiles in parallel, and to parse
+ * several scene files at once, handing back the errors they throw
+ */
+#include <thread>
+#include <functional>
+#include <exception>
+#include <atomic>
+
+/* Locks and queues used to hand rendered frames to the image encoder
+ * threads, and zlib to compress PNG images
+ */
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <zlib.h>
+
+/* File change notifications, file times, and owning pointers used to reload
+ * the scene while the viewer is running
+ */
+#include <memory>
+#include <set>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+
+/* Memory-mapped files and a linked list used to stream chunked meshes */
+#include <list>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/* Canonical paths used to share meshes between scene files */
+#include <cstdlib>
+
+/* Range checks on numeric command line arguments */
+#include <climits>
+
+/* Peak resident memory for the memory report */
+#include <sys/resource.h>
+
+/* Clock used to pace redraws and measure the frame rate */
+#include <chrono>
+#include <charconv>
+#include <array>
+#include <type_traits>
+
 /* Eigen Library included for ArcBall */
 #include <Eigen/Dense>
 using Eigen::Vector3f;
 using Eigen::Matrix4f;
 
+/* GLX lets us ask the driver to sync buffer swaps to the display refresh,
+ * and EGL lets us render without a window for batch export. Both pull in
+ * X11 headers whose macros clash with Eigen, so they come after it.
+ */
+#include <GL/glx.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
 using namespace std;
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -82,7 +151,7 @@ using namespace std;
  * further below.
  */
 
-void init(string filename);
+void init(const vector<string> &filenames);
 void reshape(int width, int height);
 void display(void);
 
@@ -94,6 +163,8 @@ void mouse_pressed(int button, int state, int x, int y);
 void mouse_moved(int x, int y);
 void key_pressed(unsigned char key, int x, int y);
 
+void request_redraw();
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 /* The following structs do not involve OpenGL, but they are useful ways to
@@ -189,9 +260,20 @@ struct Instance
     
     float shininess;
 
-    vector<Transform> transforms;
+    /* The instance's transformations multiplied into one column-major
+     * matrix by 'bake_transforms', ready to hand to 'glMultMatrixf'.
+     */
+    GLfloat model[16];
+
+    /* Instances with identical reflectances share a material id, which lets
+     * 'draw_objects' skip redundant 'glMaterial' calls.
+     */
+    int material_id = 0;
 };
 
+/* Binary scene files store instances exactly as they are laid out in memory */
+static_assert(is_trivially_copyable<Instance>::value, "Instance must be a plain record");
+
 struct Quarternion
 {
     float real;
@@ -206,6 +288,91 @@ Quarternion getIdentityQuarternion(void) {
 }
 
 
+/* The following structs describe a mesh stored in chunks on disk, which we
+ * use for meshes too large to keep in memory. 'convert_to_chunks' writes
+ * such a ".chunks" file from an OBJ file. It holds:
+ *
+ * - a 'Chunk_File_Header',
+ * - one 'Mesh_Chunk' per chunk, and
+ * - each chunk's vertices followed by its normals, as 'Triple's, starting
+ *   on a page boundary so that the chunk's pages hold nothing else.
+ *
+ * The triangles are sorted along a Morton (Z-order) curve through the
+ * mesh's bounding box before being cut into chunks, so each chunk covers a
+ * small, compact part of the mesh and can be culled on its own.
+ */
+struct Chunk_File_Header
+{
+    char magic[8];
+    uint32_t chunk_count;
+    uint32_t triangle_count;
+    float center[3];
+    float radius;
+};
+
+struct Mesh_Chunk
+{
+    /* A sphere around the chunk's vertices */
+    float center[3];
+    float radius;
+
+    /* Where the chunk's vertices start in the file, and how many there are */
+    uint64_t offset;
+    uint32_t vertex_count;
+    uint32_t unused;
+};
+
+/* The chunk cache lists (mesh, chunk) pairs from most to least recently
+ * drawn; see 'use_chunk'.
+ */
+struct Chunked_Mesh;
+typedef list<pair<Chunked_Mesh *, uint32_t> > Chunk_List;
+
+/* Defined before every mesh, so it is destroyed after them (see
+ * '~Chunked_Mesh')
+ */
+Chunk_List chunk_cache;
+
+/* A ".chunks" file mapped into memory. Only the chunk table is read up
+ * front; the operating system reads a chunk's pages from disk the first
+ * time the chunk is uploaded. 'chunk_vbos' holds each chunk's buffer object
+ * while the chunk is in the chunk cache, or 0, and 'cache_entries' its
+ * place in the cache's list. A mesh drops its chunks from the cache when it
+ * goes away, which must then happen on the main thread.
+ */
+struct Chunked_Mesh
+{
+    int fd = -1;
+    unsigned char *data = NULL;
+    size_t size = 0;
+    const Mesh_Chunk *chunks = NULL;
+    uint32_t chunk_count = 0;
+
+    vector<GLuint> chunk_vbos;
+    vector<int> chunk_last_used;
+    vector<Chunk_List::iterator> cache_entries;
+
+    ~Chunked_Mesh();
+};
+
+/* A small cluster of neighbouring triangles of a mesh, built by
+ * 'build_meshlets'. The sphere bounds the cluster's vertices and the cone
+ * bounds its face normals: every normal is within the cone around
+ * 'cone_axis', and 'cone_cutoff' is the sine of the cone's half angle, or 1
+ * for a cluster whose normals spread too far to be culled as a whole. Its
+ * triangles are 'index_count' indices of the object's 'meshlet_indices'
+ * starting at 'first_index'.
+ */
+struct Meshlet
+{
+    float center[3];
+    float radius;
+    float cone_axis[3];
+    float cone_cutoff;
+    GLuint first_index;
+    GLuint index_count;
+};
+
 /* The following struct is used to represent objects.
  *
  * The main things to note here are the 'vertex_buffer' and 'normal_buffer'
@@ -239,13 +406,58 @@ Quarternion getIdentityQuarternion(void) {
  * The 'normal_buffer' stores all the normals corresponding to the vertices
  * in the 'vertex_buffer'. With the cube example, since the "vertex array"
  * has "36" vertices, the "normal array" also has "36" normals.
+ *
+ * Both arrays are copied once into OpenGL buffer objects by 'upload_object'.
+ * 'vertex_vbo' and 'normal_vbo' hold the names OpenGL gave those buffers, or
+ * 0 while the object has not been uploaded yet.
+ *
+ * The 'edge_buffer' lists every distinct edge of the mesh once, as pairs of
+ * indices into the 'vertex_buffer'. It is built by 'build_edge_buffer' and
+ * lets wireframe mode draw the whole mesh with a single 'GL_LINES' call.
+ *
+ * 'filename' records which OBJ file the mesh was read from, and 'mesh_key'
+ * names that file as it was when read (see 'mesh_key'), so that reloading
+ * the scene or reading another scene can tell whether the mesh needs to be
+ * read again.
+ *
+ * The 'meshlets' split the triangles into small clusters that can be culled
+ * one at a time (see 'draw_meshlets'). 'meshlet_indices' lists the vertices
+ * of every cluster's triangles, cluster after cluster, and 'meshlet_ibo' is
+ * the index buffer holding it.
+ *
+ * Objects read from a ".chunks" file leave all of the above empty and set
+ * 'chunked' instead; their chunks are uploaded as they come into view.
  */
 struct Object
 {
     vector<Triple> vertex_buffer;
     vector<Triple> normal_buffer;
-    
-    vector<Instance> instances;
+    vector<GLuint> edge_buffer;
+
+    GLuint vertex_vbo = 0;
+    GLuint normal_vbo = 0;
+    GLuint edge_ibo = 0;
+
+    vector<Meshlet> meshlets;
+    vector<GLuint> meshlet_indices;
+    GLuint meshlet_ibo = 0;
+
+    /* A sphere around all the vertices, used to skip instances that are
+     * outside of the view frustum.
+     */
+    Triple bound_center = {0.0f, 0.0f, 0.0f};
+    float bound_radius = 0.0f;
+
+    string filename;
+    string mesh_key;
+
+    shared_ptr<Chunked_Mesh> chunked;
+
+    /* The object's instances, a run of the scene's instance table (see
+     * 'Scene_Data').
+     */
+    Instance *instances = NULL;
+    size_t instance_count = 0;
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -280,90 +492,1067 @@ float near_param, far_param,
 
 /* All the lights in the scene */
 vector<Point_Light> lights;
+
+/* Which of our lights each of OpenGL's built-in lights currently holds, or
+ * -1 for a built-in light that is switched off. See 'select_lights'.
+ */
+vector<int> slot_lights;
 /* All the objects mapped by name (filename) */
 map<string, Object> objects;
+/* The ground sphere drawn under every scene, with its single instance */
+Object ground;
+Instance ground_instance;
+
+/* A whole file mapped into memory for reading, unmapped when it goes away */
+struct Mapped_File
+{
+    int fd = -1;
+    char *data = NULL;
+    size_t size = 0;
+
+    ~Mapped_File()
+    {
+        if (data != NULL) {
+            munmap((void *) data, size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+/* What 'count_obj_records' finds in an OBJ file: how many positions and
+ * normals it lists, how many triangle corners its faces split into, and
+ * whether every corner gives a normal.
+ */
+struct Obj_Counts
+{
+    size_t positions = 0;
+    size_t normals = 0;
+    size_t corners = 0;
+    bool all_normals = true;
+};
+
+/* An instance placed under a node of a 'Scene_Graph', with its own
+ * transformations, relative to the node, baked into 'local'.
+ */
+struct Node_Instance
+{
+    int node;
+    Instance *inst;
+    GLfloat local[16];
+};
+
+/* A node that keeps turning about an axis of its own, 'speed' radians per
+ * second. 'rest' is the node's local matrix before it turns.
+ */
+struct Node_Spin
+{
+    int node;
+    float axis[3];
+    float speed;
+    GLfloat rest[16];
+};
+
+/* The nodes a scene file places instances under. Each node has a local
+ * matrix, relative to its parent, and a world matrix, which is its parent's
+ * world matrix times its local one. The world matrix of an instance under a
+ * node is the node's world matrix times the instance's own transformations,
+ * and is what its 'model' matrix holds.
+ *
+ * The nodes are stored depth first, so every node comes after its parent
+ * and a node's subtree is the run of nodes from the node up to (but not
+ * including) 'subtree_end'. The instances under the nodes are stored in the
+ * same order, with a node's own instances starting at 'first_attached', so
+ * a subtree's instances are one run of 'attached' too. Moving a node only
+ * walks those two runs, however big the rest of the scene is.
+ *
+ * 'set_node_transform' changes a node's local matrix and marks it dirty,
+ * and 'update_scene_graph' brings the world matrices of the dirty subtrees
+ * up to date before the next frame is drawn.
+ */
+struct Scene_Graph
+{
+    vector<int> parent;
+    vector<int> subtree_end;
+    vector<Matrix4f, Eigen::aligned_allocator<Matrix4f> > local;
+    vector<Matrix4f, Eigen::aligned_allocator<Matrix4f> > world;
+    vector<int> first_attached;
+    vector<Node_Instance> attached;
+    vector<char> dirty;
+    vector<int> dirty_nodes;
+    vector<Node_Spin> spins;
+};
+
+/* A scene's objects, by 'mesh_key'. Looking one up takes a 'string_view'. */
+typedef pmr::map<pmr::string, Object, less<> > Scene_Objects;
+
+/* Everything 'parseFormatFile' reads from a scene file. It is filled in on
+ * its own rather than straight into the globals above so that a scene can
+ * be reloaded on another thread while the current one is being drawn; see
+ * 'swap_in_scene'. The camera fields mirror the camera globals, and
+ * 'camera_text' is the camera section as written, used to tell whether it
+ * changed.
+ *
+ * Everything the scene itself holds (its text, lights, objects, file names
+ * and instances) comes from its 'arena', so a scene is freed in one go.
+ * The meshes do not: they move to 'objects' when they are uploaded and
+ * outlive the scene.
+ */
+struct Scene_Data
+{
+    /* Memory that lasts as long as the scene does. Allocating from it only
+     * moves a pointer, and it is all freed at once when the scene is
+     * evicted or replaced by a reload. It comes first, so it is made before
+     * and destroyed after everything allocated from it.
+     */
+    pmr::monotonic_buffer_resource arena;
+
+    pmr::string camera_text{&arena};
+    float cam_position[3] = {0.0f, 0.0f, 0.0f};
+    float cam_orientation_axis[3] = {0.0f, 0.0f, 1.0f};
+    float cam_orientation_angle = 0.0f;
+    float near_param = 0.0f, far_param = 0.0f,
+          left_param = 0.0f, right_param = 0.0f,
+          top_param = 0.0f, bottom_param = 0.0f;
+
+    pmr::vector<Point_Light> lights{&arena};
+
+    /* One object per mesh, by 'mesh_key', however many names in however
+     * many scene files refer to it.
+     */
+    Scene_Objects objects{&arena};
+
+    /* The scene file and every scene file it includes or takes objects
+     * from, to watch for changes.
+     */
+    pmr::vector<pmr::string> scene_files{&arena};
+
+    /* Every instance in the scene, grouped by object, in 'arena'. Scenes
+     * read from a binary scene file leave 'instance_table' empty, and their
+     * objects' instances point straight into the mapped 'binary_file'
+     * instead.
+     */
+    pmr::vector<Instance> instance_table{&arena};
+    shared_ptr<Mapped_File> binary_file;
+
+    /* The nodes the instances are placed under, if the scene file has any.
+     * Binary scene files store the instances where their nodes put them
+     * and have no nodes.
+     */
+    Scene_Graph graph;
+};
+
+/* A binary ".scene" file, written by 'convert_scene', starts with this
+ * header. The camera section's text, the lights, the object table and the
+ * instance table follow at the given offsets. Each object lists where its
+ * name (its 'mesh_key' when it was written) and mesh file are in the file,
+ * the mesh file relative to the scene's directory unless it is outside of
+ * it, and which run of the instance table is its own. Instances are stored as
+ * 'Instance' records with their matrices baked and their material ids
+ * assigned, so the loaded scene draws straight from the mapped file. The
+ * file is only meant to be read on the kind of machine that wrote it.
+ */
+struct Scene_File_Header
+{
+    char magic[8];
+    float cam_position[3];
+    float cam_orientation_axis[3];
+    float cam_orientation_angle;
+    float near_param, far_param, left_param, right_param, top_param, bottom_param;
+    uint32_t camera_text_offset;
+    uint32_t camera_text_length;
+    uint32_t light_count;
+    uint32_t object_count;
+    uint64_t instance_count;
+    uint64_t lights_offset;
+    uint64_t objects_offset;
+    uint64_t instances_offset;
+};
+
+struct Scene_File_Object
+{
+    uint64_t first_instance;
+    uint64_t instance_count;
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t path_offset;
+    uint32_t path_length;
+};
+
+
+/* One line of a scene file split into fields by 'next_scene_line'. The
+ * fields point into the mapped file, so splitting a line allocates nothing.
+ * 'start' and 'end' are the whole line without its line break.
+ */
+const int max_scene_fields = 12;
+struct Scene_Line
+{
+    const char *start;
+    const char *end;
+    int number = 0;
+    int count = 0;
+    const char *fields[max_scene_fields + 1];
+    int lengths[max_scene_fields + 1];
+};
+
+/* The objects a scene file refers to by name. Names belong to the file that
+ * lists them (or takes them from a library), so included scenes can reuse
+ * names for other meshes. Looking a name up takes a 'string_view' straight
+ * from the mapped file, without building a string.
+ */
+typedef pmr::map<pmr::string, Object *, less<> > Object_Names;
+
+/* The nodes a scene file lists, by name, as indices into the parse's nodes.
+ * Like object names, they belong to the file that lists them.
+ */
+typedef pmr::map<pmr::string, int, less<> > Node_Names;
+
+/* A node as 'parse_scene_text' reads it: its parent's index in the order
+ * the files list nodes (-1 for none), its transformations baked into one
+ * matrix, and the axis and speed of its spin (a zero speed for none).
+ */
+struct Parsed_Node
+{
+    int parent = -1;
+    GLfloat local[16];
+    float spin[4] = {0.0f, 0.0f, 1.0f, 0.0f};
+};
+
+/* What 'parse_scene_text' keeps while reading a scene file and the files it
+ * includes: the scene being filled, the meshes that are already loaded,
+ * the instances in the order the files list them, which object each one
+ * belongs to and which node it is under (-1 for none), the nodes in the
+ * order the files list them, and the canonical paths of the files being
+ * read, to catch a file including itself.
+ *
+ * The instances, their owners, the nodes and the names are only needed
+ * until the instances are grouped into the scene's table, so they come
+ * from 'scratch', which is freed in one go when the parse is done.
+ */
+struct Scene_Parse
+{
+    Scene_Data *scene;
+    const map<string, string> *loaded_meshes;
+    bool read_meshes;
+    pmr::monotonic_buffer_resource scratch;
+    pmr::vector<Instance> instances{&scratch};
+    pmr::vector<Object *> owners{&scratch};
+    pmr::vector<int> instance_nodes{&scratch};
+    pmr::vector<Parsed_Node> nodes{&scratch};
+    vector<string> open_files;
+};
+
+/* The camera section of the scene that is currently shown */
+string loaded_camera_text;
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-/* Quarternions that control ArcBall Rotations
+/* The following are used to read OBJ files on background threads so that
+ * the window can start drawing before the meshes are loaded.
+ *
+ * Until its mesh arrives, an object is drawn as 'placeholder_box', a
+ * wireframe cube from -1 to 1, at each of its instances. 'load_mesh_async'
+ * queues a mesh for the loader threads, which put the parsed meshes in
+ * 'loaded_meshes'; the main thread then uploads them and swaps them in
+ * (see 'upload_loaded_meshes'). The loader threads wait for more meshes
+ * until 'stop_loaders' is called when the program exits.
  */
-Quarternion last_rotation;
-Quarternion curr_rotation;
+Object placeholder_box;
+
+/* A mesh waiting to be read, or one that has been read. 'key' is the
+ * 'mesh_key' of its object, 'mesh' holds the OBJ file's name going in and
+ * the parsed mesh coming out, and 'error' says why the file could not be
+ * read, if it could not.
+ */
+struct Mesh_Load
+{
+    string key;
+    Object mesh;
+    string error;
+};
+
+deque<Mesh_Load> mesh_requests;
+vector<Mesh_Load> loaded_meshes;
+vector<thread> loaders;
+bool loaders_stopping = false;
+mutex load_mutex;
+condition_variable mesh_requested, mesh_loaded;
+
+/* How many queued meshes the main thread has not swapped in yet, and
+ * whether a timer to check on them is set. Only used by the main thread.
+ */
+int meshes_loading = 0;
+bool load_timer_pending = false;
+const int load_check_ms = 10;
+
+/* When 'init' started, for logging how long the first frame and the full
+ * scene took to show up
+ */
+double load_start = 0;
+bool first_frame_logged = false;
+bool full_scene_logged = false;
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-/* The following are parameters for creating an interactive first-person camera
- * view of the scene. The variables will make more sense when explained in
- * context, so you should just look at the 'mousePressed', 'mouseMoved', and
- * 'keyPressed' functions for the details.
+/* The following struct is one entry of the render queue that 'draw_objects'
+ * builds every frame. The 'key' packs the object's mesh id into the top 16
+ * bits, the instance's material id into the next 16 bits, and its depth into
+ * the low 32 bits, so sorting by key groups draws by mesh, then by material,
+ * then front to back.
  */
+struct Draw_Item
+{
+    uint64_t key;
+    Object *obj;
+    Instance *inst;
 
-int mouse_x, mouse_y;
-float mouse_scale_x, mouse_scale_y;
+    /* The instance's bounding sphere in world space */
+    float world_center[3];
+    float world_radius;
+};
 
-const float step_size = 0.2;
-const float x_view_step = 90.0, y_view_step = 90.0;
-float x_view_angle = 0, y_view_angle = 0;
+/* Counters filled in by 'draw_objects' for the most recent frame. Press 'i'
+ * to print them.
+ */
+struct Render_Stats
+{
+    int instances = 0;
+    int culled = 0;
+    int draw_calls = 0;
+    int mesh_binds = 0;
+    int material_changes = 0;
+    int lights_binned = 0;
+    int light_tile_pairs = 0;
+    int light_object_pairs = 0;
+    int chunks_drawn = 0;
+    int chunks_culled = 0;
+    int chunks_over_budget = 0;
+    int64_t triangles_total = 0;
+    int64_t triangles_submitted = 0;
+    int clusters_backface = 0;
+    int clusters_frustum = 0;
+    int occluders = 0;
+    int occluder_triangles = 0;
+    int occluded = 0;
+    double occlusion_ms = 0;
+    /* Time spent queueing and culling instances, before sorting and drawing */
+    double cull_ms = 0;
+    /* Scene graph nodes whose world matrices were brought up to date, and
+     * the instances under them
+     */
+    int nodes_updated = 0;
+    int instances_moved = 0;
+};
 
-bool is_pressed = false;
-bool wireframe_mode = false;
+/* Kept between frames so the queue does not reallocate every frame */
+vector<Draw_Item> render_queue;
+Render_Stats render_stats;
+/* The index ranges 'draw_meshlets' hands to 'glMultiDrawElements' */
+vector<GLsizei> meshlet_counts;
+vector<const GLvoid *> meshlet_offsets;
+
+/* One level of the coarse depth buffer that 'cull_occluded' draws the
+ * largest instances into. Level 0 is 'occlusion_width' pixels wide, and
+ * every next level has half the width and height and holds the farthest
+ * depth of the pixels it covers. Depths are distances in front of the
+ * camera, with INFINITY where nothing was drawn.
+ */
+struct Depth_Level
+{
+    int width;
+    int height;
+    vector<float> depth;
+};
+
+/* A triangle of an occluder in depth buffer pixels, with the depth of its
+ * farthest corner, or a negative depth for a triangle that is not drawn.
+ */
+struct Screen_Triangle
+{
+    float x[3];
+    float y[3];
+    float depth;
+};
+
+const int occlusion_width = 256;
+const int max_occluders = 8;
+/* Whether 'cull_occluded' runs; 'o' switches it to compare */
+bool occlusion_culling = true;
+vector<Depth_Level> occlusion_levels;
+vector<Screen_Triangle> occluder_triangles;
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-/* The following function prototypes are for helper functions that parse the given 
- * format file to extract all the scene data and populate our map of objects.
- *
- * Details of the function will be given in its implementation further below.
+/* The following structs mirror the data our GLSL Phong shader reads (see
+ * 'init_shaders'). Materials go in a uniform block following the "std140"
+ * layout rules, and lights go in a texture buffer as two RGBA texels each,
+ * which is why every color is padded to 4 floats. The spare 4th float of the
+ * specular color carries the shininess, and the spare 4th float of a light
+ * color carries the light's attenuation k.
+ */
+struct Material_Block
+{
+    GLfloat ambient[4];
+    GLfloat diffuse[4];
+    GLfloat specular[4];
+};
+
+/* An instance's reflectances and shininess, compared to find instances
+ * that share a material; see 'assign_material_ids'.
  */
+typedef array<float, 10> Material_Key;
+
+struct Light_Block
+{
+    /* Camera space position, updated every frame by 'update_light_block' */
+    GLfloat position[4];
+    GLfloat color[4];
+};
+
+/* The uniform block binding point the shader reads materials from */
+const GLuint material_binding = 1;
+
+/* One entry per material id handed out by 'assign_material_ids' */
+vector<Material_Block> materials;
 
-void parseFormatFile(string filename);
+GLuint phong_program = 0;
+GLuint materials_ubo = 0;
+/* Bytes between consecutive materials in 'materials_ubo' */
+GLint material_stride = 0;
+
+/* Whether we shade with the Phong shader or with fixed-function Gouraud */
+bool phong_mode = false;
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-/* From here on are all the function implementations.
+/* The following are used for tiled light culling in the Phong shader.
+ *
+ * Every frame, 'update_light_block' splits the window into squares of
+ * 'tile_size' pixels and lists, for each tile, the lights whose sphere of
+ * influence (see 'light_radius') covers part of it. Each pixel then only
+ * loops over the lights of its own tile, so scenes can have hundreds of
+ * lights that each only light a small part of the screen.
+ *
+ * The lists are sent to the shader through three texture buffers:
+ * - 'light_data_tbo' holds every light as two RGBA texels (a 'Light_Block'),
+ * - 'tile_ranges_tbo' holds an (offset, count) pair for each tile, and
+ * - 'tile_indices_tbo' holds the light indices of all tiles back to back.
  */
- 
+const int tile_size = 16;
 
-/* 'init' function:
- * 
- * As you would expect, the 'init' function initializes and sets up the
- * program. It should always be called before anything else.
+/* A light whose contribution drops below this fraction of its color is
+ * treated as having no effect from that distance on. Set with the
+ * '-light_cutoff' command line option.
+ */
+float light_cutoff = 1.0f / 256.0f;
+
+/* The texture units the three texture buffers are bound to */
+const GLint light_data_unit = 1;
+const GLint tile_ranges_unit = 2;
+const GLint tile_indices_unit = 3;
+
+GLuint light_data_buffer = 0, light_data_tbo = 0;
+GLuint tile_ranges_buffer = 0, tile_ranges_tbo = 0;
+GLuint tile_indices_buffer = 0, tile_indices_tbo = 0;
+GLint tiles_x_location = -1;
+
+/* The size of the program window, kept up to date by 'reshape' */
+int window_width = 1, window_height = 1;
+
+/* Per-tile light lists, kept between frames to avoid reallocating them */
+vector<vector<GLint> > tile_lights;
+
+/* The lights 'select_lights' found for the last instance, kept for the same reason */
+vector<pair<float, int> > reaching_lights;
+
+/* A call of 'parallel_for' waiting for its chunks to be run. 'next_chunk'
+ * and 'chunks_done' are guarded by 'worker_mutex', like the queue.
+ */
+struct Parallel_Job
+{
+    const function<void(int, int)> *body;
+    int count, num_chunks;
+    int next_chunk, chunks_done;
+};
+
+/* The threads that run the chunks of every 'parallel_for' (see
+ * 'start_workers'), started on first use and kept until the program exits,
+ * and the jobs whose chunks are not all taken yet.
+ */
+deque<Parallel_Job *> parallel_jobs;
+bool workers_stopping = false;
+mutex worker_mutex;
+condition_variable job_ready, job_done;
+vector<thread> workers;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* The following are used by the frame scheduler in 'request_redraw'.
  *
- * Writing an 'init' function is not required by OpenGL. If you wanted to, you
- * could just put all your initializations in the beginning of the 'main'
- * function instead. However, doing so is bad style; it is cleaner to have all
- * your initializations contained within one function.
- * 
- * Before we go into the function itself, it is important to mention that
- * OpenGL works like a state machine. It will do different procedures depending
- * on what state it is in.
+ * Nothing is redrawn unless something changed: input handlers call
+ * 'request_redraw', which renders the next frame at most once per refresh
+ * period and otherwise leaves GLUT asleep waiting for events. In benchmark
+ * mode frames are instead rendered back to back as fast as possible.
+ */
+double refresh_rate = 60.0;
+bool benchmark_mode = false;
+
+/* Whether a redraw was requested and not yet rendered, when it was
+ * requested, and whether a timer to render it is already waiting
+ */
+bool redraw_pending = false;
+double redraw_request_time = 0;
+bool redraw_timer_pending = false;
+
+/* When the last frame started, and the frames and dropped frames counted
+ * since 'report_start' for the once-a-second frame rate report
+ */
+double last_frame_time = -1e9;
+double report_start = 0;
+int report_frames = 0;
+int report_dropped = 0;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* The following are used for rendering into a framebuffer object without a
+ * window and writing the frames to image files (see 'render_offscreen').
  *
- * For instance, OpenGL has different states for its shading procedure. By
- * default, OpenGL is in "flat shading state", meaning it will always use flat
- * shading when we tell it to render anything. With some syntax, we can change
- * the shading procedure from the "flat shading state" to the "Gouraud shading
- * state", and then OpenGL will render everything using Gouraud shading.
+ * 'render_prefix' is set with the '-render' command line option and the
+ * images are named '<render_prefix>_0000.ppm' and so on ('.png' with
+ * '-format png'). If an orientations file is given with '-orientations', one
+ * image is rendered for each ArcBall orientation in it. With '-turntable n',
+ * n images are rendered with the scene turned evenly about the y-axis.
+ * Otherwise a single image is rendered.
+ */
+bool offscreen_mode = false;
+string render_prefix;
+string orientations_file;
+int turntable_frames = 0;
+bool png_format = false;
+
+/* A rendered frame waiting to be written to an image file. 'pixels' holds
+ * the RGBA pixels as OpenGL read them, bottom row first.
+ */
+struct Encode_Job
+{
+    string filename;
+    int width, height;
+    vector<GLubyte> pixels;
+};
+
+/* The frames waiting for an encoder thread, and the pixel vectors of frames
+ * already written, kept to be reused for later frames. At most
+ * 'max_queued_frames' frames wait at once so a slow disk cannot use up all
+ * of our memory; 'render_offscreen' waits for room in the queue instead.
+ */
+deque<Encode_Job> encode_queue;
+vector<vector<GLubyte> > free_pixels;
+int max_queued_frames = 0;
+bool encoders_stopping = false;
+mutex encode_mutex;
+condition_variable encode_ready, encode_room;
+vector<thread> encoders;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* The following are used by '-bench', which times the stages of loading
+ * and drawing scenes and writes the results to a JSON file (see
+ * 'run_benchmarks').
  *
- * The most important task of the 'init' function is to set OpenGL to the
- * states that we want it to be in.
+ * Every stage is run 'bench_warmup' times untimed, so caches and drivers
+ * settle, and then 'bench_repetitions' times timed.
+ */
+int bench_warmup = 3;
+int bench_repetitions = 20;
+
+/* The timed runs of one stage. Each run does 'iterations' calls of the
+ * function being measured, for functions too quick to time one call of.
  */
-void init(string filename)
+struct Bench_Stage
 {
-    /* Extracts all information from format file entered in command line */
-    parseFormatFile(filename);
+    string name;
+    int iterations = 1;
+    vector<double> samples_ms;
+    /* Heap allocations per run, on average, or -1 if they were not counted */
+    double allocations = -1;
+};
 
-    /* Rotation Quarternion Initializations */
-    last_rotation = getIdentityQuarternion();
-    curr_rotation = getIdentityQuarternion();
+///////////////////////////////////////////////////////////////////////////////////////////////////
 
-    /* The following line of code tells OpenGL to use "smooth shading" (aka
-     * Gouraud shading) when rendering.
-     *
-     * Yes. This is actually all you need to do to use Gouraud shading in
-     * OpenGL (besides providing OpenGL the vertices and normals to render).
-     * Short and sweet, right?
-     *
-     * If you wanted to tell OpenGL to use flat shading at any point, then you
+/* The following are used to stream the chunks of ".chunks" meshes.
+ *
+ * Chunks are uploaded to buffer objects when an instance needs them and
+ * stay there as long as the total size of the uploaded chunks fits in
+ * 'chunk_budget' bytes (set in megabytes with '-chunk_budget'). To make
+ * room, the chunk that was drawn longest ago is dropped. Chunks drawn in the
+ * current frame are never dropped; if they alone fill the budget, the
+ * remaining chunks are skipped for that frame.
+ *
+ * The counters add up over the whole run and are printed with 'i'.
+ */
+const int triangles_per_chunk = 2048;
+size_t chunk_budget = 256 << 20;
+size_t chunk_bytes_resident = 0;
+int frame_number = 0;
+
+uint64_t chunk_hits = 0, chunk_misses = 0, chunk_evictions = 0;
+uint64_t chunk_bytes_streamed = 0;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* The following are used to reload the scene when its files change, which
+ * the '-watch' command line option turns on.
+ *
+ * A background thread ('watch_scene') waits for inotify to report that the
+ * scene file or one of its OBJ files was written, parses the scene again
+ * into 'pending_scene', and leaves it for the main thread, which checks
+ * for it a few times a second ('check_reload') and swaps it in between
+ * frames. 'loaded_mesh_files' tells the background thread which meshes
+ * (by 'mesh_key') the shown scene already has, and from which files, so it
+ * only reads the ones that changed; 'loaded_scene_files' lists the scene
+ * files to watch.
+ *
+ * 'stop_watching' ends the thread when the program exits by writing to
+ * 'watch_stop_fd', which the thread polls along with inotify.
+ */
+bool watch_mode = false;
+string scene_filename;
+const int reload_check_ms = 250;
+thread watcher;
+int watch_stop_fd = -1;
+mutex reload_mutex;
+unique_ptr<Scene_Data> pending_scene;
+map<string, string> loaded_mesh_files;
+vector<string> loaded_scene_files;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* The following keep every scene listed on the command line loaded at once,
+ * so that switching between them (with the number keys, or '[' and ']')
+ * does not read anything again.
+ *
+ * The scenes are parsed at the same time when the viewer starts. Each one
+ * stays in its 'Scene_Slot' with its lights, camera and instances, and the
+ * materials 'assign_material_ids' numbered for it the first time it was
+ * shown. The meshes of all of them are kept uploaded in 'objects', once
+ * each; the objects of the shown scene point at its instances, and the
+ * other objects have none. So showing a resident scene only has to point
+ * the objects at its instances and upload its materials.
+ *
+ * When the meshes and instances of the resident scenes need more than
+ * 'scene_budget' bytes, the scenes shown longest ago are evicted: their
+ * instances are freed along with any mesh no other resident scene uses
+ * (see 'enforce_scene_budget'). An evicted scene is read again when it is
+ * next shown.
+ */
+struct Scene_Slot
+{
+    string filename;
+    unique_ptr<Scene_Data> scene;
+    vector<Material_Block> materials;
+    int ground_material = -1;
+    int last_shown = 0;
+};
+vector<Scene_Slot> scene_slots;
+int shown_scene = 0;
+int scenes_shown = 0;
+size_t scene_budget = (size_t) 1024 << 20;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* The following are used by the memory report printed once the scenes
+ * have loaded and whenever 'm' is pressed (see 'print_memory_report').
+ *
+ * While 'parseObjFile' reads a file it holds every position and normal of
+ * the file, and where each corner came from, in lists of its own that go
+ * away once the mesh is built. 'parse_scratch_peak' is the most any one
+ * file needed, which is memory a load needs on top of the mesh itself.
+ * 'load_peak_rss' is the peak resident memory of the process when every
+ * mesh had first loaded.
+ */
+size_t parse_scratch_peak = 0;
+mutex parse_scratch_mutex;
+size_t load_peak_rss = 0;
+
+/* In the 'opengl_bench' build ("make bench" defines OPENGL_BENCH), every
+ * 'new' of the program is counted here, which is how '-bench' shows how
+ * many heap allocations a stage makes. The viewer itself keeps the standard
+ * allocator.
+ *
+ * The array, nothrow and sized forms are replaced too, each passing on to
+ * the plain or aligned form, so that no allocation is missed whichever
+ * form the standard library picks.
+ */
+#ifdef OPENGL_BENCH
+atomic<uint64_t> heap_allocations(0);
+
+void *operator new(size_t size)
+{
+    heap_allocations.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(size > 0 ? size : 1);
+    if (p == NULL) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void *operator new(size_t size, align_val_t alignment)
+{
+    heap_allocations.fetch_add(1, memory_order_relaxed);
+    size_t align = max((size_t) alignment, sizeof(void *));
+    void *p = NULL;
+    if (posix_memalign(&p, align, size > 0 ? size : 1) != 0) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, align_val_t alignment) noexcept
+{
+    free(p);
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new[](size_t size, align_val_t alignment) { return operator new(size, alignment); }
+
+void *operator new(size_t size, const nothrow_t &) noexcept
+{
+    try {
+        return operator new(size);
+    } catch (const bad_alloc &) {
+        return NULL;
+    }
+}
+
+void *operator new[](size_t size, const nothrow_t &) noexcept
+{
+    return operator new(size, nothrow);
+}
+
+void *operator new(size_t size, align_val_t alignment, const nothrow_t &) noexcept
+{
+    try {
+        return operator new(size, alignment);
+    } catch (const bad_alloc &) {
+        return NULL;
+    }
+}
+
+void *operator new[](size_t size, align_val_t alignment, const nothrow_t &) noexcept
+{
+    return operator new(size, alignment, nothrow);
+}
+
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t size) noexcept { free(p); }
+void operator delete[](void *p, size_t size) noexcept { free(p); }
+void operator delete[](void *p, align_val_t alignment) noexcept { free(p); }
+void operator delete(void *p, size_t size, align_val_t alignment) noexcept { free(p); }
+void operator delete[](void *p, size_t size, align_val_t alignment) noexcept { free(p); }
+void operator delete(void *p, const nothrow_t &) noexcept { free(p); }
+void operator delete[](void *p, const nothrow_t &) noexcept { free(p); }
+void operator delete(void *p, align_val_t alignment, const nothrow_t &) noexcept { free(p); }
+void operator delete[](void *p, align_val_t alignment, const nothrow_t &) noexcept { free(p); }
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* Quarternions that control ArcBall Rotations
+ */
+Quarternion last_rotation;
+Quarternion curr_rotation;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* The following are parameters for creating an interactive first-person camera
+ * view of the scene. The variables will make more sense when explained in
+ * context, so you should just look at the 'mousePressed', 'mouseMoved', and
+ * 'keyPressed' functions for the details.
+ */
+
+int mouse_x, mouse_y;
+float mouse_scale_x, mouse_scale_y;
+
+const float step_size = 0.2;
+const float x_view_step = 90.0, y_view_step = 90.0;
+float x_view_angle = 0, y_view_angle = 0;
+
+bool is_pressed = false;
+bool wireframe_mode = false;
+/* Whether 'draw_meshlets' culls clusters; 'c' switches it to compare */
+bool cluster_culling = true;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* The following function prototypes are for helper functions that parse the given 
+ * format file to extract all the scene data and populate our map of objects.
+ *
+ * Details of the function will be given in its implementation further below.
+ */
+
+void parseFormatFile(string filename, Scene_Data &scene,
+                     const map<string, string> &loaded_meshes, bool read_meshes);
+void parse_scene_text(const string &filename, Scene_Parse &parse, Object_Names &names,
+                      Node_Names &nodes, bool library);
+string scene_path(const string &directory, const string &path);
+string mesh_key(const string &filename);
+bool map_file(const string &filename, Mapped_File &file, bool writable);
+bool read_file(const string &filename, string &text);
+bool next_scene_line(const string &filename, const char *&pos, const char *end,
+                     Scene_Line &line);
+bool field_is(const Scene_Line &line, int i, const char *word);
+void scene_error(const string &filename, const Scene_Line &line, int i, const string &msg);
+bool parse_short_float(const char *p, const char *end, float &value);
+void read_floats(const string &filename, const Scene_Line &line, int count, float *values);
+void parseObjFile(string filename, Object &obj);
+void count_obj_records(ifstream &file, Obj_Counts &counts);
+Object &read_scene_object(const string &filename, Scene_Data &scene,
+                          const map<string, string> &loaded_meshes, bool read_meshes);
+bool has_extension(const string &filename, const string &extension);
+void read_scene_file(string filename, Scene_Data &scene,
+                     const map<string, string> &loaded_meshes, bool read_meshes);
+void open_binary_scene(string filename, Scene_Data &scene,
+                       const map<string, string> &loaded_meshes, bool read_meshes);
+void convert_scene(string text_filename, string binary_filename);
+int parse_obj_index(string_view field, int count);
+void generate_normals(Object &obj, size_t first_corner, const vector<GLuint> &corner_vertices,
+                      int num_vertices, const vector<char> &has_normal);
+
+/* The following function prototypes are for helper functions that swap a
+ * parsed scene in and reload it when its files change.
+ */
+
+int swap_in_scene(unique_ptr<Scene_Data> scene);
+int add_scene_meshes(Scene_Data &scene);
+void show_scene(int index, bool keep_camera);
+void switch_scene(int index);
+void release_unused_meshes();
+void enforce_scene_budget();
+size_t mesh_bytes(const Object &obj);
+void release_object(Object &obj);
+bool mesh_ready(const Object &obj);
+void load_mesh_file(string filename, Object &obj);
+void create_placeholder_box(Object &obj);
+void load_mesh_async(const string &key, const Object &obj);
+void load_meshes();
+void stop_loaders();
+int upload_loaded_meshes();
+void check_loads(int value);
+void finish_loading();
+void log_load_times();
+void start_watching();
+void watch_scene(int inotify_fd);
+void stop_watching();
+void check_reload(int value);
+
+/* The following function prototypes are for helper functions that build the
+ * ground mesh and copy object geometry into OpenGL buffer objects.
+ */
+
+void create_ground_sphere(Object &obj, float radius, int slices, int stacks);
+void weld_vertices(const vector<Triple> &verts, vector<GLuint> &shared);
+void build_edge_buffer(Object &obj);
+void morton_order(const vector<Triple> &verts, vector<GLuint> &order);
+void build_meshlets(Object &obj);
+void draw_meshlets(Object &obj);
+void cull_occluded(const Matrix4f &view);
+void compute_bounds(Object &obj);
+void upload_object(Object &obj);
+
+/* The following function prototypes are for helpers that prepare instances
+ * for the render queue in 'draw_objects'.
+ */
+
+void bake_transforms(const vector<Transform> &transforms, Instance &inst);
+void bake_transforms(const vector<Transform> &transforms, GLfloat *model_out);
+void assign_material_ids();
+void number_material(map<Material_Key, int> &ids, Instance &inst);
+void print_render_stats();
+
+/* The following function prototypes are for the scene graph, which places
+ * instances under nodes that can be moved.
+ */
+
+void build_scene_graph(const pmr::vector<Parsed_Node> &nodes, vector<Node_Instance> &attached,
+                       Scene_Graph &graph);
+void set_node_transform(Scene_Graph &graph, int node, const Matrix4f &local);
+void update_scene_graph(Scene_Graph &graph);
+void update_subtree(Scene_Graph &graph, int node);
+void animate_nodes(Scene_Graph &graph, double seconds);
+size_t scene_graph_bytes(const Scene_Graph &graph);
+
+/* The following function prototypes are for the memory report.
+ */
+
+size_t object_cpu_bytes(const Object &obj);
+size_t object_gpu_bytes(const Object &obj);
+size_t peak_rss_bytes();
+size_t current_rss_bytes();
+string format_bytes(size_t bytes);
+void print_memory_report();
+
+/* The following function prototypes are for chunked, streamed meshes.
+ */
+
+void convert_to_chunks(string obj_filename, string chunk_filename);
+void open_chunked_mesh(string filename, Object &obj);
+GLuint use_chunk(Chunked_Mesh &mesh, uint32_t i);
+void evict_chunk(Chunked_Mesh &mesh, uint32_t i);
+void release_chunks(Chunked_Mesh &mesh);
+void draw_chunked_object(Object &obj);
+
+/* The following function prototypes are for the GLSL Phong shading path.
+ */
+
+void init_shaders();
+void upload_materials();
+void update_light_block();
+
+float light_radius(const Point_Light &light);
+void parallel_for(int count, const function<void(int, int)> &body);
+void start_workers();
+void run_workers();
+bool run_chunk(Parallel_Job &job, unique_lock<mutex> &lock);
+void stop_workers();
+
+/* The following function prototypes are for the frame scheduler.
+ */
+
+double now_seconds();
+void redraw_timer(int value);
+void benchmark_idle();
+void begin_frame();
+void set_swap_interval(int interval);
+
+/* The following function prototypes are for rendering to image files.
+ */
+
+bool create_offscreen_context();
+void start_offscreen();
+void read_orientations(string filename, vector<Quarternion> &orientations);
+void write_ppm(const string &filename, int width, int height, const GLubyte *pixels);
+void write_png(const string &filename, int width, int height, const GLubyte *pixels);
+void start_encoders(int count);
+void encode_frames();
+void submit_frame(const string &filename, int width, int height, const GLubyte *pixels);
+void stop_encoders();
+void create_framebuffer(int width, int height);
+void render_offscreen(string filename, int width, int height);
+
+/* The following function prototypes are for the '-bench' benchmarks.
+ */
+
+void time_stage(Bench_Stage &stage, const function<void()> &body);
+double percentile(vector<double> samples, double fraction);
+string json_string(const string &text);
+void write_bench_stages(ostream &out, const vector<Bench_Stage> &stages, const string &indent);
+void run_benchmarks(string json_filename, const vector<string> &filenames);
+
+void load_light(int slot, int i);
+void select_lights(const Draw_Item &item);
+
+float deg2rad(float angle);
+float rad2deg(float angle);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* From here on are all the function implementations.
+ */
+ 
+
+/* 'init' function:
+ * 
+ * As you would expect, the 'init' function initializes and sets up the
+ * program. It should always be called before anything else.
+ *
+ * Writing an 'init' function is not required by OpenGL. If you wanted to, you
+ * could just put all your initializations in the beginning of the 'main'
+ * function instead. However, doing so is bad style; it is cleaner to have all
+ * your initializations contained within one function.
+ * 
+ * Before we go into the function itself, it is important to mention that
+ * OpenGL works like a state machine. It will do different procedures depending
+ * on what state it is in.
+ *
+ * For instance, OpenGL has different states for its shading procedure. By
+ * default, OpenGL is in "flat shading state", meaning it will always use flat
+ * shading when we tell it to render anything. With some syntax, we can change
+ * the shading procedure from the "flat shading state" to the "Gouraud shading
+ * state", and then OpenGL will render everything using Gouraud shading.
+ *
+ * The most important task of the 'init' function is to set OpenGL to the
+ * states that we want it to be in.
+ */
+void init(const vector<string> &filenames)
+{
+    /* Extracts all information from the format files entered in command
+     * line, parsing them all at the same time. The OBJ files are left for
+     * background threads to read, and their objects are drawn as
+     * placeholder boxes until they are done.
+     */
+    load_start = now_seconds();
+    scene_slots.resize(filenames.size());
+    vector<exception_ptr> errors(filenames.size());
+    parallel_for(filenames.size(), [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            scene_slots[i].filename = filenames[i];
+            scene_slots[i].scene.reset(new Scene_Data());
+            try {
+                read_scene_file(filenames[i], *scene_slots[i].scene, map<string, string>(), false);
+            } catch (...) {
+                errors[i] = current_exception();
+            }
+        }
+    });
+    for (size_t i = 0; i < errors.size(); ++i) {
+        if (errors[i]) {
+            rethrow_exception(errors[i]);
+        }
+    }
+    scene_filename = filenames[0];
+
+    /* Tessellates the ground sphere once instead of on every redraw. The
+     * ground sits 3 units below the origin and uses a plain grey material.
+     */
+    create_ground_sphere(ground, 100, 100, 100);
+
+    ground_instance = {{0.2f, 0.2f, 0.2f}, {0.6f, 0.6f, 0.6f},
+                       {0.0f, 0.0f, 0.0f}, 1.0f};
+    Transform ground_offset = {translation, {0.0f, -103.0f, 0.0f, 0.0f}};
+    bake_transforms(vector<Transform>(1, ground_offset), ground_instance);
+    ground.instances = &ground_instance;
+    ground.instance_count = 1;
+    upload_object(ground);
+
+    create_placeholder_box(placeholder_box);
+    upload_object(placeholder_box);
+
+    /* Copies every mesh into OpenGL buffer objects and shows the first
+     * scene. See 'show_scene'.
+     */
+    for (size_t i = 0; i < scene_slots.size(); ++i) {
+        add_scene_meshes(*scene_slots[i].scene);
+    }
+    show_scene(0, false);
+
+    /* Rotation Quarternion Initializations */
+    last_rotation = getIdentityQuarternion();
+    curr_rotation = getIdentityQuarternion();
+
+    /* The following line of code tells OpenGL to use "smooth shading" (aka
+     * Gouraud shading) when rendering.
+     *
+     * Yes. This is actually all you need to do to use Gouraud shading in
+     * OpenGL (besides providing OpenGL the vertices and normals to render).
+     * Short and sweet, right?
+     *
+     * If you wanted to tell OpenGL to use flat shading at any point, then you
      * would use the following line:
      
        glShadeModel(GL_FLAT);
@@ -479,6 +1668,13 @@ void init(string filename)
      * the code more organized.
      */
     init_lights();
+
+    /* Compiles our Phong shader and fills its uniform buffers. If the shader
+     * does not compile, we keep using the fixed-function Gouraud shading.
+     */
+    init_shaders();
+    upload_materials();
+    phong_mode = (phong_program != 0);
 }
 
 /* 'reshape' function:
@@ -524,6 +1720,8 @@ void reshape(int width, int height)
      * to render them.
      */
     glViewport(0, 0, width, height);
+    window_width = width;
+    window_height = height;
     
     /* The following two lines are specific to updating our mouse interface
      * parameters. Details will be given in the 'mouse_moved' function.
@@ -531,11 +1729,11 @@ void reshape(int width, int height)
     mouse_scale_x = (float) (right_param - left_param) / (float) width;
     mouse_scale_y = (float) (top_param - bottom_param) / (float) height;
     
-    /* The following line tells OpenGL that our program window needs to
-     * be re-displayed, meaning everything that was being displayed on
-     * the window before it got resized needs to be re-rendered.
+    /* The following line tells our frame scheduler that our program window
+     * needs to be re-displayed, meaning everything that was being displayed
+     * on the window before it got resized needs to be re-rendered.
      */
-    glutPostRedisplay();
+    request_redraw();
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -544,9 +1742,9 @@ void reshape(int width, int height)
 
 float screenToNDC(int coord, bool x) {
     if (x) {
-        return ( (2.0f * coord) / glutGet(GLUT_INIT_WINDOW_WIDTH) - 0.5f) * (right_param - left_param) + left_param;
+        return ( (2.0f * coord) / window_width - 0.5f) * (right_param - left_param) + left_param;
     }
-    return top_param - ( (2.0f * coord) / glutGet(GLUT_INIT_WINDOW_HEIGHT) - 0.5f) * (top_param - bottom_param);
+    return top_param - ( (2.0f * coord) / window_height - 0.5f) * (top_param - bottom_param);
 }
 
 float getZNDC(float x, float y) {
@@ -619,6 +1817,23 @@ void applyArcBallRotation(void)
     glMultMatrixf(rot);
 }
 
+/* Returns the ArcBall rotation that turns the scene by 'angle' radians about
+ * the axis (x, y, z). 'applyArcBallRotation' turns the scene the opposite way
+ * from the usual quarternion convention, so the imaginary part is negated.
+ */
+Quarternion axisAngleQuarternion(float x, float y, float z, float angle)
+{
+    Vector3f axis (x, y, z);
+    axis.normalize();
+    float sin_half = sin(0.5f * angle);
+    Quarternion q;
+    q.real = cos(0.5f * angle);
+    q.im.x = -axis[0] * sin_half;
+    q.im.y = -axis[1] * sin_half;
+    q.im.z = -axis[2] * sin_half;
+    return q;
+}
+
 //////////////////////////////////////////////////////////////////////////
 
 
@@ -634,6 +1849,13 @@ void applyArcBallRotation(void)
  */
 void display(void)
 {
+    /* Let the frame scheduler know a frame is starting so it can keep track
+     * of the frame rate. Frames rendered to image files are not paced.
+     */
+    if (!offscreen_mode) {
+        begin_frame();
+    }
+
     /* The following line of code is typically the first line of code in any
      * 'display' function. It tells OpenGL to reset the "color buffer" (which
      * is our pixel grid of RGB values) and the depth buffer.
@@ -752,15 +1974,38 @@ void display(void)
      *
      * The reason we have this procedure as a separate function is to make
      * the code more organized.
+     *
+     * With the Phong shader, the lights live in a texture buffer instead, and
+     * 'update_light_block' moves them into camera space and sorts them into
+     * screen tiles for the shader.
      */
-    set_lights();
+    render_stats = Render_Stats();
+    if (phong_mode) {
+        glUseProgram(phong_program);
+        update_light_block();
+    } else {
+        glUseProgram(0);
+        set_lights();
+    }
     /* Once the lights are set, we can specify the points and faces that we
      * want drawn. We do all this in our 'draw_objects' helper function. See
      * the function for more details.
      *
      * The reason we have this procedure as a separate function is to make
      * the code more organized.
+     *
+     * Before that, the spinning nodes of the scene graph are turned to where
+     * they are now, and the instances under every node that moved are moved
+     * with it. Images rendered to files show the scene as the file places it.
      */
+    if (!scene_slots.empty() && scene_slots[shown_scene].scene) {
+        Scene_Graph &graph = scene_slots[shown_scene].scene->graph;
+        if (!offscreen_mode && !graph.spins.empty()) {
+            animate_nodes(graph, now_seconds() - load_start);
+            request_redraw();
+        }
+        update_scene_graph(graph);
+    }
     draw_objects();
     
     /* The following line of code has OpenGL do what is known as "double
@@ -798,121 +2043,2373 @@ void display(void)
      *
      * The following function, 'glutSwapBuffers', tells OpenGL to swap the
      * active and off-screen buffers.
+     *
+     * When rendering to image files there is no window, and 'render_offscreen'
+     * reads the frame back from its framebuffer object instead.
      */
-    glutSwapBuffers();
+    if (!offscreen_mode) {
+        glutSwapBuffers();
+    }
+    log_load_times();
 }
 
-/* 'init_lights' function:
- * 
- * This function has OpenGL enable its built-in lights to represent our point
- * lights.
- *
- * OpenGL has 8 built-in lights in all, each one with its own unique, integer
- * ID value. When setting the properties of a light, we need to tell OpenGL
- * the ID value of the light we are modifying.
- * 
- * The first light's ID value is stored in 'GL_LIGHT0'. The second light's ID
- * value is stored in 'GL_LIGHT1'. And so on. The eighth and last light's ID
- * value is stored in 'GL_LIGHT7'.
+/* 'now_seconds' function:
  *
- * The properties of the lights are set using the 'glLightfv' and 'glLightf'
- * functions as you will see below.
+ * Returns the time in seconds on a clock that never jumps backwards.
  */
-void init_lights()
+double now_seconds()
 {
-    /* The following line of code tells OpenGL to enable lighting calculations
-     * during its rendering process. This tells it to automatically apply the
-     * Phong reflection model or lighting model to every pixel it will render.
-     */
-    glEnable(GL_LIGHTING);
-    
-    int num_lights = lights.size();
-    
-    for(int i = 0; i < num_lights; ++i)
-    {
-        /* In this loop, we are going to associate each of our point lights
-         * with one of OpenGL's built-in lights. The simplest way to do this
-         * is to just let our first point light correspond to 'GL_LIGHT0', our
-         * second point light correspond to 'GL_LIGHT1', and so on. i.e. let:
-         * 
-         * 'lights[0]' have an ID value of 'GL_LIGHT0'
-         * 'lights[1]' have an ID value of 'GL_LIGHT1'
-         * etc...
-         */
-        int light_id = GL_LIGHT0 + i;
-        
-        glEnable(light_id);
-        
-        /* The following lines of code use 'glLightfv' to set the color of
-         * the light. The parameters for 'glLightfv' are:
-         *
-         * - enum light_ID: an integer between 'GL_LIGHT0' and 'GL_LIGHT7'
-         * - enum property: this varies depending on what you are setting
-         *                  e.g. 'GL_AMBIENT' for the light's ambient component
-         * - float* values: a set of values to set for the specified property
-         *                  e.g. an array of RGB values for the light's color
-         * 
-         * OpenGL actually lets us specify different colors for the ambient,
-         * diffuse, and specular components of the light. However, since we
-         * are used to only working with one overall light color, we will
-         * just set every component to the light color.
-         */
-        glLightfv(light_id, GL_AMBIENT, lights[i].color);
-        glLightfv(light_id, GL_DIFFUSE, lights[i].color);
-        glLightfv(light_id, GL_SPECULAR, lights[i].color);
-        
-        /* The following line of code sets the attenuation k constant of the
-         * light. The difference between 'glLightf' and 'glLightfv' is that
-         * 'glLightf' is used for when the parameter is only one value like
-         * the attenuation constant while 'glLightfv' is used for when the
-         * parameter is a set of values like a color array. i.e. the third
-         * parameter of 'glLightf' is just a float instead of a float*.
-         */
-        glLightf(light_id, GL_QUADRATIC_ATTENUATION, lights[i].attenuation_k);
-    }
+    return chrono::duration<double>(
+        chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-/* 'set_lights' function:
+/* 'request_redraw' function:
  *
- * While the 'init_lights' function enables and sets the colors of the lights,
- * the 'set_lights' function is supposed to position the lights.
+ * Asks for the scene to be redrawn because something about it changed.
  *
- * You might be wondering why we do not just set the positions of the lights in
- * the 'init_lights' function in addition to the other properties. The reason
- * for this is because OpenGL does lighting computations after it applies the
- * Modelview Matrix to points. This means that the lighting computations are
- * effectively done in camera space. Hence, to ensure that we get the correct
- * lighting computations, we need to make sure that we position the lights
- * correctly in camera space.
- * 
- * Now, the 'glLightfv' function, when used to position a light, applies all
- * the current Modelview Matrix to the given light position. This means that
- * to correctly position lights in camera space, we should call the 'glLightfv'
- * function to position them AFTER the Modelview Matrix has been modified by
- * the necessary camera transformations. As you can see in the 'display'
- * function, this is exactly what we do.
+ * Calling 'glutPostRedisplay' directly would redraw once per input event,
+ * and mouse motion can arrive much faster than the display refreshes. So
+ * if the last frame started less than a refresh period ago, we set a timer
+ * for the start of the next period instead. Requests that come in before
+ * then are merged into the one pending redraw.
+ *
+ * When nothing requests a redraw, no timer is set and GLUT just sleeps
+ * until the next event, so an idle viewer uses no CPU.
  */
-void set_lights()
+void request_redraw()
 {
-    int num_lights = lights.size();
-    
-    for(int i = 0; i < num_lights; ++i)
-    {
-        int light_id = GL_LIGHT0 + i;
-        
-        glLightfv(light_id, GL_POSITION, lights[i].position);
+    if (offscreen_mode || benchmark_mode || redraw_pending) {
+        return;
+    }
+    double now = now_seconds();
+    redraw_pending = true;
+    redraw_request_time = now;
+
+    double wait = last_frame_time + 1.0 / refresh_rate - now;
+    if (wait <= 0) {
+        glutPostRedisplay();
+    } else if (!redraw_timer_pending) {
+        redraw_timer_pending = true;
+        glutTimerFunc((unsigned int) ceil(wait * 1000.0), redraw_timer, 0);
     }
 }
 
-/* 'draw_objects' function:
+/* 'redraw_timer' function:
  *
- * This function has OpenGL render our objects to the display screen.
+ * Called by GLUT when the timer set in 'request_redraw' runs out.
  */
-void draw_objects()
-{   
-    for (map<string, Object>::iterator obj_iter = objects.begin(); 
-                                    obj_iter != objects.end(); obj_iter++) {
-        Object &obj = objects[obj_iter->first];
+void redraw_timer(int value)
+{
+    redraw_timer_pending = false;
+    if (redraw_pending) {
+        glutPostRedisplay();
+    }
+}
+
+/* 'benchmark_idle' function:
+ *
+ * Called by GLUT whenever it has no events to handle in benchmark mode, so
+ * that frames are rendered back to back.
+ */
+void benchmark_idle()
+{
+    glutPostRedisplay();
+}
+
+/* 'begin_frame' function:
+ *
+ * Called at the start of every frame to count frames and dropped frames,
+ * and to print the frame rate about once a second while frames are being
+ * rendered.
+ *
+ * A requested frame should start no later than one refresh period after
+ * the request (or after the previous frame, if that is later). Each whole
+ * refresh period it starts after that counts as one dropped frame.
+ */
+void begin_frame()
+{
+    double now = now_seconds();
+    double period = 1.0 / refresh_rate;
+
+    if (redraw_pending && !benchmark_mode) {
+        double due = max(redraw_request_time, last_frame_time + period);
+        double late = now - due;
+        if (late > period) {
+            report_dropped += (int) (late / period);
+        }
+    }
+    redraw_pending = false;
+
+    /* After the viewer has been idle we start a new report rather than
+     * averaging the idle time into the frame rate.
+     */
+    if (now - last_frame_time > 1.0) {
+        if (report_frames > 0) {
+            double elapsed = last_frame_time - report_start;
+            cout << "fps: " << (elapsed > 0 ? report_frames / elapsed : 0)
+                 << ", dropped frames: " << report_dropped << "\n";
+        }
+        report_start = now;
+        report_frames = 0;
+        report_dropped = 0;
+    } else {
+        ++report_frames;
+        if (now - report_start >= 1.0) {
+            cout << "fps: " << report_frames / (now - report_start)
+                 << ", dropped frames: " << report_dropped << "\n";
+            report_start = now;
+            report_frames = 0;
+            report_dropped = 0;
+        }
+    }
+    last_frame_time = now;
+}
+
+/* 'set_swap_interval' function:
+ *
+ * Tells the driver how many display refreshes to wait for before each
+ * buffer swap: 1 syncs 'glutSwapBuffers' to the display refresh (vsync) and
+ * 0 lets it swap right away. GLUT has no call for this, so we look up the
+ * GLX extension functions that drivers provide for it. If none is found
+ * we keep the driver's default.
+ */
+void set_swap_interval(int interval)
+{
+    typedef int (*Swap_Interval_Func)(int);
+    const char *names[] = {"glXSwapIntervalMESA", "glXSwapIntervalSGI"};
+    for (const char *name : names) {
+        Swap_Interval_Func func = (Swap_Interval_Func)
+            glXGetProcAddressARB((const GLubyte *) name);
+        if (func != NULL) {
+            func(interval);
+            return;
+        }
+    }
+}
+
+/* 'create_offscreen_context' function:
+ *
+ * Makes an OpenGL context current without opening a window, so the viewer
+ * can render on machines with no display (Mesa's software renderer works
+ * fine for this). We ask EGL for Mesa's "surfaceless" platform first and
+ * fall back on the default EGL display.
+ *
+ * Returns false if no context could be created.
+ */
+bool create_offscreen_context()
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    EGLDisplay egl_display = EGL_NO_DISPLAY;
+    if (get_platform_display != NULL) {
+        egl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                           EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (egl_display == EGL_NO_DISPLAY) {
+        egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, NULL, NULL)
+        || !eglBindAPI(EGL_OPENGL_API)) {
+        return false;
+    }
+
+    /* We draw into our own framebuffer object, so the context needs no
+     * config or surface of its own.
+     */
+    EGLContext context = eglCreateContext(egl_display, EGL_NO_CONFIG_KHR,
+                                          EGL_NO_CONTEXT, NULL);
+    if (context == EGL_NO_CONTEXT) {
+        return false;
+    }
+    return eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+}
+
+/* 'start_offscreen' function:
+ *
+ * Makes an offscreen OpenGL context current and loads the OpenGL functions,
+ * for drawing without a window. Exits if it cannot.
+ *
+ * GLEW was built for windows made with GLX, so without an X display it
+ * reports that it found none, but it still loads the OpenGL functions.
+ */
+void start_offscreen()
+{
+    offscreen_mode = true;
+    if (!create_offscreen_context()) {
+        cerr << "Could not create an offscreen OpenGL context\n";
+        exit(1);
+    }
+    glewExperimental = GL_TRUE;
+    GLenum glew_status = glewInit();
+    if (glew_status != GLEW_OK && glew_status != GLEW_ERROR_NO_GLX_DISPLAY) {
+        cerr << "Could not initialize GLEW: " << glewGetErrorString(glew_status) << "\n";
+        exit(1);
+    }
+}
+
+/* 'read_orientations' function:
+ *
+ * Reads ArcBall orientations for 'render_offscreen', one per line, each
+ * written like the camera orientation in a scene file:
+ *
+ *     x y z angle
+ *
+ * which turns the scene by 'angle' radians about the axis (x, y, z).
+ * Blank lines and lines starting with '#' are skipped.
+ *
+ * @throws invalid_argument if it fails to read the file
+ */
+void read_orientations(string filename, vector<Quarternion> &orientations)
+{
+    ifstream file(filename);
+    if (file.fail()) {
+        throw invalid_argument("Could not read orientations file '" + filename + "'.");
+    }
+    string line;
+    while (getline(file, line)) {
+        istringstream stream(line);
+        string first;
+        if (!(stream >> first) || first[0] == '#') {
+            continue;
+        }
+        float y, z, angle;
+        if (!(stream >> y >> z >> angle)) {
+            throw invalid_argument("Orientations file '" + filename +
+                                   "' has a line that is not 'x y z angle'.");
+        }
+        orientations.push_back(axisAngleQuarternion(stof(first), y, z, angle));
+    }
+}
+
+/* 'write_ppm' function:
+ *
+ * Writes RGBA pixels read back from OpenGL to a binary PPM image. OpenGL
+ * gives us the bottom row first, so the rows are written in reverse.
+ *
+ * @throws invalid_argument if it fails to write the file
+ */
+void write_ppm(const string &filename, int width, int height, const GLubyte *pixels)
+{
+    ofstream file(filename, ios::binary);
+    if (file.fail()) {
+        throw invalid_argument("Could not write image file '" + filename + "'.");
+    }
+    file << "P6\n" << width << " " << height << "\n255\n";
+    vector<char> row(width * 3);
+    for (int y = height - 1; y >= 0; --y) {
+        const GLubyte *src = pixels + (size_t) y * width * 4;
+        for (int x = 0; x < width; ++x) {
+            row[3 * x] = src[4 * x];
+            row[3 * x + 1] = src[4 * x + 1];
+            row[3 * x + 2] = src[4 * x + 2];
+        }
+        file.write(row.data(), row.size());
+    }
+}
+
+/* 'write_png_chunk' function:
+ *
+ * Writes one chunk of a PNG file: its length, its 4 letter type, its data
+ * and a checksum of the type and data. PNG stores numbers big-endian.
+ */
+void write_png_chunk(ofstream &file, const char *type, const Bytef *data, uint32_t length)
+{
+    GLubyte header[8] = {(GLubyte) (length >> 24), (GLubyte) (length >> 16),
+                         (GLubyte) (length >> 8), (GLubyte) length,
+                         (GLubyte) type[0], (GLubyte) type[1],
+                         (GLubyte) type[2], (GLubyte) type[3]};
+    /* zlib treats a NULL buffer as a request for the starting checksum, so
+     * empty chunks must skip the second call
+     */
+    uLong crc = crc32(0, header + 4, 4);
+    if (length > 0) {
+        crc = crc32(crc, data, length);
+    }
+    GLubyte footer[4] = {(GLubyte) (crc >> 24), (GLubyte) (crc >> 16),
+                         (GLubyte) (crc >> 8), (GLubyte) crc};
+    file.write((const char *) header, 8);
+    file.write((const char *) data, length);
+    file.write((const char *) footer, 4);
+}
+
+/* 'write_png' function:
+ *
+ * Writes RGBA pixels read back from OpenGL to an 8-bit RGB PNG image. The
+ * image data of a PNG is its rows, top row first, each starting with a
+ * byte naming the filter applied to it (0 for none), compressed with zlib.
+ * We use zlib's fastest setting since the encoders should keep up with
+ * rendering.
+ *
+ * @throws invalid_argument if it fails to write the file
+ */
+void write_png(const string &filename, int width, int height, const GLubyte *pixels)
+{
+    size_t row_bytes = (size_t) width * 3 + 1;
+    vector<Bytef> rows(row_bytes * height);
+    for (int y = 0; y < height; ++y) {
+        Bytef *row = &rows[y * row_bytes];
+        const GLubyte *src = pixels + (size_t) (height - 1 - y) * width * 4;
+        row[0] = 0;
+        for (int x = 0; x < width; ++x) {
+            row[1 + 3 * x] = src[4 * x];
+            row[2 + 3 * x] = src[4 * x + 1];
+            row[3 + 3 * x] = src[4 * x + 2];
+        }
+    }
+    uLongf compressed_size = compressBound(rows.size());
+    vector<Bytef> compressed(compressed_size);
+    if (compress2(compressed.data(), &compressed_size, rows.data(), rows.size(),
+                  Z_BEST_SPEED) != Z_OK) {
+        throw invalid_argument("Could not compress image file '" + filename + "'.");
+    }
+
+    ofstream file(filename, ios::binary);
+    if (file.fail()) {
+        throw invalid_argument("Could not write image file '" + filename + "'.");
+    }
+    const char signature[8] = {'\x89', 'P', 'N', 'G', '\r', '\n', '\x1a', '\n'};
+    file.write(signature, 8);
+
+    /* Width, height, 8 bits per channel, RGB colors, and the standard
+     * compression, filtering and (no) interlacing methods
+     */
+    Bytef header[13] = {(Bytef) (width >> 24), (Bytef) (width >> 16),
+                        (Bytef) (width >> 8), (Bytef) width,
+                        (Bytef) (height >> 24), (Bytef) (height >> 16),
+                        (Bytef) (height >> 8), (Bytef) height,
+                        8, 2, 0, 0, 0};
+    write_png_chunk(file, "IHDR", header, 13);
+    write_png_chunk(file, "IDAT", compressed.data(), compressed_size);
+    write_png_chunk(file, "IEND", NULL, 0);
+}
+
+/* 'start_encoders' function:
+ *
+ * Starts 'count' threads that write the frames given to 'submit_frame' to
+ * image files, so rendering never waits on image compression or the disk.
+ */
+void start_encoders(int count)
+{
+    encoders_stopping = false;
+    max_queued_frames = 2 * count;
+    for (int i = 0; i < count; ++i) {
+        encoders.push_back(thread(encode_frames));
+    }
+}
+
+/* 'encode_frames' function:
+ *
+ * What each encoder thread runs: it takes frames off the queue and writes
+ * them until 'stop_encoders' is called and the queue is empty.
+ */
+void encode_frames()
+{
+    while (true) {
+        Encode_Job job;
+        {
+            unique_lock<mutex> lock(encode_mutex);
+            encode_ready.wait(lock, [] {
+                return !encode_queue.empty() || encoders_stopping;
+            });
+            if (encode_queue.empty()) {
+                return;
+            }
+            job = move(encode_queue.front());
+            encode_queue.pop_front();
+        }
+        encode_room.notify_one();
+
+        try {
+            if (png_format) {
+                write_png(job.filename, job.width, job.height, job.pixels.data());
+            } else {
+                write_ppm(job.filename, job.width, job.height, job.pixels.data());
+            }
+        } catch (const invalid_argument &error) {
+            cerr << error.what() << "\n";
+        }
+
+        lock_guard<mutex> lock(encode_mutex);
+        free_pixels.push_back(move(job.pixels));
+    }
+}
+
+/* 'submit_frame' function:
+ *
+ * Copies a frame into a pixel vector left over from an earlier frame (if
+ * there is one) and queues it for the encoder threads. Waits only if the
+ * queue is full.
+ */
+void submit_frame(const string &filename, int width, int height, const GLubyte *pixels)
+{
+    Encode_Job job;
+    job.filename = filename;
+    job.width = width;
+    job.height = height;
+    {
+        unique_lock<mutex> lock(encode_mutex);
+        encode_room.wait(lock, [] {
+            return (int) encode_queue.size() < max_queued_frames;
+        });
+        if (!free_pixels.empty()) {
+            job.pixels = move(free_pixels.back());
+            free_pixels.pop_back();
+        }
+    }
+    job.pixels.assign(pixels, pixels + (size_t) width * height * 4);
+    {
+        lock_guard<mutex> lock(encode_mutex);
+        encode_queue.push_back(move(job));
+    }
+    encode_ready.notify_one();
+}
+
+/* 'stop_encoders' function:
+ *
+ * Waits for the encoder threads to write every queued frame and ends them.
+ */
+void stop_encoders()
+{
+    {
+        lock_guard<mutex> lock(encode_mutex);
+        encoders_stopping = true;
+    }
+    encode_ready.notify_all();
+    for (thread &encoder : encoders) {
+        encoder.join();
+    }
+    encoders.clear();
+    free_pixels.clear();
+}
+
+/* 'create_framebuffer' function:
+ *
+ * Creates a framebuffer object of the given size and binds it in place of
+ * the window, for drawing without one.
+ */
+void create_framebuffer(int width, int height)
+{
+    /* The framebuffer object stands in for the window: one renderbuffer for
+     * colors and one for depths.
+     */
+    GLuint framebuffer, renderbuffers[2];
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glGenRenderbuffers(2, renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER, renderbuffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              GL_RENDERBUFFER, renderbuffers[1]);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        cerr << "Could not create a " << width << "x" << height << " framebuffer\n";
+        exit(1);
+    }
+}
+
+/* 'render_offscreen' function:
+ *
+ * Renders the scene in 'filename' into a framebuffer object of the given
+ * size, once for each orientation, and writes each frame to an image file.
+ *
+ * Reading pixels straight into our memory with 'glReadPixels' would make
+ * the CPU wait until the GPU has finished the frame. Instead we read each
+ * frame into one of two pixel buffer objects, which returns right away,
+ * and only map a frame's buffer after the next frame has been submitted.
+ * That way the readback of one frame overlaps the rendering of the next.
+ *
+ * The mapped frames are copied to a queue for encoder threads (see
+ * 'start_encoders'), which write the image files while we keep rendering.
+ */
+void render_offscreen(string filename, int width, int height)
+{
+    vector<Quarternion> orientations;
+    if (!orientations_file.empty()) {
+        read_orientations(orientations_file, orientations);
+    } else if (turntable_frames > 0) {
+        for (int i = 0; i < turntable_frames; ++i) {
+            float angle = 2.0f * M_PI * i / turntable_frames;
+            orientations.push_back(axisAngleQuarternion(0, 1, 0, angle));
+        }
+    } else {
+        orientations.push_back(getIdentityQuarternion());
+    }
+
+    create_framebuffer(width, height);
+    init(vector<string>(1, filename));
+    finish_loading();
+    reshape(width, height);
+
+    GLsizeiptr frame_bytes = (GLsizeiptr) width * height * 4;
+    GLuint pixel_buffers[2];
+    glGenBuffers(2, pixel_buffers);
+    for (int i = 0; i < 2; ++i) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_buffers[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, frame_bytes, NULL, GL_STREAM_READ);
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    start_encoders(max(1, (int) thread::hardware_concurrency()));
+
+    int frame_count = orientations.size();
+    double start = now_seconds();
+    for (int i = 0; i <= frame_count; ++i) {
+        if (i < frame_count) {
+            last_rotation = orientations[i];
+            curr_rotation = getIdentityQuarternion();
+            display();
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_buffers[i % 2]);
+            glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        }
+        /* Save the previous frame while the GPU works on this one */
+        if (i > 0) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_buffers[(i - 1) % 2]);
+            const GLubyte *pixels =
+                (const GLubyte *) glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+            if (pixels == NULL) {
+                GLenum error = glGetError();
+                cerr << "Could not read frame " << i - 1 << ": "
+                     << gluErrorString(error) << " (OpenGL error 0x" << hex << error << dec
+                     << ")\n";
+                stop_encoders();
+                exit(1);
+            }
+            char number[16];
+            snprintf(number, sizeof(number), "_%04d.%s", i - 1,
+                     png_format ? "png" : "ppm");
+            submit_frame(render_prefix + number, width, height, pixels);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    double render_elapsed = now_seconds() - start;
+    stop_encoders();
+    double elapsed = now_seconds() - start;
+
+    cout << "Rendered " << frame_count << " frame(s) in " << render_elapsed * 1000.0
+         << " ms (" << frame_count / render_elapsed << " fps)\n"
+         << "Wrote them in " << elapsed * 1000.0
+         << " ms (" << frame_count / elapsed << " fps)\n";
+}
+
+/* 'time_stage' function:
+ *
+ * Runs 'body' 'bench_warmup' times and then 'bench_repetitions' times more,
+ * adding how many milliseconds each of the later runs took to 'stage', and,
+ * in the 'opengl_bench' build, how many heap allocations they made on
+ * average.
+ */
+void time_stage(Bench_Stage &stage, const function<void()> &body)
+{
+    for (int i = 0; i < bench_warmup; ++i) {
+        body();
+    }
+#ifdef OPENGL_BENCH
+    uint64_t allocations = 0;
+#endif
+    for (int i = 0; i < bench_repetitions; ++i) {
+#ifdef OPENGL_BENCH
+        uint64_t first_allocation = heap_allocations.load();
+#endif
+        double start = now_seconds();
+        body();
+        stage.samples_ms.push_back(1000 * (now_seconds() - start));
+#ifdef OPENGL_BENCH
+        allocations += heap_allocations.load() - first_allocation;
+#endif
+    }
+#ifdef OPENGL_BENCH
+    stage.allocations = (double) allocations / bench_repetitions;
+#endif
+}
+
+/* 'percentile' function:
+ *
+ * Returns the smallest sample that at least 'fraction' of the samples are
+ * no larger than (the nearest-rank percentile), or 0 if there are none.
+ */
+double percentile(vector<double> samples, double fraction)
+{
+    if (samples.empty()) {
+        return 0;
+    }
+    size_t rank = (size_t) ceil(fraction * samples.size());
+    size_t i = min(samples.size() - 1, rank > 0 ? rank - 1 : 0);
+    nth_element(samples.begin(), samples.begin() + i, samples.end());
+    return samples[i];
+}
+
+/* 'json_string' function:
+ *
+ * Returns 'text' as a quoted JSON string.
+ */
+string json_string(const string &text)
+{
+    string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if ((unsigned char) c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+/* 'write_bench_stages' function:
+ *
+ * Writes the median, 99th percentile, fastest and mean time of each stage,
+ * and its allocations if they were counted, as the elements of a JSON
+ * array, and prints them as well.
+ */
+void write_bench_stages(ostream &out, const vector<Bench_Stage> &stages, const string &indent)
+{
+    for (size_t i = 0; i < stages.size(); ++i) {
+        const Bench_Stage &stage = stages[i];
+        const vector<double> &samples = stage.samples_ms;
+        double total = 0;
+        for (double sample : samples) {
+            total += sample;
+        }
+        double median = percentile(samples, 0.5);
+        double p99 = percentile(samples, 0.99);
+        double fastest = samples.empty() ? 0 : *min_element(samples.begin(), samples.end());
+        double mean = samples.empty() ? 0 : total / samples.size();
+
+        out << indent << "{\"name\": " << json_string(stage.name)
+            << ", \"iterations\": " << stage.iterations
+            << ", \"repetitions\": " << samples.size()
+            << ", \"median_ms\": " << median << ", \"p99_ms\": " << p99
+            << ", \"min_ms\": " << fastest << ", \"mean_ms\": " << mean;
+        if (stage.allocations >= 0) {
+            out << ", \"allocations\": " << stage.allocations;
+        }
+        out << "}" << (i + 1 < stages.size() ? ",\n" : "\n");
+        cout << "  " << setw(16) << left << stage.name << right
+             << " median " << setw(10) << median << " ms, p99 " << setw(10) << p99 << " ms, ";
+        if (stage.allocations >= 0) {
+            cout << setw(10) << stage.allocations << " allocations ";
+        }
+        cout << "(" << samples.size() << " x " << stage.iterations << ")\n";
+    }
+}
+
+/* 'run_benchmarks' function:
+ *
+ * Times the stages of loading and drawing each of the given scenes and
+ * writes the results to 'json_filename', so that runs on different commits
+ * can be compared. Needs a current OpenGL context.
+ *
+ * For each scene we time
+ *
+ * - 'parseFormatFile': reading the scene file, without its meshes
+ * - 'parseObjFile': reading every OBJ file the scene uses
+ * - 'upload_object': copying those meshes into new OpenGL buffers
+ * - 'render': drawing a frame of the scene and waiting for it to finish
+ * - 'cull': the part of each of those frames spent queueing and culling
+ *   instances (see 'draw_objects')
+ *
+ * Scenes whose meshes cannot be read get an "error" and are drawn with
+ * placeholder boxes. Baking transforms and turning the ArcBall do not
+ * depend on the scene and are timed once, 1000 calls per run.
+ */
+void run_benchmarks(string json_filename, const vector<string> &filenames)
+{
+    const int width = 800, height = 800, iterations = 1000;
+    create_framebuffer(width, height);
+
+    vector<Bench_Stage> common(2);
+    common[0].name = "bake_transforms";
+    common[0].iterations = iterations;
+    vector<Transform> transforms(3);
+    transforms[0] = {translation, {1.0f, 2.0f, 3.0f, 0.0f}};
+    transforms[1] = {rotation, {0.0f, 1.0f, 1.0f, 0.5f}};
+    transforms[2] = {scaling, {2.0f, 2.0f, 2.0f, 0.0f}};
+    vector<Instance> instances(iterations);
+    time_stage(common[0], [&] {
+        for (Instance &inst : instances) {
+            bake_transforms(transforms, inst);
+        }
+    });
+
+    /* A drag across the middle of the window, as 'mouse_moved' follows it */
+    common[1].name = "arcball";
+    common[1].iterations = iterations;
+    reshape(width, height);
+    time_stage(common[1], [&] {
+        mouse_x = width / 2;
+        mouse_y = height / 2;
+        for (int i = 0; i < iterations; ++i) {
+            computeRotationQuarternion(width / 2 + i % 200, height / 2 + i % 150);
+            last_rotation = multiplyQuarternion(last_rotation, curr_rotation);
+        }
+    });
+    last_rotation = curr_rotation = getIdentityQuarternion();
+
+    vector<vector<Bench_Stage> > scene_stages(filenames.size());
+    vector<string> scene_errors(filenames.size());
+    vector<size_t> scene_instances(filenames.size()), scene_triangles(filenames.size());
+    vector<string> readable;
+    for (size_t s = 0; s < filenames.size(); ++s) {
+        vector<Bench_Stage> &stages = scene_stages[s];
+        stages.resize(3);
+        stages[0].name = "parseFormatFile";
+        Scene_Data scene;
+        try {
+            parseFormatFile(filenames[s], scene, map<string, string>(), false);
+            time_stage(stages[0], [&] {
+                Scene_Data parsed;
+                parseFormatFile(filenames[s], parsed, map<string, string>(), false);
+            });
+        } catch (const exception &error) {
+            scene_errors[s] = error.what();
+            stages.clear();
+            continue;
+        }
+        readable.push_back(filenames[s]);
+
+        /* The meshes are read into objects of our own, so the scenes drawn
+         * below are loaded the usual way.
+         */
+        vector<string> mesh_files;
+        for (const auto &entry : scene.objects) {
+            scene_instances[s] += entry.second.instance_count;
+            const string &file = entry.second.filename;
+            const string chunks = ".chunks";
+            if (file.size() < chunks.size()
+                || file.compare(file.size() - chunks.size(), chunks.size(), chunks) != 0) {
+                mesh_files.push_back(file);
+            }
+        }
+        vector<Object> meshes(mesh_files.size());
+        stages[1].name = "parseObjFile";
+        stages[2].name = "upload_object";
+        try {
+            for (size_t i = 0; i < meshes.size(); ++i) {
+                parseObjFile(mesh_files[i], meshes[i]);
+                build_edge_buffer(meshes[i]);
+                build_meshlets(meshes[i]);
+                scene_triangles[s] += meshes[i].vertex_buffer.size() / 3;
+            }
+        } catch (const exception &error) {
+            scene_errors[s] = error.what();
+            stages.resize(1);
+            continue;
+        }
+        time_stage(stages[1], [&] {
+            for (size_t i = 0; i < mesh_files.size(); ++i) {
+                Object parsed;
+                parseObjFile(mesh_files[i], parsed);
+            }
+        });
+        time_stage(stages[2], [&] {
+            for (Object &mesh : meshes) {
+                upload_object(mesh);
+            }
+            glFinish();
+            for (Object &mesh : meshes) {
+                release_object(mesh);
+            }
+        });
+    }
+
+    /* Every readable scene is loaded at once, as the viewer does, and shown
+     * in turn
+     */
+    if (!readable.empty()) {
+        init(readable);
+        finish_loading();
+        reshape(width, height);
+    }
+    for (size_t s = 0, shown = 0; s < filenames.size(); ++s) {
+        if (shown == readable.size() || readable[shown] != filenames[s]) {
+            continue;
+        }
+        switch_scene(shown++);
+        finish_loading();
+        vector<Bench_Stage> &stages = scene_stages[s];
+        stages.push_back(Bench_Stage());
+        stages.back().name = "render";
+        vector<double> cull_ms;
+        time_stage(stages.back(), [&] {
+            display();
+            glFinish();
+            cull_ms.push_back(render_stats.cull_ms);
+        });
+        /* Only the timed frames count */
+        stages.push_back(Bench_Stage());
+        stages.back().name = "cull";
+        stages.back().samples_ms.assign(cull_ms.begin() + bench_warmup, cull_ms.end());
+
+        /* Moving the first node brings its whole subtree up to date, and
+         * moving the last one just that node. Each node is given the matrix
+         * it already has, so the scene does not change.
+         */
+        Scene_Graph &graph = scene_slots[shown_scene].scene->graph;
+        if (!graph.parent.empty()) {
+            int moved[2] = {0, (int) graph.parent.size() - 1};
+            const char *names[2] = {"move_first_node", "move_last_node"};
+            for (int k = 0; k < 2; ++k) {
+                stages.push_back(Bench_Stage());
+                stages.back().name = names[k];
+                stages.back().iterations = iterations;
+                time_stage(stages.back(), [&] {
+                    for (int i = 0; i < iterations; ++i) {
+                        set_node_transform(graph, moved[k], graph.local[moved[k]]);
+                        update_scene_graph(graph);
+                    }
+                });
+            }
+        }
+    }
+
+    ofstream out(json_filename);
+    out << setprecision(6) << "{\n  \"warmup\": " << bench_warmup
+        << ",\n  \"repetitions\": " << bench_repetitions
+        << ",\n  \"width\": " << width << ",\n  \"height\": " << height
+        << ",\n  \"stages\": [\n";
+    cout << setprecision(4) << fixed << "Common stages:\n";
+    write_bench_stages(out, common, "    ");
+    out << "  ],\n  \"scenes\": [\n";
+    for (size_t s = 0; s < filenames.size(); ++s) {
+        cout << filenames[s] << ": " << scene_instances[s] << " instances, "
+             << scene_triangles[s] << " triangles\n";
+        out << "    {\"file\": " << json_string(filenames[s])
+            << ", \"instances\": " << scene_instances[s]
+            << ", \"triangles\": " << scene_triangles[s];
+        if (!scene_errors[s].empty()) {
+            cout << "  error: " << scene_errors[s] << "\n";
+            out << ", \"error\": " << json_string(scene_errors[s]);
+        }
+        out << ",\n     \"stages\": [\n";
+        write_bench_stages(out, scene_stages[s], "       ");
+        out << "     ]}" << (s + 1 < filenames.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+    if (out.fail()) {
+        throw invalid_argument("Could not write benchmark file '" + json_filename + "'.");
+    }
+    cout << "Wrote " << json_filename << "\n";
+}
+
+/* 'init_lights' function:
+ * 
+ * This function has OpenGL enable its built-in lights to represent our point
+ * lights.
+ *
+ * OpenGL has 8 built-in lights in all, each one with its own unique, integer
+ * ID value. When setting the properties of a light, we need to tell OpenGL
+ * the ID value of the light we are modifying.
+ * 
+ * The first light's ID value is stored in 'GL_LIGHT0'. The second light's ID
+ * value is stored in 'GL_LIGHT1'. And so on. The eighth and last light's ID
+ * value is stored in 'GL_LIGHT7'. (Some drivers have more, and tell us how
+ * many through 'GL_MAX_LIGHTS'.)
+ *
+ * Our scenes can have more point lights than that, so the built-in lights
+ * work like slots: before drawing each instance, 'select_lights' loads the
+ * point lights that can reach that instance into the slots.
+ */
+void init_lights()
+{
+    /* The following line of code tells OpenGL to enable lighting calculations
+     * during its rendering process. This tells it to automatically apply the
+     * Phong reflection model or lighting model to every pixel it will render.
+     */
+    glEnable(GL_LIGHTING);
+    
+    GLint max_lights;
+    glGetIntegerv(GL_MAX_LIGHTS, &max_lights);
+    slot_lights.assign(max_lights, -1);
+}
+
+/* 'load_light' function:
+ *
+ * Copies point light 'i' into the built-in light 'GL_LIGHT0 + slot'. This
+ * must be called while the Modelview Matrix holds only the camera
+ * transformations; see 'set_lights' for why.
+ */
+void load_light(int slot, int i)
+{
+    int light_id = GL_LIGHT0 + slot;
+    
+    /* The following lines of code use 'glLightfv' to set the color of
+     * the light. The parameters for 'glLightfv' are:
+     *
+     * - enum light_ID: an integer between 'GL_LIGHT0' and 'GL_LIGHT7'
+     * - enum property: this varies depending on what you are setting
+     *                  e.g. 'GL_AMBIENT' for the light's ambient component
+     * - float* values: a set of values to set for the specified property
+     *                  e.g. an array of RGB values for the light's color
+     * 
+     * OpenGL actually lets us specify different colors for the ambient,
+     * diffuse, and specular components of the light. However, since we
+     * are used to only working with one overall light color, we will
+     * just set every component to the light color.
+     */
+    glLightfv(light_id, GL_AMBIENT, lights[i].color);
+    glLightfv(light_id, GL_DIFFUSE, lights[i].color);
+    glLightfv(light_id, GL_SPECULAR, lights[i].color);
+    
+    /* The following line of code sets the attenuation k constant of the
+     * light. The difference between 'glLightf' and 'glLightfv' is that
+     * 'glLightf' is used for when the parameter is only one value like
+     * the attenuation constant while 'glLightfv' is used for when the
+     * parameter is a set of values like a color array. i.e. the third
+     * parameter of 'glLightf' is just a float instead of a float*.
+     */
+    glLightf(light_id, GL_QUADRATIC_ATTENUATION, lights[i].attenuation_k);
+
+    glLightfv(light_id, GL_POSITION, lights[i].position);
+}
+
+/* 'set_lights' function:
+ *
+ * While the 'init_lights' function enables lighting, the lights themselves
+ * are loaded and positioned by 'load_light'.
+ *
+ * You might be wondering why we do not just set the positions of the lights in
+ * the 'init_lights' function in addition to the other properties. The reason
+ * for this is because OpenGL does lighting computations after it applies the
+ * Modelview Matrix to points. This means that the lighting computations are
+ * effectively done in camera space. Hence, to ensure that we get the correct
+ * lighting computations, we need to make sure that we position the lights
+ * correctly in camera space.
+ * 
+ * Now, the 'glLightfv' function, when used to position a light, applies all
+ * the current Modelview Matrix to the given light position. This means that
+ * to correctly position lights in camera space, we should call the 'glLightfv'
+ * function to position them AFTER the Modelview Matrix has been modified by
+ * the necessary camera transformations.
+ *
+ * Since the camera may have moved since the last frame, the positions loaded
+ * last frame are stale. 'set_lights' switches all the built-in lights off at
+ * the start of every frame, and 'select_lights' loads lights again as the
+ * instances need them, while the Modelview Matrix holds only the camera
+ * transformations.
+ */
+void set_lights()
+{
+    int num_slots = slot_lights.size();
+    
+    for(int slot = 0; slot < num_slots; ++slot)
+    {
+        if (slot_lights[slot] >= 0) {
+            glDisable(GL_LIGHT0 + slot);
+            slot_lights[slot] = -1;
+        }
+    }
+}
+
+/* 'select_lights' function:
+ *
+ * Turns on exactly the built-in lights the given instance needs: those whose
+ * sphere of influence (see 'light_radius') overlaps the instance's bounding
+ * sphere. If more lights reach the instance than OpenGL has built-in lights,
+ * the closest ones win.
+ *
+ * A light that is already loaded in a slot stays in that slot, so instances
+ * that are lit by the same lights do not cause any 'glLight' calls.
+ */
+void select_lights(const Draw_Item &item)
+{
+    int num_slots = slot_lights.size();
+
+    /* (distance, light index) of every light that reaches the instance */
+    vector<pair<float, int> > &reaching = reaching_lights;
+    reaching.clear();
+    for (size_t i = 0; i < lights.size(); ++i)
+    {
+        float dx = lights[i].position[0] - item.world_center[0];
+        float dy = lights[i].position[1] - item.world_center[1];
+        float dz = lights[i].position[2] - item.world_center[2];
+        float distance = sqrt(dx * dx + dy * dy + dz * dz);
+        if (distance < light_radius(lights[i]) + item.world_radius) {
+            reaching.push_back(make_pair(distance, (int) i));
+        }
+    }
+    if ((int) reaching.size() > num_slots) {
+        partial_sort(reaching.begin(), reaching.begin() + num_slots, reaching.end());
+        reaching.resize(num_slots);
+    }
+    render_stats.light_object_pairs += reaching.size();
+
+    /* Keeps lights that are already loaded and frees the other slots */
+    vector<bool> placed(reaching.size(), false);
+    for (int slot = 0; slot < num_slots; ++slot)
+    {
+        bool keep = false;
+        for (size_t r = 0; r < reaching.size() && !keep; ++r) {
+            if (reaching[r].second == slot_lights[slot]) {
+                placed[r] = keep = true;
+            }
+        }
+        if (!keep && slot_lights[slot] >= 0) {
+            glDisable(GL_LIGHT0 + slot);
+            slot_lights[slot] = -1;
+        }
+    }
+
+    /* Loads the remaining lights into free slots */
+    int slot = 0;
+    for (size_t r = 0; r < reaching.size(); ++r)
+    {
+        if (placed[r]) {
+            continue;
+        }
+        while (slot_lights[slot] >= 0) {
+            ++slot;
+        }
+        load_light(slot, reaching[r].second);
+        glEnable(GL_LIGHT0 + slot);
+        slot_lights[slot] = reaching[r].second;
+    }
+}
+
+/* The following GLSL shaders implement per-pixel Phong shading.
+ *
+ * The vertex shader only moves each vertex and normal into camera space and
+ * hands them to the fragment shader, which OpenGL interpolates across each
+ * triangle. The fragment shader then does the lighting computation at every
+ * pixel instead of only at the vertices like 'glShadeModel(GL_SMOOTH)' does.
+ *
+ * The lighting model is the one the fixed-function pipeline uses with our
+ * 'init_lights' settings, so switching between the two only changes where
+ * lighting is evaluated: a global ambient of 0.2 times the ambient
+ * reflectance, plus for every light its color scaled by 1 / (1 + k d^2) and
+ * multiplied by the ambient, diffuse, and specular terms. The specular term
+ * uses the half vector between the light and the camera direction.
+ *
+ * Using the "compatibility" profile lets the shaders read the Modelview and
+ * Projection Matrices we already build with 'glTranslatef' and friends.
+ *
+ * The fragment shader only visits the lights listed for its screen tile (see
+ * 'update_light_block'), fetching them from texture buffers.
+ */
+const char *phong_vertex_source = R"(
+#version 330 compatibility
+
+out vec3 eye_position;
+out vec3 eye_normal;
+
+void main()
+{
+    eye_position = vec3(gl_ModelViewMatrix * gl_Vertex);
+    eye_normal = gl_NormalMatrix * gl_Normal;
+    gl_Position = ftransform();
+}
+)";
+
+const char *phong_fragment_source = R"(
+#version 330 compatibility
+
+#define TILE_SIZE 16
+
+uniform samplerBuffer light_data;
+uniform isamplerBuffer tile_ranges;
+uniform isamplerBuffer tile_indices;
+uniform int tiles_x;
+
+layout(std140) uniform Material
+{
+    vec4 ambient;
+    vec4 diffuse;
+    vec4 specular;
+};
+
+in vec3 eye_position;
+in vec3 eye_normal;
+
+void main()
+{
+    vec3 n = normalize(eye_normal);
+    vec3 e = normalize(-eye_position);
+    vec3 color = 0.2 * ambient.rgb;
+
+    ivec2 tile = ivec2(gl_FragCoord.xy) / TILE_SIZE;
+    ivec2 range = texelFetch(tile_ranges, tile.y * tiles_x + tile.x).xy;
+
+    for (int j = 0; j < range.y; ++j) {
+        int i = texelFetch(tile_indices, range.x + j).x;
+        vec4 light_position = texelFetch(light_data, 2 * i);
+        vec4 light_color = texelFetch(light_data, 2 * i + 1);
+
+        vec3 l = light_position.xyz - eye_position;
+        float d2 = dot(l, l);
+        l = l * inversesqrt(d2);
+        float attenuation = 1.0 / (1.0 + light_color.w * d2);
+
+        float n_dot_l = max(dot(n, l), 0.0);
+        float n_dot_h = max(dot(n, normalize(l + e)), 0.0);
+        float spec = (n_dot_l > 0.0) ? pow(n_dot_h, specular.w) : 0.0;
+
+        color += attenuation * light_color.rgb
+               * (ambient.rgb + n_dot_l * diffuse.rgb + spec * specular.rgb);
+    }
+    gl_FragColor = vec4(min(color, vec3(1.0)), 1.0);
+}
+)";
+
+/* 'compile_shader' function:
+ *
+ * Compiles one shader stage. Returns 0 and prints the compiler's messages if
+ * compilation fails.
+ */
+GLuint compile_shader(GLenum type, const char *source)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint compiled;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled) {
+        char log[4096];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        cerr << "Could not compile shader:\n" << log << "\n";
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+/* 'init_shaders' function:
+ *
+ * Builds the Phong shader program and creates the buffers it reads lights
+ * and materials from. On any failure 'phong_program' stays 0 and we render
+ * with fixed-function OpenGL.
+ *
+ * These buffers let us send all the lights with a few calls per frame and
+ * switch materials with one call per material change, instead of a
+ * 'glLightfv' per light and four 'glMaterial' calls per instance.
+ */
+void init_shaders()
+{
+    GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, phong_vertex_source);
+    GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, phong_fragment_source);
+    if (vertex_shader == 0 || fragment_shader == 0) {
+        return;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glLinkProgram(program);
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+
+    GLint linked;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        char log[4096];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        cerr << "Could not link shader program:\n" << log << "\n";
+        glDeleteProgram(program);
+        return;
+    }
+
+    glUniformBlockBinding(program, glGetUniformBlockIndex(program, "Material"), material_binding);
+    phong_program = program;
+
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "light_data"), light_data_unit);
+    glUniform1i(glGetUniformLocation(program, "tile_ranges"), tile_ranges_unit);
+    glUniform1i(glGetUniformLocation(program, "tile_indices"), tile_indices_unit);
+    tiles_x_location = glGetUniformLocation(program, "tiles_x");
+    glUseProgram(0);
+
+    /* Each texture buffer is a plain buffer object plus a texture that views
+     * it as an array of texels of the given format.
+     */
+    GLuint *buffers[3] = {&light_data_buffer, &tile_ranges_buffer, &tile_indices_buffer};
+    GLuint *textures[3] = {&light_data_tbo, &tile_ranges_tbo, &tile_indices_tbo};
+    GLenum formats[3] = {GL_RGBA32F, GL_RG32I, GL_R32I};
+    GLint units[3] = {light_data_unit, tile_ranges_unit, tile_indices_unit};
+    for (int i = 0; i < 3; ++i) {
+        glGenBuffers(1, buffers[i]);
+        glBindBuffer(GL_TEXTURE_BUFFER, *buffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+
+        glGenTextures(1, textures[i]);
+        glActiveTexture(GL_TEXTURE0 + units[i]);
+        glBindTexture(GL_TEXTURE_BUFFER, *textures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, formats[i], *buffers[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+/* 'upload_materials' function:
+ *
+ * Copies every material into one uniform buffer. Each material starts at a
+ * multiple of the driver's required offset alignment so that
+ * 'glBindBufferRange' can point the shader at any one of them.
+ */
+void upload_materials()
+{
+    if (phong_program == 0) {
+        return;
+    }
+
+    GLint alignment;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    material_stride = ((sizeof(Material_Block) + alignment - 1) / alignment) * alignment;
+
+    vector<unsigned char> data(materials.size() * material_stride);
+    for (size_t i = 0; i < materials.size(); ++i) {
+        memcpy(&data[i * material_stride], &materials[i], sizeof(Material_Block));
+    }
+
+    if (materials_ubo == 0) {
+        glGenBuffers(1, &materials_ubo);
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, materials_ubo);
+    glBufferData(GL_UNIFORM_BUFFER, data.size(), data.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+/* 'light_radius' function:
+ *
+ * Returns the distance past which the light adds less than 'light_cutoff' of
+ * its brightest color channel. With our attenuation of 1 / (1 + k d^2), this
+ * is the 'd' solving max_color / (1 + k d^2) = light_cutoff. A light without
+ * attenuation reaches everywhere, and a light that is dimmer than the cutoff
+ * to begin with reaches nowhere.
+ */
+float light_radius(const Point_Light &light)
+{
+    float brightest = max(light.color[0], max(light.color[1], light.color[2]));
+    if (brightest <= light_cutoff) {
+        return 0.0f;
+    }
+    if (light.attenuation_k <= 0.0f) {
+        return INFINITY;
+    }
+    return sqrt((brightest / light_cutoff - 1.0f) / light.attenuation_k);
+}
+
+/* 'parallel_for' function:
+ *
+ * Splits the range [0, count) into one contiguous chunk per hardware thread
+ * and calls 'body(begin, end)' on every chunk at the same time. Returns once
+ * all chunks are done.
+ *
+ * The chunks run on the threads of 'start_workers', which are kept between
+ * calls, since starting threads every time costs more than a small range
+ * takes to run. The calling thread runs chunks too until none are left, so
+ * calls from several threads at once, or from inside a chunk, never wait on
+ * each other.
+ */
+void parallel_for(int count, const function<void(int, int)> &body)
+{
+    int num_threads = min((int) max(1u, thread::hardware_concurrency()), count);
+    if (num_threads <= 1) {
+        if (count > 0) {
+            body(0, count);
+        }
+        return;
+    }
+
+    static once_flag workers_started;
+    call_once(workers_started, start_workers);
+
+    Parallel_Job job = {&body, count, num_threads, 0, 0};
+    unique_lock<mutex> lock(worker_mutex);
+    parallel_jobs.push_back(&job);
+    job_ready.notify_all();
+    while (run_chunk(job, lock)) {
+    }
+    job_done.wait(lock, [&] { return job.chunks_done == job.num_chunks; });
+}
+
+/* 'start_workers' function:
+ *
+ * Starts one thread less than there are hardware threads (the thread calling
+ * 'parallel_for' is the last one) and has them stopped when the program
+ * exits.
+ */
+void start_workers()
+{
+    int count = max(1u, thread::hardware_concurrency()) - 1;
+    for (int i = 0; i < count; ++i) {
+        workers.push_back(thread(run_workers));
+    }
+    atexit(stop_workers);
+}
+
+/* 'run_workers' function:
+ *
+ * What each worker thread runs: it runs chunks of the oldest job until
+ * 'stop_workers' is called.
+ */
+void run_workers()
+{
+    unique_lock<mutex> lock(worker_mutex);
+    while (true) {
+        job_ready.wait(lock, [] { return !parallel_jobs.empty() || workers_stopping; });
+        if (parallel_jobs.empty()) {
+            return;
+        }
+        run_chunk(*parallel_jobs.front(), lock);
+    }
+}
+
+/* 'run_chunk' function:
+ *
+ * Takes the next chunk of 'job', if there is one, and runs it with 'lock'
+ * released. The job leaves the queue once its last chunk is taken, and its
+ * caller is woken once that chunk is done; until then it cannot return, so
+ * 'job' stays valid while we use it.
+ *
+ * Returns false if every chunk was already taken.
+ */
+bool run_chunk(Parallel_Job &job, unique_lock<mutex> &lock)
+{
+    if (job.next_chunk == job.num_chunks) {
+        return false;
+    }
+    int chunk = job.next_chunk++;
+    if (job.next_chunk == job.num_chunks) {
+        parallel_jobs.erase(find(parallel_jobs.begin(), parallel_jobs.end(), &job));
+    }
+
+    lock.unlock();
+    (*job.body)((long) job.count * chunk / job.num_chunks,
+                (long) job.count * (chunk + 1) / job.num_chunks);
+    lock.lock();
+
+    if (++job.chunks_done == job.num_chunks) {
+        job_done.notify_all();
+    }
+    return true;
+}
+
+/* 'stop_workers' function:
+ *
+ * Ends the worker threads once they run out of jobs.
+ */
+void stop_workers()
+{
+    {
+        lock_guard<mutex> lock(worker_mutex);
+        workers_stopping = true;
+    }
+    job_ready.notify_all();
+    for (thread &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+}
+
+/* 'update_light_block' function:
+ *
+ * The shader's equivalent of 'set_lights'. 'glLightfv' moves light positions
+ * into camera space with the current Modelview Matrix; here we do that
+ * ourselves, sort the lights into screen tiles, and upload everything.
+ *
+ * To find the tiles a light touches, we take the box around its sphere of
+ * influence in camera space and project the box's 8 corners onto the screen.
+ * The rectangle around the projected corners contains the whole sphere. A
+ * sphere that reaches behind the near plane could project anywhere, so it
+ * gets every tile.
+ *
+ * Both steps run on all hardware threads: first each thread places a share
+ * of the lights, then each thread fills the lists of a band of tile rows.
+ */
+void update_light_block()
+{
+    Matrix4f view;
+    glGetFloatv(GL_MODELVIEW_MATRIX, view.data());
+
+    int num_lights = lights.size();
+    int tiles_x = (window_width + tile_size - 1) / tile_size;
+    int tiles_y = (window_height + tile_size - 1) / tile_size;
+
+    /* Camera space lights and the tile rectangle [x0, x1) x [y0, y1) each one
+     * covers. An empty rectangle means the light is out of view.
+     */
+    vector<Light_Block> data(num_lights);
+    vector<int> rects(4 * num_lights);
+
+    parallel_for(num_lights, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
+        {
+            Eigen::Vector4f position = view * Eigen::Map<Eigen::Vector4f>(lights[i].position);
+            for (int c = 0; c < 4; ++c) {
+                data[i].position[c] = position[c];
+            }
+            data[i].color[0] = lights[i].color[0];
+            data[i].color[1] = lights[i].color[1];
+            data[i].color[2] = lights[i].color[2];
+            data[i].color[3] = lights[i].attenuation_k;
+
+            int *rect = &rects[4 * i];
+            float radius = light_radius(lights[i]);
+            float x = position[0], y = position[1], z = position[2];
+
+            rect[0] = 0; rect[1] = tiles_x; rect[2] = 0; rect[3] = tiles_y;
+            if (radius == 0.0f || z - radius > -near_param) {
+                rect[1] = rect[3] = 0;
+                continue;
+            }
+            if (isinf(radius) || z + radius > -near_param) {
+                continue;
+            }
+
+            float lo_x = INFINITY, hi_x = -INFINITY, lo_y = INFINITY, hi_y = -INFINITY;
+            for (int corner = 0; corner < 8; ++corner) {
+                float cx = x + ((corner & 1) ? radius : -radius);
+                float cy = y + ((corner & 2) ? radius : -radius);
+                float cz = z + ((corner & 4) ? radius : -radius);
+                float px = near_param * cx / -cz, py = near_param * cy / -cz;
+                lo_x = min(lo_x, px); hi_x = max(hi_x, px);
+                lo_y = min(lo_y, py); hi_y = max(hi_y, py);
+            }
+
+            /* From the near plane to pixels, then to tiles */
+            float to_px_x = window_width / (right_param - left_param);
+            float to_px_y = window_height / (top_param - bottom_param);
+            rect[0] = max(0, (int) floor((lo_x - left_param) * to_px_x / tile_size));
+            rect[1] = min(tiles_x, (int) floor((hi_x - left_param) * to_px_x / tile_size) + 1);
+            rect[2] = max(0, (int) floor((lo_y - bottom_param) * to_px_y / tile_size));
+            rect[3] = min(tiles_y, (int) floor((hi_y - bottom_param) * to_px_y / tile_size) + 1);
+        }
+    });
+
+    tile_lights.resize(tiles_x * tiles_y);
+    parallel_for(tiles_y, [&](int row_begin, int row_end) {
+        for (int ty = row_begin; ty < row_end; ++ty) {
+            for (int tx = 0; tx < tiles_x; ++tx) {
+                tile_lights[ty * tiles_x + tx].clear();
+            }
+        }
+        for (int i = 0; i < num_lights; ++i) {
+            const int *rect = &rects[4 * i];
+            int y0 = max(rect[2], row_begin), y1 = min(rect[3], row_end);
+            for (int ty = y0; ty < y1; ++ty) {
+                for (int tx = rect[0]; tx < rect[1]; ++tx) {
+                    tile_lights[ty * tiles_x + tx].push_back(i);
+                }
+            }
+        }
+    });
+
+    /* Packs the per-tile lists back to back, remembering where each starts */
+    vector<GLint> ranges(2 * tiles_x * tiles_y);
+    vector<GLint> indices;
+    for (size_t t = 0; t < tile_lights.size(); ++t) {
+        ranges[2 * t] = indices.size();
+        ranges[2 * t + 1] = tile_lights[t].size();
+        indices.insert(indices.end(), tile_lights[t].begin(), tile_lights[t].end());
+    }
+
+    for (int i = 0; i < num_lights; ++i) {
+        if (rects[4 * i + 1] > rects[4 * i] && rects[4 * i + 3] > rects[4 * i + 2]) {
+            ++render_stats.lights_binned;
+        }
+    }
+    render_stats.light_tile_pairs = indices.size();
+
+    /* OpenGL does not accept empty buffers, so keep at least one index */
+    if (indices.empty()) {
+        indices.push_back(0);
+    }
+
+    glBindBuffer(GL_TEXTURE_BUFFER, light_data_buffer);
+    glBufferData(GL_TEXTURE_BUFFER, max(1, num_lights) * sizeof(Light_Block),
+                 num_lights > 0 ? data.data() : NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, tile_ranges_buffer);
+    glBufferData(GL_TEXTURE_BUFFER, ranges.size() * sizeof(GLint), ranges.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, tile_indices_buffer);
+    glBufferData(GL_TEXTURE_BUFFER, indices.size() * sizeof(GLint), indices.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    GLuint textures[3] = {light_data_tbo, tile_ranges_tbo, tile_indices_tbo};
+    GLint units[3] = {light_data_unit, tile_ranges_unit, tile_indices_unit};
+    for (int i = 0; i < 3; ++i) {
+        glActiveTexture(GL_TEXTURE0 + units[i]);
+        glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    glUniform1i(tiles_x_location, tiles_x);
+}
+
+/* 'bake_transforms' function:
+ *
+ * Multiplies all of an instance's transformations into its 'model' matrix.
+ */
+void bake_transforms(const vector<Transform> &transforms, Instance &inst)
+{
+    bake_transforms(transforms, inst.model);
+}
+
+/* Multiplies a list of transformations into the column-major matrix 'model'.
+ * Nodes of the scene graph are baked the same way as instances.
+ */
+void bake_transforms(const vector<Transform> &transforms, GLfloat *model_out)
+{
+    /* The loop below combines the desired geometric transformations for
+     * this instance into a single matrix. We do this once, while the scene
+     * is parsed, so that drawing a frame only needs one 'glMultMatrixf'
+     * per instance instead of replaying every 'glTranslatef', 'glRotatef',
+     * and 'glScalef' call.
+     *
+     * To explain how to correctly transform your objects, consider the
+     * following example. Suppose our object has the following desired
+     * transformations:
+     *
+     *    scale by 2, 2, 2
+     *    translate by 2, 0, 5
+     *    rotate about 0, 1, 0.5 and by angle = 0.6 radians
+     *
+     * Obviously, we cannot use the following loop for this, because the order
+     * is not translate -> rotate -> scale. Instead, we need to make the following
+     * calls in this exact order:
+     *
+     *    glRotatef(0.6 * 180.0 / M_PI, 0, 1, 0.5);
+     *    glTranslatef(2, 0, 5);
+     *    glScalef(2, 2, 2);
+     *
+     * We make the calls in the REVERSE order of how the transformations are specified
+     * because OpenGL edits our modelview matrix using post-multiplication (see above
+     * at the notes regarding the camera transforms in display()). Our Eigen
+     * matrices are post-multiplied in exactly the same order, so the baked
+     * matrix equals what those calls would have built.
+     */
+    Matrix4f model = Matrix4f::Identity();
+    int num_transforms = transforms.size();
+
+    for (int transformIdx = 0; transformIdx < num_transforms; ++transformIdx)
+    {
+        const Transform &t = transforms[transformIdx];
+        Eigen::Affine3f step = Eigen::Affine3f::Identity();
+        switch(t.type) {
+            case translation :
+                step.translate(Vector3f(t.data[0], t.data[1], t.data[2]));
+                break;
+            case rotation :
+                step.rotate(Eigen::AngleAxisf(deg2rad(t.data[3]),
+                        Vector3f(t.data[0], t.data[1], t.data[2]).normalized()));
+                break;
+            case scaling :
+                step.scale(Vector3f(t.data[0], t.data[1], t.data[2]));
+        }
+        /* Later transformations in the list are applied on top of the
+         * earlier ones, so they go on the left.
+         */
+        model = step.matrix() * model;
+    }
+
+    /* Eigen stores matrices column by column, which is also the layout
+     * 'glMultMatrixf' expects.
+     */
+    copy(model.data(), model.data() + 16, model_out);
+}
+
+/* 'build_scene_graph' function:
+ *
+ * Fills in the scene graph from the nodes 'parse_scene_text' read, in the
+ * order the files list them, and the instances placed under them, whose
+ * 'node' fields are indices into 'nodes'. Sorts the nodes depth first and
+ * the instances by node, and works out every world matrix.
+ */
+void build_scene_graph(const pmr::vector<Parsed_Node> &nodes, vector<Node_Instance> &attached,
+                       Scene_Graph &graph)
+{
+    int count = nodes.size();
+    if (count == 0) {
+        return;
+    }
+
+    /* Each node's children, in the order they are listed */
+    vector<int> first_child(count + 1, 0);
+    for (int i = 0; i < count; ++i) {
+        if (nodes[i].parent >= 0) {
+            ++first_child[nodes[i].parent + 1];
+        }
+    }
+    for (int i = 0; i < count; ++i) {
+        first_child[i + 1] += first_child[i];
+    }
+    vector<int> children(first_child[count]);
+    vector<int> filled(first_child.begin(), first_child.end() - 1);
+    for (int i = 0; i < count; ++i) {
+        if (nodes[i].parent >= 0) {
+            children[filled[nodes[i].parent]++] = i;
+        }
+    }
+
+    /* Walks the trees depth first, keeping the listed order among siblings
+     * and among roots, and numbers the nodes in the order they are reached.
+     */
+    vector<int> order, position(count), stack;
+    order.reserve(count);
+    for (int i = count - 1; i >= 0; --i) {
+        if (nodes[i].parent < 0) {
+            stack.push_back(i);
+        }
+    }
+    while (!stack.empty()) {
+        int node = stack.back();
+        stack.pop_back();
+        position[node] = order.size();
+        order.push_back(node);
+        for (int c = first_child[node + 1] - 1; c >= first_child[node]; --c) {
+            stack.push_back(children[c]);
+        }
+    }
+
+    graph.parent.resize(count);
+    graph.local.resize(count);
+    graph.world.resize(count);
+    for (int i = 0; i < count; ++i) {
+        const Parsed_Node &parsed = nodes[order[i]];
+        graph.parent[i] = parsed.parent < 0 ? -1 : position[parsed.parent];
+        graph.local[i] = Eigen::Map<const Matrix4f>(parsed.local);
+        if (parsed.spin[3] != 0.0f) {
+            Node_Spin spin;
+            spin.node = i;
+            copy(parsed.spin, parsed.spin + 3, spin.axis);
+            spin.speed = parsed.spin[3];
+            copy(parsed.local, parsed.local + 16, spin.rest);
+            graph.spins.push_back(spin);
+        }
+    }
+
+    /* Children come after their parents, so going backwards every subtree
+     * is complete by the time its end is handed to the parent.
+     */
+    graph.subtree_end.resize(count);
+    for (int i = count - 1; i >= 0; --i) {
+        graph.subtree_end[i] = max(graph.subtree_end[i], i + 1);
+        if (graph.parent[i] >= 0) {
+            graph.subtree_end[graph.parent[i]] =
+                max(graph.subtree_end[graph.parent[i]], graph.subtree_end[i]);
+        }
+    }
+
+    /* Sorts the instances by node, keeping their order under each node */
+    graph.first_attached.assign(count + 1, 0);
+    for (Node_Instance &placed : attached) {
+        placed.node = position[placed.node];
+        ++graph.first_attached[placed.node + 1];
+    }
+    for (int i = 0; i < count; ++i) {
+        graph.first_attached[i + 1] += graph.first_attached[i];
+    }
+    graph.attached.resize(attached.size());
+    vector<int> next(graph.first_attached.begin(), graph.first_attached.end() - 1);
+    for (const Node_Instance &placed : attached) {
+        graph.attached[next[placed.node]++] = placed;
+    }
+
+    graph.dirty.assign(count, 0);
+    for (int i = 0; i < count; i = graph.subtree_end[i]) {
+        update_subtree(graph, i);
+    }
+}
+
+/* 'set_node_transform' function:
+ *
+ * Gives a node a new local matrix. The world matrices under it are brought
+ * up to date by the next 'update_scene_graph'.
+ */
+void set_node_transform(Scene_Graph &graph, int node, const Matrix4f &local)
+{
+    graph.local[node] = local;
+    if (!graph.dirty[node]) {
+        graph.dirty[node] = 1;
+        graph.dirty_nodes.push_back(node);
+    }
+}
+
+/* 'update_scene_graph' function:
+ *
+ * Brings the world matrices of every node that was moved, and of
+ * everything under it, up to date. A moved node inside the subtree of
+ * another moved node is covered by that subtree, so each node is done at
+ * most once. Must be called from the main thread, since it counts what it
+ * did in 'render_stats'.
+ */
+void update_scene_graph(Scene_Graph &graph)
+{
+    if (graph.dirty_nodes.empty()) {
+        return;
+    }
+    sort(graph.dirty_nodes.begin(), graph.dirty_nodes.end());
+    int covered = 0;
+    for (int node : graph.dirty_nodes) {
+        graph.dirty[node] = 0;
+        if (node < covered) {
+            continue;
+        }
+        update_subtree(graph, node);
+        covered = graph.subtree_end[node];
+        render_stats.nodes_updated += covered - node;
+        render_stats.instances_moved += graph.first_attached[covered] - graph.first_attached[node];
+    }
+    graph.dirty_nodes.clear();
+}
+
+/* 'update_subtree' function:
+ *
+ * Works out the world matrices of a node and every node under it, and the
+ * 'model' matrices of the instances under them. Both are single runs of
+ * the graph's arrays, walked front to back, and every parent is done
+ * before its children.
+ */
+void update_subtree(Scene_Graph &graph, int node)
+{
+    int end = graph.subtree_end[node];
+    for (int i = node; i < end; ++i) {
+        int parent = graph.parent[i];
+        if (parent < 0) {
+            graph.world[i] = graph.local[i];
+        } else {
+            graph.world[i].noalias() = graph.world[parent] * graph.local[i];
+        }
+    }
+    int first = graph.first_attached[node], last = graph.first_attached[end];
+    for (int i = first; i < last; ++i) {
+        Node_Instance &placed = graph.attached[i];
+        Eigen::Map<Matrix4f> model(placed.inst->model);
+        model.noalias() = graph.world[placed.node] * Eigen::Map<const Matrix4f>(placed.local);
+    }
+}
+
+/* 'animate_nodes' function:
+ *
+ * Turns every spinning node to where it is 'seconds' after the scene
+ * started.
+ */
+void animate_nodes(Scene_Graph &graph, double seconds)
+{
+    for (const Node_Spin &spin : graph.spins) {
+        float angle = fmod(spin.speed * seconds, 2 * M_PI);
+        Eigen::Affine3f turn(Eigen::AngleAxisf(angle,
+            Vector3f(spin.axis[0], spin.axis[1], spin.axis[2]).normalized()));
+        set_node_transform(graph, spin.node, Eigen::Map<const Matrix4f>(spin.rest) * turn.matrix());
+    }
+}
+
+/* 'scene_graph_bytes' function:
+ *
+ * Returns how many bytes the scene graph's arrays take up.
+ */
+size_t scene_graph_bytes(const Scene_Graph &graph)
+{
+    return (graph.parent.capacity() + graph.subtree_end.capacity()
+            + graph.first_attached.capacity() + graph.dirty_nodes.capacity()) * sizeof(int)
+           + (graph.local.capacity() + graph.world.capacity()) * sizeof(Matrix4f)
+           + graph.attached.capacity() * sizeof(Node_Instance)
+           + graph.dirty.capacity()
+           + graph.spins.capacity() * sizeof(Node_Spin);
+}
+
+/* 'set_material' function:
+ *
+ * Tells OpenGL the material of the instance we are about to draw.
+ */
+void set_material(Instance &inst)
+{
+    /* The 'glMaterialfv' and 'glMaterialf' functions tell OpenGL
+    * the material properties of the surface we want to render.
+    * The parameters for 'glMaterialfv' are (in the following order):
+    *
+    * - enum face: Options are 'GL_FRONT' for front-face rendering,
+    *              'GL_BACK' for back-face rendering, and
+    *              'GL_FRONT_AND_BACK' for rendering both sides.
+    * - enum property: this varies on what you are setting up
+    *                  e.g. 'GL_AMBIENT' for ambient reflectance
+    * - float* values: a set of values for the specified property
+    *                  e.g. an array of RGB values for the reflectance
+    *
+    * The 'glMaterialf' function is the same, except the third
+    * parameter is only a single float value instead of an array of
+    * values. 'glMaterialf' is used to set the shininess property.
+    */
+    glMaterialfv(GL_FRONT, GL_AMBIENT, inst.ambient_reflect);
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, inst.diffuse_reflect);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, inst.specular_reflect);
+    glMaterialf(GL_FRONT, GL_SHININESS, inst.shininess);
+}
+
+/* 'bind_object' function:
+ *
+ * Points OpenGL's vertex and normal arrays at the object's buffers.
+ */
+void bind_object(Object &obj)
+{
+    /* The next few lines of code are how we tell OpenGL to render
+    * geometry for us. First, let us look at the 'glVertexPointer'
+    * function.
+    * 
+    * 'glVertexPointer' tells OpenGL the specifications for our
+    * "vertex array". As a recap of the comments from the 'Object'
+    * struct, the "vertex array" stores all the faces of the surface
+    * we want to render. The faces are stored in the array as
+    * consecutive points. For instance, if our surface were a cube,
+    * then our "vertex array" could be the following:
+    *
+    * [face1vertex1, face1vertex2, face1vertex3, face1vertex4,
+    *  face2vertex1, face2vertex2, face2vertex3, face2vertex4,
+    *  face3vertex1, face3vertex2, face3vertex3, face3vertex4,
+    *  face4vertex1, face4vertex2, face4vertex3, face4vertex4,
+    *  face5vertex1, face5vertex2, face5vertex3, face5vertex4,
+    *  face6vertex1, face6vertex2, face6vertex3, face6vertex4]
+    * 
+    * Obviously to us, some of the vertices in the array are repeats.
+    * However, the repeats cannot be avoided since OpenGL requires
+    * this explicit specification of the faces.
+    *
+    * The parameters to the 'glVertexPointer' function are as
+    * follows:
+    *
+    * - int num_points_per_face: this is the parameter that tells
+    *                            OpenGL where the breaks between
+    *                            faces are in the vertex array.
+    *                            Below, we set this parameter to 3,
+    *                            which tells OpenGL to treat every
+    *                            set of 3 consecutive vertices in
+    *                            the vertex array as 1 face. So
+    *                            here, our vertex array is an array
+    *                            of triangle faces.
+    *                            If we were using the example vertex
+    *                            array above, we would have set this
+    *                            parameter to 4 instead of 3.
+    * - enum type_of_coordinates: this parameter tells OpenGL whether
+    *                             our vertex coordinates are ints,
+    *                             floats, doubles, etc. In our case,
+    *                             we are using floats, hence 'GL_FLOAT'.
+    * - sizei stride: this parameter specifies the number of bytes
+    *                 between consecutive vertices in the array.
+    *                 Most often, you will set this parameter to 0
+    *                 (i.e. no offset between consecutive vertices).
+    * - void* pointer_to_array: this parameter is the pointer to
+    *                           our vertex array.
+    *
+    * Our vertex arrays already live in OpenGL buffer objects (see the
+    * 'upload_object' function), so we bind the object's buffer first.
+    * While a buffer is bound to 'GL_ARRAY_BUFFER', the last parameter
+    * is read as a byte offset into that buffer rather than as a pointer.
+    */
+    glBindBuffer(GL_ARRAY_BUFFER, obj.vertex_vbo);
+    glVertexPointer(3, GL_FLOAT, 0, 0);
+    /* The "normal array" is the equivalent array for normals.
+    * Each normal in the normal array corresponds to the vertex
+    * of the same index in the vertex array.
+    *
+    * The 'glNormalPointer' function has the following parameters:
+    *
+    * - enum type_of_normals: e.g. int, float, double, etc
+    * - sizei stride: same as the stride parameter in 'glVertexPointer'
+    * - void* pointer_to_array: the pointer to the normal array
+    */
+    glBindBuffer(GL_ARRAY_BUFFER, obj.normal_vbo);
+    glNormalPointer(GL_FLOAT, 0, 0);
+}
+
+/* 'draw_object' function:
+ *
+ * Draws the currently bound object with the current Modelview Matrix and
+ * material, either as triangles or as a wireframe.
+ */
+void draw_object(Object &obj)
+{
+    int buffer_size = obj.vertex_buffer.size();
+
+    ++render_stats.draw_calls;
+    /* The placeholder box only has edges, so it is always a wireframe */
+    if(!wireframe_mode && &obj != &placeholder_box)
+        /* Finally, we tell OpenGL to render everything with the
+        * 'glDrawArrays' function. The parameters are:
+        * 
+        * - enum mode: in our case, we want to render triangles,
+        *              so we specify 'GL_TRIANGLES'. If we wanted
+        *              to render squares, then we would use
+        *              'GL_QUADS' (for quadrilaterals).
+        * - int start_index: the index of the first vertex
+        *                    we want to render in our array
+        * - int num_vertices: number of vertices to render
+        *
+        * As OpenGL renders all the faces, it automatically takes
+        * into account all the specifications we have given it to
+        * do all the lighting calculations for us. It also applies
+        * the Modelview and Projection matrix transformations to
+        * the vertices and converts everything to screen coordinates
+        * using our Viewport specification. Everything is rendered
+        * onto the off-screen buffer.
+        */
+        glDrawArrays(GL_TRIANGLES, 0, buffer_size);
+    else
+    {
+        /* If we are in "wireframe mode" (see the 'key_pressed'
+        * function for more information), then we want to render
+        * lines instead of triangle surfaces. Rather than drawing
+        * each face frame one at a time with 'GL_LINE_LOOP', we
+        * hand OpenGL the object's list of distinct edges (see
+        * 'build_edge_buffer') and let 'glDrawElements' draw them
+        * all as 'GL_LINES' in one call. The indices come from the
+        * buffer bound to 'GL_ELEMENT_ARRAY_BUFFER'.
+        */
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj.edge_ibo);
+        glDrawElements(GL_LINES, obj.edge_buffer.size(), GL_UNSIGNED_INT, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+}
+
+/* 'frustum_contains' function:
+ *
+ * Returns whether a sphere given in camera space can overlap the view frustum
+ * set up by 'glFrustum'. The four side planes of the frustum all pass through
+ * the camera, so each one is tested with a dot product against its normal.
+ */
+bool frustum_contains(const Vector3f &center, float radius)
+{
+    float x = center[0], y = center[1], z = center[2];
+
+    if (-z + radius < near_param || -z - radius > far_param) {
+        return false;
+    }
+    if ((x * near_param + z * left_param) < -radius * hypotf(near_param, left_param) ||
+        (x * near_param + z * right_param) > radius * hypotf(near_param, right_param) ||
+        (y * near_param + z * bottom_param) < -radius * hypotf(near_param, bottom_param) ||
+        (y * near_param + z * top_param) > radius * hypotf(near_param, top_param)) {
+        return false;
+    }
+    return true;
+}
+
+/* 'draw_meshlets' function:
+ *
+ * Draws the currently bound object one cluster at a time with the current
+ * Modelview Matrix and material, skipping clusters that are outside the view
+ * frustum or whose triangles all face away from the camera. 'GL_CULL_FACE'
+ * would drop those triangles too, but only after transforming and lighting
+ * their vertices; here a whole cluster costs one test.
+ *
+ * A cluster faces away when the camera is behind every one of its triangles.
+ * Seen from the camera, the direction to any point of the cluster must then
+ * be within 90 degrees of every normal in its cone, which holds when the
+ * direction to the cluster's center, widened by its radius, is inside the
+ * cone around the axis narrowed by the cone's half angle. Clusters that
+ * pass are merged into runs of neighbouring clusters, and all the runs are
+ * drawn with a single 'glMultiDrawElements' call.
+ */
+void draw_meshlets(Object &obj)
+{
+    Matrix4f modelview;
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview.data());
+    Eigen::Matrix3f linear = modelview.topLeftCorner<3, 3>();
+    float scale = linear.colwise().norm().maxCoeff();
+
+    /* The camera in object space, where the cones are. A transformation
+     * that mirrors the object also flips which side of its triangles is the
+     * front, so we then only cull against the frustum.
+     */
+    float det = linear.determinant();
+    Vector3f eye = linear.inverse() * -modelview.topRightCorner<3, 1>();
+    bool cull_cones = cluster_culling && det > 0;
+
+    meshlet_counts.clear();
+    meshlet_offsets.clear();
+    GLuint run_end = (GLuint) -1;
+    for (size_t m = 0; m < obj.meshlets.size(); ++m) {
+        const Meshlet &meshlet = obj.meshlets[m];
+        if (cluster_culling) {
+            Vector3f center(meshlet.center[0], meshlet.center[1], meshlet.center[2]);
+            Vector3f to_center = center - eye;
+            Vector3f axis(meshlet.cone_axis[0], meshlet.cone_axis[1], meshlet.cone_axis[2]);
+            if (cull_cones && meshlet.cone_cutoff < 1.0f
+                && to_center.dot(axis) >= meshlet.cone_cutoff * to_center.norm() + meshlet.radius) {
+                ++render_stats.clusters_backface;
+                continue;
+            }
+            Vector3f eye_center = (modelview * center.homogeneous()).head<3>();
+            if (!frustum_contains(eye_center, meshlet.radius * scale)) {
+                ++render_stats.clusters_frustum;
+                continue;
+            }
+        }
+        if (meshlet.first_index == run_end) {
+            meshlet_counts.back() += meshlet.index_count;
+        } else {
+            meshlet_counts.push_back(meshlet.index_count);
+            meshlet_offsets.push_back((const GLvoid *) (meshlet.first_index * sizeof(GLuint)));
+        }
+        run_end = meshlet.first_index + meshlet.index_count;
+        render_stats.triangles_submitted += meshlet.index_count / 3;
+    }
+    render_stats.triangles_total += obj.meshlet_indices.size() / 3;
+
+    ++render_stats.draw_calls;
+    if (meshlet_counts.empty()) {
+        return;
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj.meshlet_ibo);
+    glMultiDrawElements(GL_TRIANGLES, meshlet_counts.data(), GL_UNSIGNED_INT,
+                        meshlet_offsets.data(), meshlet_counts.size());
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+/* 'queue_object' function:
+ *
+ * Adds every instance of the object that can be seen from the camera to the
+ * render queue. 'view' is the Modelview Matrix holding only the camera
+ * transformations, and 'mesh_id' is the object's position in this frame's
+ * list of meshes.
+ */
+void queue_object(Object &obj, int mesh_id, const Matrix4f &view)
+{
+    Eigen::Vector4f center(obj.bound_center.x, obj.bound_center.y, obj.bound_center.z, 1.0f);
+
+    for (size_t i = 0; i < obj.instance_count; ++i)
+    {
+        Instance &inst = obj.instances[i];
+        ++render_stats.instances;
+
+        Eigen::Map<Matrix4f> model(inst.model);
+        Vector3f world_center = (model * center).head<3>();
+        float scale = model.topLeftCorner<3, 3>().colwise().norm().maxCoeff();
+        Vector3f eye_center = (view * world_center.homogeneous()).head<3>();
+        if (!frustum_contains(eye_center, obj.bound_radius * scale)) {
+            ++render_stats.culled;
+            continue;
+        }
+
+        /* Non-negative floats keep their order when read as unsigned ints */
+        float depth = max(0.0f, -eye_center[2]);
+        uint32_t depth_bits;
+        memcpy(&depth_bits, &depth, sizeof(depth_bits));
+
+        Draw_Item item;
+        item.key = ((uint64_t) (mesh_id & 0xffff) << 48)
+                 | ((uint64_t) (inst.material_id & 0xffff) << 32)
+                 | depth_bits;
+        item.obj = &obj;
+        item.inst = &inst;
+        item.world_center[0] = world_center[0];
+        item.world_center[1] = world_center[1];
+        item.world_center[2] = world_center[2];
+        item.world_radius = obj.bound_radius * scale;
+        render_queue.push_back(item);
+    }
+}
+
+/* 'cull_occluded' function:
+ *
+ * Removes the instances in the render queue that are hidden behind other
+ * instances. 'view' is the Modelview Matrix holding only the camera
+ * transformations.
+ *
+ * The few instances that look largest from the camera are the occluders.
+ * Their front-facing triangles are drawn into a small depth buffer on the
+ * CPU, each one at the depth of its farthest corner, so the buffer is never
+ * nearer than what OpenGL will draw. A triangle only covers the pixels that
+ * lie wholly inside it, so a pixel that is partly uncovered, on an outline
+ * or in a gap between occluders, keeps showing what is behind it. Each
+ * thread draws every triangle into its own band of rows. Halving the buffer
+ * again and again, keeping the farthest depth, gives a pyramid of coarser
+ * and coarser buffers.
+ *
+ * An instance is then hidden if the nearest point of its bounding sphere is
+ * farther than the buffer everywhere in the rectangle around the sphere on
+ * screen. We read that rectangle from the level where it covers at most
+ * 4 x 4 pixels, so each test is cheap whatever the size of the instance.
+ */
+void cull_occluded(const Matrix4f &view)
+{
+    vector<Draw_Item> &queue = render_queue;
+    if (!occlusion_culling || queue.size() < 2) {
+        return;
+    }
+    double start = now_seconds();
+
+    /* Picks the instances with the largest bounding spheres on screen.
+     * Chunked meshes keep no vertices in memory, so they cannot occlude.
+     */
+    vector<pair<float, int> > candidates;
+    for (size_t i = 0; i < queue.size(); ++i) {
+        const Object &obj = *queue[i].obj;
+        if (!mesh_ready(obj) || obj.chunked || obj.vertex_buffer.empty()) {
+            continue;
+        }
+        Vector3f center = (view * Eigen::Map<const Vector3f>(queue[i].world_center)
+                                  .homogeneous()).head<3>();
+        float size = queue[i].world_radius / max(near_param, -center[2]);
+        if (size * near_param >= (right_param - left_param) / 16) {
+            candidates.push_back(make_pair(-size, (int) i));
+        }
+    }
+    int num_occluders = min((int) candidates.size(), max_occluders);
+    partial_sort(candidates.begin(), candidates.begin() + num_occluders, candidates.end());
+
+    /* Where each occluder's triangles start in 'occluder_triangles' */
+    vector<int> first_triangle(num_occluders + 1, 0);
+    for (int k = 0; k < num_occluders; ++k) {
+        const Object &obj = *queue[candidates[k].second].obj;
+        first_triangle[k + 1] = first_triangle[k] + obj.vertex_buffer.size() / 3;
+    }
+    render_stats.occluders = num_occluders;
+    render_stats.occluder_triangles = first_triangle[num_occluders];
+
+    int width = occlusion_width;
+    int height = max(1, occlusion_width * window_height / max(1, window_width));
+    float to_px_x = width / (right_param - left_param);
+    float to_px_y = height / (top_param - bottom_param);
+
+    occluder_triangles.resize(first_triangle[num_occluders]);
+    parallel_for(num_occluders, [&](int begin, int end) {
+        for (int k = begin; k < end; ++k) {
+            const Draw_Item &item = queue[candidates[k].second];
+            Matrix4f modelview = view * Eigen::Map<const Matrix4f>(item.inst->model);
+            const vector<Triple> &verts = item.obj->vertex_buffer;
+            for (size_t t = 0; 3 * t + 2 < verts.size(); ++t) {
+                Screen_Triangle &tri = occluder_triangles[first_triangle[k] + t];
+                tri.depth = 0;
+                for (int c = 0; c < 3; ++c) {
+                    const Triple &v = verts[3 * t + c];
+                    Vector3f p = (modelview * Eigen::Vector4f(v.x, v.y, v.z, 1.0f)).head<3>();
+                    /* Triangles reaching past the near plane are left out */
+                    if (-p[2] < near_param) {
+                        tri.depth = -1;
+                        break;
+                    }
+                    tri.x[c] = (near_param * p[0] / -p[2] - left_param) * to_px_x;
+                    tri.y[c] = (near_param * p[1] / -p[2] - bottom_param) * to_px_y;
+                    tri.depth = max(tri.depth, -p[2]);
+                }
+                /* So are the ones facing away, which 'GL_CULL_FACE' drops */
+                float area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0])
+                           - (tri.x[2] - tri.x[0]) * (tri.y[1] - tri.y[0]);
+                if (!(area > 0)) {
+                    tri.depth = -1;
+                }
+            }
+        }
+    });
+
+    /* Draws the triangles. A pixel is inside an edge if its center is at
+     * least half a pixel inside it along both axes, which holds for all four
+     * of its corners when it holds for the center.
+     */
+    if (occlusion_levels.empty() || occlusion_levels[0].width != width
+        || occlusion_levels[0].height != height) {
+        occlusion_levels.clear();
+        for (int w = width, h = height; ; w = (w + 1) / 2, h = (h + 1) / 2) {
+            Depth_Level level = {w, h, vector<float>(w * h)};
+            occlusion_levels.push_back(level);
+            if (w == 1 && h == 1) {
+                break;
+            }
+        }
+    }
+    vector<float> &depth = occlusion_levels[0].depth;
+    parallel_for(height, [&](int row_begin, int row_end) {
+        fill(depth.begin() + row_begin * width, depth.begin() + row_end * width, INFINITY);
+        for (size_t t = 0; t < occluder_triangles.size(); ++t) {
+            const Screen_Triangle &tri = occluder_triangles[t];
+            if (tri.depth < 0) {
+                continue;
+            }
+            float lo_x = min(tri.x[0], min(tri.x[1], tri.x[2]));
+            float hi_x = max(tri.x[0], max(tri.x[1], tri.x[2]));
+            float lo_y = min(tri.y[0], min(tri.y[1], tri.y[2]));
+            float hi_y = max(tri.y[0], max(tri.y[1], tri.y[2]));
+            int x0 = max(0, (int) ceil(lo_x)), x1 = min(width - 1, (int) floor(hi_x) - 1);
+            int y0 = max(row_begin, (int) ceil(lo_y));
+            int y1 = min(row_end - 1, (int) floor(hi_y) - 1);
+            float margin[3];
+            for (int e = 0; e < 3; ++e) {
+                int f = (e + 1) % 3;
+                margin[e] = 0.5f * (fabs(tri.x[f] - tri.x[e]) + fabs(tri.y[f] - tri.y[e]));
+            }
+            for (int py = y0; py <= y1; ++py) {
+                float cy = py + 0.5f;
+                for (int px = x0; px <= x1; ++px) {
+                    float cx = px + 0.5f;
+                    bool inside = true;
+                    for (int e = 0; e < 3 && inside; ++e) {
+                        int f = (e + 1) % 3;
+                        inside = (tri.x[f] - tri.x[e]) * (cy - tri.y[e])
+                               - (tri.y[f] - tri.y[e]) * (cx - tri.x[e]) >= margin[e];
+                    }
+                    float &d = depth[py * width + px];
+                    if (inside && tri.depth < d) {
+                        d = tri.depth;
+                    }
+                }
+            }
+        }
+    });
+
+    for (size_t l = 1; l < occlusion_levels.size(); ++l) {
+        const Depth_Level &fine = occlusion_levels[l - 1];
+        Depth_Level &coarse = occlusion_levels[l];
+        for (int y = 0; y < coarse.height; ++y) {
+            for (int x = 0; x < coarse.width; ++x) {
+                int fx = 2 * x, fy = 2 * y;
+                int fx1 = min(fx + 1, fine.width - 1), fy1 = min(fy + 1, fine.height - 1);
+                coarse.depth[y * coarse.width + x] =
+                    max(max(fine.depth[fy * fine.width + fx], fine.depth[fy * fine.width + fx1]),
+                        max(fine.depth[fy1 * fine.width + fx], fine.depth[fy1 * fine.width + fx1]));
+            }
+        }
+    }
+
+    /* Tests every instance, projecting the 8 corners of the box around its
+     * sphere like 'update_light_block' does.
+     */
+    vector<char> hidden(queue.size(), 0);
+    parallel_for(queue.size(), [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            const Draw_Item &item = queue[i];
+            Vector3f center = (view * Eigen::Map<const Vector3f>(item.world_center)
+                                      .homogeneous()).head<3>();
+            float x = center[0], y = center[1], z = center[2], radius = item.world_radius;
+            if (z + radius > -near_param) {
+                continue;
+            }
+
+            float lo_x = INFINITY, hi_x = -INFINITY, lo_y = INFINITY, hi_y = -INFINITY;
+            for (int corner = 0; corner < 8; ++corner) {
+                float cx = x + ((corner & 1) ? radius : -radius);
+                float cy = y + ((corner & 2) ? radius : -radius);
+                float cz = z + ((corner & 4) ? radius : -radius);
+                float px = near_param * cx / -cz, py = near_param * cy / -cz;
+                lo_x = min(lo_x, px); hi_x = max(hi_x, px);
+                lo_y = min(lo_y, py); hi_y = max(hi_y, py);
+            }
+            int x0 = max(0, (int) floor((lo_x - left_param) * to_px_x));
+            int x1 = min(width - 1, (int) floor((hi_x - left_param) * to_px_x));
+            int y0 = max(0, (int) floor((lo_y - bottom_param) * to_px_y));
+            int y1 = min(height - 1, (int) floor((hi_y - bottom_param) * to_px_y));
+            if (x0 > x1 || y0 > y1) {
+                continue;
+            }
+
+            size_t l = 0;
+            while (l + 1 < occlusion_levels.size()
+                   && ((x1 >> l) - (x0 >> l) > 3 || (y1 >> l) - (y0 >> l) > 3)) {
+                ++l;
+            }
+            const Depth_Level &level = occlusion_levels[l];
+            float nearest = -z - radius;
+            bool covered = true;
+            for (int ly = y0 >> l; ly <= (y1 >> l) && covered; ++ly) {
+                for (int lx = x0 >> l; lx <= (x1 >> l) && covered; ++lx) {
+                    covered = level.depth[ly * level.width + lx] < nearest;
+                }
+            }
+            hidden[i] = covered;
+        }
+    });
+
+    size_t kept = 0;
+    for (size_t i = 0; i < queue.size(); ++i) {
+        if (!hidden[i]) {
+            queue[kept++] = queue[i];
+        }
+    }
+    render_stats.occluded = queue.size() - kept;
+    queue.resize(kept);
+    render_stats.occlusion_ms = 1000 * (now_seconds() - start);
+}
+
+/* 'draw_objects' function:
+ *
+ * This function has OpenGL render our objects to the display screen.
+ *
+ * Rather than drawing instances in the order the scene file lists them, we
+ * first collect every visible instance into a render queue. Each entry gets
+ * a sort key made of (from most to least significant) its mesh, its material,
+ * and its depth, so that sorting the queue puts instances that share a mesh
+ * and then a material next to each other, front to back. While walking the
+ * sorted queue we only rebind buffers when the mesh changes and only call
+ * 'glMaterial' when the material changes.
+ */
+void draw_objects()
+{   
+
+    /* The Modelview Matrix currently holds just the camera transformations,
+     * which is what takes each instance's bounds into camera space.
+     */
+    Matrix4f view;
+    glGetFloatv(GL_MODELVIEW_MATRIX, view.data());
+
+    double cull_start = now_seconds();
+    vector<Draw_Item> &queue = render_queue;
+    queue.clear();
+    ++frame_number;
+
+    int mesh_id = 0;
+    for (map<string, Object>::iterator obj_iter = objects.begin(); 
+                                    obj_iter != objects.end(); obj_iter++) {
+        queue_object(obj_iter->second, mesh_id++, view);
+    }
+    /* The blue-ground that you are walking on when you run the program is the
+     * surface of a big sphere of radius 100. Its mesh is tessellated once in
+     * 'create_ground_sphere' and queued just like the objects loaded from the
+     * scene file.
+     */
+    queue_object(ground, mesh_id++, view);
+
+    cull_occluded(view);
+    render_stats.cull_ms = 1000 * (now_seconds() - cull_start);
+
+    sort(queue.begin(), queue.end(), [](const Draw_Item &a, const Draw_Item &b) {
+        return a.key < b.key;
+    });
+
+    Object *bound_obj = NULL;
+    int bound_material = -1;
+    for (size_t i = 0; i < queue.size(); ++i)
+    {
+        Draw_Item &item = queue[i];
+
+        /* Objects whose mesh is still being read are drawn as boxes */
+        Object *mesh = mesh_ready(*item.obj) ? item.obj : &placeholder_box;
+        if (mesh != bound_obj) {
+            /* Chunked meshes bind each chunk as they draw it */
+            if (!mesh->chunked) {
+                bind_object(*mesh);
+            }
+            bound_obj = mesh;
+            ++render_stats.mesh_binds;
+        }
+        if (item.inst->material_id != bound_material) {
+            /* The Phong shader reads its material from a slice of one big
+             * uniform buffer, so changing material is a single call that
+             * points the material binding at a different slice.
+             */
+            if (phong_mode) {
+                glBindBufferRange(GL_UNIFORM_BUFFER, material_binding, materials_ubo,
+                                  item.inst->material_id * material_stride,
+                                  sizeof(Material_Block));
+            } else {
+                set_material(*item.inst);
+            }
+            bound_material = item.inst->material_id;
+            ++render_stats.material_changes;
+        }
+
+        /* Fixed-function lighting evaluates every enabled light at every
+         * vertex, so we only enable the lights that can reach this instance.
+         * The Phong shader does the same per screen tile instead.
+         */
+        if (!phong_mode) {
+            select_lights(item);
+        }
+
         /* The current Modelview Matrix is actually stored at the top of a
          * stack in OpenGL. The following function, 'glPushMatrix', pushes
          * another copy of the current Modelview Matrix onto the top of the
@@ -921,8 +4418,8 @@ void draw_objects()
          * the copy that is below it 'M2'.
          *
          * The reason we want to use 'glPushMatrix' is because we need to
-         * modify the Modelview Matrix differently for each object we need to
-         * render, since each object is affected by different transformations.
+         * modify the Modelview Matrix differently for each instance we need to
+         * render, since each instance is affected by different transformations.
          * We use 'glPushMatrix' to essentially keep a copy of the Modelview
          * Matrix before it is modified by an object's transformations. This
          * copy is our 'M2'. We then modify 'M1' and use it to render the
@@ -931,208 +4428,1580 @@ void draw_objects()
          * the top of the stack. This way, we have the old unmodified Modelview
          * Matrix back to edit for the next object we want to render.
          */
-        glPushMatrix();
-        /* The following brace is not necessary, but it keeps things organized.
+        glPushMatrix();
+        glMultMatrixf(item.inst->model);
+        if (mesh->chunked) {
+            draw_chunked_object(*mesh);
+        } else if (!wireframe_mode && mesh != &placeholder_box && !mesh->meshlets.empty()) {
+            draw_meshlets(*mesh);
+        } else {
+            draw_object(*mesh);
+        }
+        glPopMatrix();
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/* 'create_ground_sphere' function:
+ *
+ * Fills the given object's buffers with a sphere of the given radius centered
+ * at the origin, split into 'slices' around the z-axis and 'stacks' along it,
+ * just like 'glutSolidSphere' does. Unlike 'glutSolidSphere', we only do the
+ * trigonometry once; the result is drawn like any other object afterwards.
+ */
+void create_ground_sphere(Object &obj, float radius, int slices, int stacks)
+{
+    obj.vertex_buffer.clear();
+    obj.normal_buffer.clear();
+    obj.vertex_buffer.reserve(6 * slices * stacks);
+    obj.normal_buffer.reserve(6 * slices * stacks);
+
+    /* Unit normals of every grid point, row by row from the +z pole down */
+    vector<Triple> grid;
+    grid.reserve((stacks + 1) * (slices + 1));
+    for (int i = 0; i <= stacks; ++i) {
+        float phi = M_PI * i / stacks;
+        for (int j = 0; j <= slices; ++j) {
+            float theta = 2 * M_PI * j / slices;
+            Triple n = {sinf(phi) * cosf(theta), sinf(phi) * sinf(theta), cosf(phi)};
+            grid.push_back(n);
+        }
+    }
+
+    /* Each grid cell becomes two counter-clockwise triangles. The cells that
+     * touch a pole collapse one of their triangles to a line, so we skip it.
+     */
+    int corners[6][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 0}, {1, 1}, {0, 1}};
+    for (int i = 0; i < stacks; ++i) {
+        for (int j = 0; j < slices; ++j) {
+            for (int k = 0; k < 6; ++k) {
+                if ((k < 3 && i == stacks - 1) || (k >= 3 && i == 0)) {
+                    continue;
+                }
+                Triple n = grid[(i + corners[k][0]) * (slices + 1) + j + corners[k][1]];
+                Triple v = {radius * n.x, radius * n.y, radius * n.z};
+                obj.vertex_buffer.push_back(v);
+                obj.normal_buffer.push_back(n);
+            }
+        }
+    }
+}
+
+/* 'weld_vertices' function:
+ *
+ * Maps every vertex to the first vertex with the same position, by sorting
+ * the vertex indices by position.
+ */
+void weld_vertices(const vector<Triple> &verts, vector<GLuint> &shared)
+{
+    int num_vertices = verts.size();
+    vector<GLuint> order(num_vertices);
+    for (int i = 0; i < num_vertices; ++i) {
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), [&verts](GLuint a, GLuint b) {
+        if (verts[a].x != verts[b].x) return verts[a].x < verts[b].x;
+        if (verts[a].y != verts[b].y) return verts[a].y < verts[b].y;
+        if (verts[a].z != verts[b].z) return verts[a].z < verts[b].z;
+        return a < b;
+    });
+
+    shared.resize(num_vertices);
+    for (int i = 0; i < num_vertices; ++i) {
+        GLuint prev = (i > 0) ? order[i - 1] : order[i];
+        bool same = i > 0 && verts[prev].x == verts[order[i]].x
+                          && verts[prev].y == verts[order[i]].y
+                          && verts[prev].z == verts[order[i]].z;
+        shared[order[i]] = same ? shared[prev] : order[i];
+    }
+}
+
+/* 'build_edge_buffer' function:
+ *
+ * Fills the object's 'edge_buffer' with every distinct edge of its triangles.
+ *
+ * Our vertex array repeats a vertex once for every face that uses it, so two
+ * neighbouring triangles do not share indices for their common edge. We first
+ * map every vertex to one shared index per position ('weld_vertices'). Each
+ * triangle edge then becomes a pair of these shared indices, and sorting the
+ * pairs lets us drop the duplicates.
+ */
+void build_edge_buffer(Object &obj)
+{
+    int num_vertices = obj.vertex_buffer.size();
+    vector<GLuint> shared;
+    weld_vertices(obj.vertex_buffer, shared);
+
+    /* Packs each edge as (smaller index, larger index) into one 64-bit key */
+    vector<uint64_t> edges;
+    edges.reserve(num_vertices);
+    for (int j = 0; j + 2 < num_vertices; j += 3) {
+        for (int k = 0; k < 3; ++k) {
+            GLuint a = shared[j + k];
+            GLuint b = shared[j + (k + 1) % 3];
+            if (a == b) {
+                continue;
+            }
+            edges.push_back(((uint64_t) min(a, b) << 32) | max(a, b));
+        }
+    }
+    sort(edges.begin(), edges.end());
+    edges.erase(unique(edges.begin(), edges.end()), edges.end());
+
+    obj.edge_buffer.clear();
+    obj.edge_buffer.reserve(2 * edges.size());
+    for (size_t e = 0; e < edges.size(); ++e) {
+        obj.edge_buffer.push_back((GLuint) (edges[e] >> 32));
+        obj.edge_buffer.push_back((GLuint) (edges[e] & 0xffffffff));
+    }
+}
+
+/* 'compute_bounds' function:
+ *
+ * Finds a sphere around all of the object's vertices: the center of their
+ * bounding box and the distance to the farthest vertex from it.
+ */
+void compute_bounds(Object &obj)
+{
+    if (obj.vertex_buffer.empty()) {
+        return;
+    }
+
+    Triple lo = obj.vertex_buffer[0], hi = obj.vertex_buffer[0];
+    for (size_t i = 1; i < obj.vertex_buffer.size(); ++i) {
+        const Triple &v = obj.vertex_buffer[i];
+        lo.x = min(lo.x, v.x); lo.y = min(lo.y, v.y); lo.z = min(lo.z, v.z);
+        hi.x = max(hi.x, v.x); hi.y = max(hi.y, v.y); hi.z = max(hi.z, v.z);
+    }
+    obj.bound_center = {0.5f * (lo.x + hi.x), 0.5f * (lo.y + hi.y), 0.5f * (lo.z + hi.z)};
+
+    float radius_sq = 0.0f;
+    for (size_t i = 0; i < obj.vertex_buffer.size(); ++i) {
+        const Triple &v = obj.vertex_buffer[i];
+        float dx = v.x - obj.bound_center.x;
+        float dy = v.y - obj.bound_center.y;
+        float dz = v.z - obj.bound_center.z;
+        radius_sq = max(radius_sq, dx * dx + dy * dy + dz * dz);
+    }
+    obj.bound_radius = sqrt(radius_sq);
+}
+
+/* 'assign_material_ids' function:
+ *
+ * Gives every instance in the scene (and the ground) a material id, where
+ * instances with exactly the same reflectances and shininess share an id.
+ */
+void assign_material_ids()
+{
+    map<Material_Key, int> ids;
+    materials.clear();
+    for (map<string, Object>::iterator obj_iter = objects.begin();
+                                    obj_iter != objects.end(); obj_iter++) {
+        for (size_t i = 0; i < obj_iter->second.instance_count; ++i) {
+            number_material(ids, obj_iter->second.instances[i]);
+        }
+    }
+    number_material(ids, ground_instance);
+}
+
+/* 'number_material' function:
+ *
+ * Gives the instance the id of its material in 'ids', adding the material
+ * to 'ids' and to 'materials' if it is new. The id is only written if it
+ * changes, so instances mapped from a binary scene file that already has
+ * the right ids are not copied.
+ */
+void number_material(map<Material_Key, int> &ids, Instance &inst)
+{
+    Material_Key material;
+    copy(inst.ambient_reflect, inst.ambient_reflect + 3, material.begin());
+    copy(inst.diffuse_reflect, inst.diffuse_reflect + 3, material.begin() + 3);
+    copy(inst.specular_reflect, inst.specular_reflect + 3, material.begin() + 6);
+    material[9] = inst.shininess;
+
+    map<Material_Key, int>::iterator found = ids.find(material);
+    if (found == ids.end()) {
+        found = ids.insert(make_pair(material, (int) ids.size())).first;
+
+        Material_Block block = {
+            {inst.ambient_reflect[0], inst.ambient_reflect[1], inst.ambient_reflect[2], 1.0f},
+            {inst.diffuse_reflect[0], inst.diffuse_reflect[1], inst.diffuse_reflect[2], 1.0f},
+            {inst.specular_reflect[0], inst.specular_reflect[1], inst.specular_reflect[2], inst.shininess}};
+        materials.push_back(block);
+    }
+    if (inst.material_id != found->second) {
+        inst.material_id = found->second;
+    }
+}
+
+/* 'print_render_stats' function:
+ *
+ * Prints the render queue counters of the most recent frame. Without the
+ * queue, every visible instance would cost one mesh bind and one material
+ * change, so those two numbers are the ones to compare against 'drawn'.
+ */
+void print_render_stats()
+{
+    cout << "instances: " << render_stats.instances
+         << ", culled: " << render_stats.culled
+         << ", drawn: " << render_stats.draw_calls
+         << ", mesh binds: " << render_stats.mesh_binds
+         << ", material changes: " << render_stats.material_changes << endl;
+    if (render_stats.nodes_updated > 0) {
+        cout << "scene graph nodes updated: " << render_stats.nodes_updated
+             << ", instances moved: " << render_stats.instances_moved << endl;
+    }
+    if (phong_mode) {
+        cout << "lights: " << lights.size()
+             << ", binned: " << render_stats.lights_binned
+             << ", light-tile pairs: " << render_stats.light_tile_pairs << endl;
+    } else {
+        cout << "lights: " << lights.size()
+             << ", light-object pairs: " << render_stats.light_object_pairs
+             << " (of " << lights.size() * render_stats.draw_calls << ")" << endl;
+    }
+    if (render_stats.triangles_total > 0) {
+        cout << "triangles submitted: " << render_stats.triangles_submitted
+             << " of " << render_stats.triangles_total << " ("
+             << 100.0 * (render_stats.triangles_total - render_stats.triangles_submitted)
+                / render_stats.triangles_total << "% culled)"
+             << ", clusters facing away: " << render_stats.clusters_backface
+             << ", outside view: " << render_stats.clusters_frustum << endl;
+    }
+    if (occlusion_culling) {
+        cout << "occluders: " << render_stats.occluders
+             << " (" << render_stats.occluder_triangles << " triangles)"
+             << ", occluded instances: " << render_stats.occluded
+             << ", occlusion culling: " << render_stats.occlusion_ms << " ms" << endl;
+    }
+    if (chunk_hits + chunk_misses > 0) {
+        cout << "chunks drawn: " << render_stats.chunks_drawn
+             << ", culled: " << render_stats.chunks_culled
+             << ", over budget: " << render_stats.chunks_over_budget << endl
+             << "chunk cache hits: " << chunk_hits
+             << ", misses: " << chunk_misses
+             << ", evictions: " << chunk_evictions
+             << ", streamed: " << chunk_bytes_streamed / 1048576.0 << " MB"
+             << ", resident: " << chunk_bytes_resident / 1048576.0 << " of "
+             << chunk_budget / 1048576.0 << " MB" << endl;
+    }
+}
+
+/* 'object_cpu_bytes' function:
+ *
+ * Returns how many bytes of our memory the object's mesh takes up: its
+ * vertex, normal and index arrays and its clusters. The file a chunked
+ * mesh is mapped from is left out, since the operating system reads it in
+ * and drops it as it likes.
+ */
+size_t object_cpu_bytes(const Object &obj)
+{
+    size_t bytes = (obj.vertex_buffer.capacity() + obj.normal_buffer.capacity()) * sizeof(Triple)
+                   + (obj.edge_buffer.capacity() + obj.meshlet_indices.capacity()) * sizeof(GLuint)
+                   + obj.meshlets.capacity() * sizeof(Meshlet);
+    if (obj.chunked) {
+        const Chunked_Mesh &mesh = *obj.chunked;
+        bytes += sizeof(Chunked_Mesh) + mesh.chunk_vbos.capacity() * sizeof(GLuint)
+                 + mesh.chunk_last_used.capacity() * sizeof(int)
+                 + mesh.cache_entries.capacity() * sizeof(Chunk_List::iterator);
+    }
+    return bytes;
+}
+
+/* 'object_gpu_bytes' function:
+ *
+ * Returns how many bytes of OpenGL buffers the object's mesh takes up,
+ * counting the chunks of a chunked mesh that are uploaded right now.
+ */
+size_t object_gpu_bytes(const Object &obj)
+{
+    size_t bytes = mesh_bytes(obj);
+    if (obj.chunked) {
+        const Chunked_Mesh &mesh = *obj.chunked;
+        for (uint32_t i = 0; i < mesh.chunk_count; ++i) {
+            if (mesh.chunk_vbos[i] != 0) {
+                bytes += mesh.chunks[i].vertex_count * 2 * sizeof(Triple);
+            }
+        }
+    }
+    return bytes;
+}
+
+/* 'peak_rss_bytes' function:
+ *
+ * Returns the most memory the process has had resident at once.
+ */
+size_t peak_rss_bytes()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (size_t) usage.ru_maxrss * 1024;
+}
+
+/* 'current_rss_bytes' function:
+ *
+ * Returns how much memory the process has resident right now, or 0 if
+ * the system does not tell us.
+ */
+size_t current_rss_bytes()
+{
+    ifstream statm("/proc/self/statm");
+    size_t total_pages = 0, resident_pages = 0;
+    if (!(statm >> total_pages >> resident_pages)) {
+        return 0;
+    }
+    return resident_pages * sysconf(_SC_PAGESIZE);
+}
+
+/* 'format_bytes' function:
+ *
+ * Returns a byte count in B, KB, MB or GB, whichever reads best.
+ */
+string format_bytes(size_t bytes)
+{
+    const char *units[] = {"B", "KB", "MB", "GB"};
+    double value = bytes;
+    int unit = 0;
+    while (value >= 1024 && unit < 3) {
+        value /= 1024;
+        ++unit;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), unit == 0 ? "%.0f %s" : "%.1f %s", value, units[unit]);
+    return text;
+}
+
+/* 'print_memory_report' function:
+ *
+ * Prints how much of our memory (CPU) and of OpenGL's buffers (GPU) each
+ * mesh and the instances of it in the shown scene take up, then the totals
+ * of every part of the viewer and how much memory the process has resident.
+ *
+ * Instances keep only their baked 'model' matrix and materials, so each
+ * one costs 'sizeof(Instance)' bytes wherever it lives: in the instance
+ * table of its scene, or in the mapped file of a binary scene.
+ */
+void print_memory_report()
+{
+    cout << "Memory:\n" << left << setw(40) << "  mesh" << right << setw(12) << "CPU"
+         << setw(12) << "GPU" << setw(12) << "instances" << setw(14) << "instance CPU" << "\n";
+    size_t mesh_cpu = 0, mesh_gpu = 0;
+    for (const auto &entry : objects) {
+        const Object &obj = entry.second;
+        size_t cpu = object_cpu_bytes(obj), gpu = object_gpu_bytes(obj);
+        mesh_cpu += cpu;
+        mesh_gpu += gpu;
+        string name = obj.filename.substr(obj.filename.find_last_of('/') + 1);
+        cout << "  " << left << setw(38) << name.substr(0, 37) << right
+             << setw(12) << format_bytes(cpu) << setw(12) << format_bytes(gpu)
+             << setw(12) << obj.instance_count
+             << setw(14) << format_bytes(obj.instance_count * sizeof(Instance)) << "\n";
+    }
+
+    /* Instances of every resident scene, not just the shown one */
+    size_t instance_count = 0, instance_cpu = 0, instance_mapped = 0;
+    int resident = 0;
+    for (const Scene_Slot &slot : scene_slots) {
+        if (!slot.scene) {
+            continue;
+        }
+        ++resident;
+        for (const auto &entry : slot.scene->objects) {
+            instance_count += entry.second.instance_count;
+        }
+        instance_cpu += slot.scene->instance_table.capacity() * sizeof(Instance)
+                        + slot.materials.capacity() * sizeof(Material_Block)
+                        + scene_graph_bytes(slot.scene->graph);
+        if (slot.scene->binary_file) {
+            instance_mapped += slot.scene->binary_file->size;
+        }
+    }
+
+    size_t ground_cpu = object_cpu_bytes(ground) + object_cpu_bytes(placeholder_box);
+    size_t ground_gpu = object_gpu_bytes(ground) + object_gpu_bytes(placeholder_box);
+    size_t culling_cpu = render_queue.capacity() * sizeof(Draw_Item)
+                         + occluder_triangles.capacity() * sizeof(Screen_Triangle);
+    for (const Depth_Level &level : occlusion_levels) {
+        culling_cpu += level.depth.capacity() * sizeof(float);
+    }
+    size_t shading_cpu = lights.capacity() * sizeof(Point_Light)
+                         + materials.capacity() * sizeof(Material_Block);
+    size_t shading_gpu = materials_ubo != 0 ? materials.size() * material_stride : 0;
+
+    cout << "  " << left << setw(38) << "all meshes" << right << setw(12)
+         << format_bytes(mesh_cpu) << setw(12) << format_bytes(mesh_gpu) << "\n"
+         << "  " << left << setw(38) << "ground and placeholder" << right << setw(12)
+         << format_bytes(ground_cpu) << setw(12) << format_bytes(ground_gpu) << "\n"
+         << "  " << left << setw(38) << "instances, nodes and materials" << right << setw(12)
+         << format_bytes(instance_cpu) << setw(12) << "" << setw(12) << instance_count
+         << " in " << resident << " resident scene(s)";
+    if (instance_mapped > 0) {
+        cout << ", " << format_bytes(instance_mapped) << " mapped";
+    }
+    cout << "\n"
+         << "  " << left << setw(38) << "render queue and culling" << right << setw(12)
+         << format_bytes(culling_cpu) << "\n"
+         << "  " << left << setw(38) << "lights and shader materials" << right << setw(12)
+         << format_bytes(shading_cpu) << setw(12) << format_bytes(shading_gpu) << "\n"
+         << "  " << left << setw(38) << "total" << right << setw(12)
+         << format_bytes(mesh_cpu + ground_cpu + instance_cpu + culling_cpu + shading_cpu)
+         << setw(12) << format_bytes(mesh_gpu + ground_gpu + shading_gpu) << "\n";
+
+    {
+        lock_guard<mutex> lock(parse_scratch_mutex);
+        cout << "Largest OBJ parse scratch: " << format_bytes(parse_scratch_peak) << "\n";
+    }
+    cout << "Resident: " << format_bytes(current_rss_bytes())
+         << ", peak " << format_bytes(peak_rss_bytes());
+    if (load_peak_rss > 0) {
+        cout << " (" << format_bytes(load_peak_rss) << " by the end of loading)";
+    }
+    cout << endl;
+}
+
+/* 'upload_object' function:
+ *
+ * Copies the object's vertex and normal arrays into OpenGL buffer objects.
+ * 'GL_STATIC_DRAW' hints that we fill the buffers once and draw from them many
+ * times, so OpenGL can keep them in video memory instead of reading our
+ * vectors again every frame.
+ */
+void upload_object(Object &obj)
+{
+    /* Chunked meshes are uploaded a chunk at a time by 'use_chunk' */
+    if (obj.chunked) {
+        return;
+    }
+    compute_bounds(obj);
+
+    if (obj.vertex_vbo == 0) {
+        glGenBuffers(1, &obj.vertex_vbo);
+        glGenBuffers(1, &obj.normal_vbo);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, obj.vertex_vbo);
+    glBufferData(GL_ARRAY_BUFFER, obj.vertex_buffer.size() * sizeof(Triple),
+                 obj.vertex_buffer.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, obj.normal_vbo);
+    glBufferData(GL_ARRAY_BUFFER, obj.normal_buffer.size() * sizeof(Triple),
+                 obj.normal_buffer.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    /* The wireframe edges go in an index buffer of their own */
+    if (obj.edge_buffer.empty()) {
+        build_edge_buffer(obj);
+    }
+    if (obj.edge_ibo == 0) {
+        glGenBuffers(1, &obj.edge_ibo);
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj.edge_ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, obj.edge_buffer.size() * sizeof(GLuint),
+                 obj.edge_buffer.data(), GL_STATIC_DRAW);
+
+    /* So do the triangles of the clusters */
+    if (obj.meshlets.empty()) {
+        build_meshlets(obj);
+    }
+    if (obj.meshlet_ibo == 0) {
+        glGenBuffers(1, &obj.meshlet_ibo);
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj.meshlet_ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, obj.meshlet_indices.size() * sizeof(GLuint),
+                 obj.meshlet_indices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+/* 'spread_bits' function:
+ *
+ * Moves the low 10 bits of 'v' two bits apart (bit i goes to bit 3i), so
+ * that three such numbers can be interleaved into a Morton code.
+ */
+uint32_t spread_bits(uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+/* 'morton_order' function:
+ *
+ * Lists the triangles of a vertex array sorted by the Morton code of their
+ * centers within the bounding box of all the vertices. Following a Morton
+ * curve visits a 3D grid one small block at a time, so triangles that are
+ * close in this order are close in space.
+ */
+void morton_order(const vector<Triple> &verts, vector<GLuint> &order)
+{
+    uint32_t triangle_count = verts.size() / 3;
+    Vector3f low = Vector3f::Constant(INFINITY), high = Vector3f::Constant(-INFINITY);
+    for (size_t i = 0; i < verts.size(); ++i) {
+        Vector3f v(verts[i].x, verts[i].y, verts[i].z);
+        low = low.cwiseMin(v);
+        high = high.cwiseMax(v);
+    }
+    Vector3f extent = (high - low).cwiseMax(Vector3f::Constant(1e-20f));
+    vector<pair<uint32_t, uint32_t> > codes(triangle_count);
+    for (uint32_t t = 0; t < triangle_count; ++t) {
+        Vector3f center = Vector3f::Zero();
+        for (int k = 0; k < 3; ++k) {
+            const Triple &v = verts[3 * t + k];
+            center += Vector3f(v.x, v.y, v.z) / 3.0f;
+        }
+        Vector3f cell = ((center - low).cwiseQuotient(extent) * 1023.0f)
+                        .cwiseMax(Vector3f::Zero()).cwiseMin(Vector3f::Constant(1023.0f));
+        uint32_t code = spread_bits((uint32_t) cell[0])
+                      | (spread_bits((uint32_t) cell[1]) << 1)
+                      | (spread_bits((uint32_t) cell[2]) << 2);
+        codes[t] = make_pair(code, t);
+    }
+    sort(codes.begin(), codes.end());
+
+    order.resize(triangle_count);
+    for (uint32_t t = 0; t < triangle_count; ++t) {
+        order[t] = codes[t].second;
+    }
+}
+
+/* 'build_meshlets' function:
+ *
+ * Splits the object's triangles into clusters of at most 64 distinct vertices
+ * and 124 triangles. Walking the triangles in Morton order keeps each cluster
+ * small in space, which makes its bounding sphere tight and its normals
+ * likely to point the same way. Nothing here touches OpenGL, so it can run
+ * on any thread.
+ */
+void build_meshlets(Object &obj)
+{
+    const int max_vertices = 64, max_triangles = 124;
+    const vector<Triple> &verts = obj.vertex_buffer;
+
+    obj.meshlets.clear();
+    obj.meshlet_indices.clear();
+    obj.meshlet_indices.reserve(verts.size());
+
+    vector<GLuint> shared, order;
+    weld_vertices(verts, shared);
+    morton_order(verts, order);
+
+    /* 'last_cluster' marks the shared vertices already in the cluster */
+    vector<int> last_cluster(verts.size(), -1);
+    int vertex_count = 0;
+    for (size_t i = 0; i < order.size(); ++i) {
+        GLuint t = order[i];
+        int cluster = obj.meshlets.size() - 1;
+        int new_vertices = 0;
+        for (int k = 0; k < 3; ++k) {
+            new_vertices += (cluster < 0 || last_cluster[shared[3 * t + k]] != cluster);
+        }
+        if (cluster < 0 || vertex_count + new_vertices > max_vertices
+            || obj.meshlets[cluster].index_count == 3 * max_triangles) {
+            Meshlet meshlet = {};
+            meshlet.first_index = obj.meshlet_indices.size();
+            obj.meshlets.push_back(meshlet);
+            ++cluster;
+            vertex_count = 0;
+        }
+        for (int k = 0; k < 3; ++k) {
+            GLuint v = shared[3 * t + k];
+            if (last_cluster[v] != cluster) {
+                last_cluster[v] = cluster;
+                ++vertex_count;
+            }
+            obj.meshlet_indices.push_back(3 * t + k);
+        }
+        obj.meshlets[cluster].index_count += 3;
+    }
+
+    for (size_t m = 0; m < obj.meshlets.size(); ++m) {
+        Meshlet &meshlet = obj.meshlets[m];
+        const GLuint *indices = &obj.meshlet_indices[meshlet.first_index];
+
+        Vector3f low = Vector3f::Constant(INFINITY), high = Vector3f::Constant(-INFINITY);
+        Vector3f axis = Vector3f::Zero();
+        vector<Vector3f> normals;
+        for (GLuint j = 0; j < meshlet.index_count; j += 3) {
+            Vector3f p[3];
+            for (int k = 0; k < 3; ++k) {
+                const Triple &v = verts[indices[j + k]];
+                p[k] = Vector3f(v.x, v.y, v.z);
+                low = low.cwiseMin(p[k]);
+                high = high.cwiseMax(p[k]);
+            }
+            /* The winding gives the side that 'GL_CULL_FACE' treats as front */
+            Vector3f n = (p[1] - p[0]).cross(p[2] - p[0]);
+            if (n.norm() > 0) {
+                normals.push_back(n.normalized());
+                axis += normals.back();
+            }
+        }
+
+        Vector3f center = (low + high) / 2;
+        float radius = 0;
+        for (GLuint j = 0; j < meshlet.index_count; ++j) {
+            const Triple &v = verts[indices[j]];
+            radius = max(radius, (Vector3f(v.x, v.y, v.z) - center).norm());
+        }
+
+        /* The cone must hold every normal, so its half angle comes from the
+         * normal furthest from the average. A cone wider than about 85
+         * degrees could only be culled from almost straight behind, so such
+         * clusters are always drawn.
+         */
+        float min_dot = -1;
+        if (axis.norm() > 0) {
+            axis.normalize();
+            min_dot = 1;
+            for (size_t j = 0; j < normals.size(); ++j) {
+                min_dot = min(min_dot, normals[j].dot(axis));
+            }
+        }
+        for (int k = 0; k < 3; ++k) {
+            meshlet.center[k] = center[k];
+            meshlet.cone_axis[k] = axis[k];
+        }
+        meshlet.radius = radius;
+        meshlet.cone_cutoff = (min_dot > 0.1f) ? sqrtf(1 - min_dot * min_dot) : 1.0f;
+    }
+}
+
+/* 'convert_to_chunks' function:
+ *
+ * Reads an OBJ file and writes it as a ".chunks" file (see
+ * 'Chunk_File_Header'), 'triangles_per_chunk' triangles to a chunk. The
+ * conversion itself still holds the whole mesh in memory; only viewing the
+ * result does not.
+ *
+ * @throws invalid_argument if it fails to read or write a file
+ */
+void convert_to_chunks(string obj_filename, string chunk_filename)
+{
+    Object obj;
+    parseObjFile(obj_filename, obj);
+    compute_bounds(obj);
+    uint32_t triangle_count = obj.vertex_buffer.size() / 3;
+    vector<GLuint> order;
+    morton_order(obj.vertex_buffer, order);
+
+    ofstream file(chunk_filename, ios::binary);
+    if (file.fail()) {
+        throw invalid_argument("Could not write chunk file '" + chunk_filename + "'.");
+    }
+
+    uint32_t chunk_count = (triangle_count + triangles_per_chunk - 1) / triangles_per_chunk;
+    Chunk_File_Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "CHUNKS1", 8);
+    header.chunk_count = chunk_count;
+    header.triangle_count = triangle_count;
+    header.center[0] = obj.bound_center.x;
+    header.center[1] = obj.bound_center.y;
+    header.center[2] = obj.bound_center.z;
+    header.radius = obj.bound_radius;
+
+    const uint64_t page = 4096;
+    vector<Mesh_Chunk> table(chunk_count);
+    uint64_t offset = sizeof(header) + chunk_count * sizeof(Mesh_Chunk);
+    Object chunk_obj;
+    for (uint32_t c = 0; c < chunk_count; ++c) {
+        chunk_obj.vertex_buffer.clear();
+        chunk_obj.normal_buffer.clear();
+        uint32_t end = min(triangle_count, (c + 1) * triangles_per_chunk);
+        for (uint32_t i = c * triangles_per_chunk; i < end; ++i) {
+            for (int k = 0; k < 3; ++k) {
+                chunk_obj.vertex_buffer.push_back(obj.vertex_buffer[3 * order[i] + k]);
+                chunk_obj.normal_buffer.push_back(obj.normal_buffer[3 * order[i] + k]);
+            }
+        }
+        compute_bounds(chunk_obj);
+
+        offset = (offset + page - 1) / page * page;
+        Mesh_Chunk &chunk = table[c];
+        memset(&chunk, 0, sizeof(chunk));
+        chunk.center[0] = chunk_obj.bound_center.x;
+        chunk.center[1] = chunk_obj.bound_center.y;
+        chunk.center[2] = chunk_obj.bound_center.z;
+        chunk.radius = chunk_obj.bound_radius;
+        chunk.offset = offset;
+        chunk.vertex_count = chunk_obj.vertex_buffer.size();
+
+        size_t bytes = chunk.vertex_count * sizeof(Triple);
+        file.seekp(offset);
+        file.write((const char *) chunk_obj.vertex_buffer.data(), bytes);
+        file.write((const char *) chunk_obj.normal_buffer.data(), bytes);
+        offset += 2 * bytes;
+    }
+    file.seekp(0);
+    file.write((const char *) &header, sizeof(header));
+    file.write((const char *) table.data(), table.size() * sizeof(Mesh_Chunk));
+    if (file.fail()) {
+        throw invalid_argument("Could not write chunk file '" + chunk_filename + "'.");
+    }
+
+    cout << "Wrote " << triangle_count << " triangles in " << chunk_count
+         << " chunks to " << chunk_filename << "\n";
+}
+
+/* 'open_chunked_mesh' function:
+ *
+ * Maps a ".chunks" file into memory and checks that its chunk table fits
+ * in the file. The object takes the bounds of the whole mesh.
+ *
+ * @throws invalid_argument if it fails to read the file
+ */
+void open_chunked_mesh(string filename, Object &obj)
+{
+    shared_ptr<Chunked_Mesh> mesh(new Chunked_Mesh());
+    mesh->fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (mesh->fd < 0 || fstat(mesh->fd, &info) != 0) {
+        throw invalid_argument("Could not read chunk file '" + filename + "'.");
+    }
+    mesh->size = info.st_size;
+    string not_chunks = "File " + filename + " is not a valid .chunks file.";
+    if (mesh->size < sizeof(Chunk_File_Header)) {
+        throw invalid_argument(not_chunks);
+    }
+    void *data = mmap(NULL, mesh->size, PROT_READ, MAP_SHARED, mesh->fd, 0);
+    if (data == MAP_FAILED) {
+        throw invalid_argument("Could not read chunk file '" + filename + "'.");
+    }
+    mesh->data = (unsigned char *) data;
+
+    const Chunk_File_Header *header = (const Chunk_File_Header *) mesh->data;
+    if (memcmp(header->magic, "CHUNKS1", 8) != 0
+        || sizeof(Chunk_File_Header) + (uint64_t) header->chunk_count * sizeof(Mesh_Chunk)
+           > mesh->size) {
+        throw invalid_argument(not_chunks);
+    }
+    mesh->chunks = (const Mesh_Chunk *) (mesh->data + sizeof(Chunk_File_Header));
+    mesh->chunk_count = header->chunk_count;
+    for (uint32_t i = 0; i < mesh->chunk_count; ++i) {
+        const Mesh_Chunk &chunk = mesh->chunks[i];
+        if (chunk.offset + 2 * (uint64_t) chunk.vertex_count * sizeof(Triple) > mesh->size) {
+            throw invalid_argument(not_chunks);
+        }
+    }
+    mesh->chunk_vbos.assign(mesh->chunk_count, 0);
+    mesh->chunk_last_used.assign(mesh->chunk_count, -1);
+    mesh->cache_entries.resize(mesh->chunk_count);
+
+    obj.bound_center = (Triple) {header->center[0], header->center[1], header->center[2]};
+    obj.bound_radius = header->radius;
+    obj.chunked = mesh;
+}
+
+/* 'use_chunk' function:
+ *
+ * Returns the buffer object holding chunk 'i' of the mesh, uploading the
+ * chunk first if it is not in the chunk cache. Returns 0 if the chunk does
+ * not fit in 'chunk_budget' this frame.
+ */
+GLuint use_chunk(Chunked_Mesh &mesh, uint32_t i)
+{
+    if (mesh.chunk_vbos[i] != 0) {
+        ++chunk_hits;
+        chunk_cache.splice(chunk_cache.begin(), chunk_cache, mesh.cache_entries[i]);
+        mesh.chunk_last_used[i] = frame_number;
+        return mesh.chunk_vbos[i];
+    }
+
+    const Mesh_Chunk &chunk = mesh.chunks[i];
+    size_t bytes = 2 * (size_t) chunk.vertex_count * sizeof(Triple);
+    while (chunk_bytes_resident + bytes > chunk_budget && !chunk_cache.empty()) {
+        pair<Chunked_Mesh *, uint32_t> oldest = chunk_cache.back();
+        if (oldest.first->chunk_last_used[oldest.second] == frame_number) {
+            break;
+        }
+        evict_chunk(*oldest.first, oldest.second);
+        ++chunk_evictions;
+    }
+    if (chunk_bytes_resident + bytes > chunk_budget) {
+        ++render_stats.chunks_over_budget;
+        return 0;
+    }
+
+    /* Reading the mapped bytes is what makes the operating system load
+     * them from disk. Once they are in the buffer object, we tell it that
+     * it may drop its copy of those pages.
+     */
+    ++chunk_misses;
+    GLuint vbo;
+    glGenBuffers(1, &vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, bytes, mesh.data + chunk.offset, GL_STATIC_DRAW);
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t first_page = chunk.offset / page * page;
+    madvise(mesh.data + first_page, chunk.offset + bytes - first_page, MADV_DONTNEED);
+
+    chunk_bytes_streamed += bytes;
+    chunk_bytes_resident += bytes;
+    mesh.chunk_vbos[i] = vbo;
+    mesh.chunk_last_used[i] = frame_number;
+    mesh.cache_entries[i] = chunk_cache.insert(chunk_cache.begin(), make_pair(&mesh, i));
+    return vbo;
+}
+
+/* 'evict_chunk' function:
+ *
+ * Drops chunk 'i' of the mesh from the chunk cache.
+ */
+void evict_chunk(Chunked_Mesh &mesh, uint32_t i)
+{
+    glDeleteBuffers(1, &mesh.chunk_vbos[i]);
+    mesh.chunk_vbos[i] = 0;
+    chunk_bytes_resident -= 2 * (size_t) mesh.chunks[i].vertex_count * sizeof(Triple);
+    chunk_cache.erase(mesh.cache_entries[i]);
+}
+
+/* 'release_chunks' function:
+ *
+ * Drops every chunk of the mesh from the chunk cache.
+ */
+void release_chunks(Chunked_Mesh &mesh)
+{
+    for (uint32_t i = 0; i < mesh.chunk_vbos.size(); ++i) {
+        if (mesh.chunk_vbos[i] != 0) {
+            evict_chunk(mesh, i);
+        }
+    }
+}
+
+/* 'Chunked_Mesh' destructor:
+ *
+ * Drops any chunks still uploaded, so the chunk cache never lists a mesh
+ * that is gone, and unmaps the file.
+ */
+Chunked_Mesh::~Chunked_Mesh()
+{
+    release_chunks(*this);
+    if (data != NULL) {
+        munmap(data, size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/* 'draw_chunked_object' function:
+ *
+ * Draws the chunks of a chunked object that are inside the view frustum
+ * with the current Modelview Matrix and material. Each chunk's vertices
+ * come first in its buffer and its normals right after them.
+ */
+void draw_chunked_object(Object &obj)
+{
+    Chunked_Mesh &mesh = *obj.chunked;
+    Matrix4f modelview;
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview.data());
+    float scale = modelview.topLeftCorner<3, 3>().colwise().norm().maxCoeff();
+
+    if (wireframe_mode) {
+        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+    }
+    for (uint32_t i = 0; i < mesh.chunk_count; ++i) {
+        const Mesh_Chunk &chunk = mesh.chunks[i];
+        Eigen::Vector4f center(chunk.center[0], chunk.center[1], chunk.center[2], 1.0f);
+        Vector3f eye_center = (modelview * center).head<3>();
+        if (!frustum_contains(eye_center, chunk.radius * scale)) {
+            ++render_stats.chunks_culled;
+            continue;
+        }
+        GLuint vbo = use_chunk(mesh, i);
+        if (vbo == 0) {
+            continue;
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glVertexPointer(3, GL_FLOAT, 0, 0);
+        glNormalPointer(GL_FLOAT, 0, (const GLvoid *) (chunk.vertex_count * sizeof(Triple)));
+        glDrawArrays(GL_TRIANGLES, 0, chunk.vertex_count);
+        ++render_stats.chunks_drawn;
+        ++render_stats.draw_calls;
+    }
+    if (wireframe_mode) {
+        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    }
+}
+
+/* 'mesh_ready' function:
+ *
+ * Returns whether the object's mesh can be drawn: it was uploaded, or it is
+ * a chunked mesh whose chunks are uploaded as needed.
+ */
+bool mesh_ready(const Object &obj)
+{
+    return obj.vertex_vbo != 0 || obj.chunked;
+}
+
+/* 'load_mesh_file' function:
+ *
+ * Reads the mesh of an object from an OBJ file, building its wireframe
+ * edges and clusters, or opens it from a ".chunks" file. Nothing here touches OpenGL,
+ * so it can run on any thread.
+ *
+ * @throws invalid_argument if it fails to read the file
+ */
+void load_mesh_file(string filename, Object &obj)
+{
+    const string chunks = ".chunks";
+    if (filename.size() >= chunks.size()
+        && filename.compare(filename.size() - chunks.size(), chunks.size(), chunks) == 0) {
+        open_chunked_mesh(filename, obj);
+    } else {
+        parseObjFile(filename, obj);
+        build_edge_buffer(obj);
+        build_meshlets(obj);
+    }
+}
+
+/* 'release_object' function:
+ *
+ * Deletes the OpenGL buffer objects of an object that is no longer drawn.
+ */
+void release_object(Object &obj)
+{
+    if (obj.chunked) {
+        release_chunks(*obj.chunked);
+    }
+    GLuint buffers[4] = {obj.vertex_vbo, obj.normal_vbo, obj.edge_ibo, obj.meshlet_ibo};
+    glDeleteBuffers(4, buffers);
+    obj.vertex_vbo = obj.normal_vbo = obj.edge_ibo = obj.meshlet_ibo = 0;
+}
+
+/* 'swap_in_scene' function:
+ *
+ * Replaces the shown scene with one filled in by 'parseFormatFile', which
+ * is how '-watch' reloads it. Must be called from the main thread, between
+ * frames.
+ *
+ * An object whose OBJ file was not written since it was loaded (it has the
+ * same 'mesh_key' as the loaded one) keeps that mesh and its OpenGL buffers
+ * and only takes the new instances, so editing a material or transform does
+ * not cost reading and uploading the mesh again. The camera is only changed if the
+ * camera section of the file was edited, so a reload does not undo moving
+ * around with the keyboard.
+ *
+ * Returns how many meshes were uploaded.
+ */
+int swap_in_scene(unique_ptr<Scene_Data> scene)
+{
+    int uploads = add_scene_meshes(*scene);
+    Scene_Slot &slot = scene_slots[shown_scene];
+    slot.scene = move(scene);
+    slot.materials.clear();
+    show_scene(shown_scene, true);
+    release_unused_meshes();
+    return uploads;
+}
+
+/* 'add_scene_meshes' function:
+ *
+ * Moves the meshes of a parsed scene that are not loaded yet into
+ * 'objects' and uploads them, leaving the scene's objects with just their
+ * files and instances. Meshes that were not read are drawn as placeholders
+ * while they are read in the background.
+ *
+ * Returns how many meshes were uploaded.
+ */
+int add_scene_meshes(Scene_Data &scene)
+{
+    int uploads = 0;
+    for (Scene_Objects::iterator obj_iter = scene.objects.begin();
+                                    obj_iter != scene.objects.end(); obj_iter++) {
+        Object &entry = obj_iter->second;
+        string key(obj_iter->first);
+        if (objects.count(key) != 0) {
+            continue;
+        }
+
+        Object &obj = objects[key];
+        obj = move(entry);
+        entry = Object();
+        entry.filename = obj.filename;
+        entry.mesh_key = obj.mesh_key;
+        entry.instances = obj.instances;
+        entry.instance_count = obj.instance_count;
+        obj.instances = NULL;
+        obj.instance_count = 0;
+
+        /* The mesh was not read yet (or was skipped as loaded but is not
+         * loaded any more, which can happen if two reloads overlap)
          */
+        if (obj.vertex_buffer.empty() && !obj.chunked) {
+            obj.bound_center = placeholder_box.bound_center;
+            obj.bound_radius = placeholder_box.bound_radius;
+            load_mesh_async(key, obj);
+            continue;
+        }
+        upload_object(obj);
+        ++uploads;
+    }
+    return uploads;
+}
+
+/* 'show_scene' function:
+ *
+ * Shows the resident scene in the given slot: points the objects at its
+ * instances, takes its lights and materials, and its camera unless
+ * 'keep_camera' is set and its camera section is the one already shown.
+ */
+void show_scene(int index, bool keep_camera)
+{
+    Scene_Slot &slot = scene_slots[index];
+    Scene_Data &scene = *slot.scene;
+    if (!keep_camera || string_view(scene.camera_text) != loaded_camera_text) {
+        loaded_camera_text.assign(scene.camera_text.begin(), scene.camera_text.end());
+        copy(scene.cam_position, scene.cam_position + 3, cam_position);
+        copy(scene.cam_orientation_axis, scene.cam_orientation_axis + 3,
+             cam_orientation_axis);
+        cam_orientation_angle = scene.cam_orientation_angle;
+        near_param = scene.near_param;
+        far_param = scene.far_param;
+        left_param = scene.left_param;
+        right_param = scene.right_param;
+        top_param = scene.top_param;
+        bottom_param = scene.bottom_param;
+
+        glMatrixMode(GL_PROJECTION);
+        glLoadIdentity();
+        glFrustum(left_param, right_param,
+                  bottom_param, top_param,
+                  near_param, far_param);
+        glMatrixMode(GL_MODELVIEW);
+        mouse_scale_x = (float) (right_param - left_param) / (float) window_width;
+        mouse_scale_y = (float) (top_param - bottom_param) / (float) window_height;
+    }
+
+    /* The built-in light slots refer to lights by index, so the ones still
+     * on are switched off and reloaded from scratch.
+     */
+    set_lights();
+    lights.assign(scene.lights.begin(), scene.lights.end());
+    render_queue.clear();
+
+    for (map<string, Object>::iterator obj_iter = objects.begin();
+                                    obj_iter != objects.end(); obj_iter++) {
+        obj_iter->second.instances = NULL;
+        obj_iter->second.instance_count = 0;
+    }
+    for (Scene_Objects::iterator obj_iter = scene.objects.begin();
+                                    obj_iter != scene.objects.end(); obj_iter++) {
+        Object &obj = objects[string(obj_iter->first)];
+        obj.instances = obj_iter->second.instances;
+        obj.instance_count = obj_iter->second.instance_count;
+    }
+
+    /* Gives matching materials matching ids, so that 'draw_objects' can
+     * sort the instances and only change OpenGL state when it has to. The
+     * ids are kept in the instances, so a scene shown again only needs its
+     * materials back.
+     */
+    if (slot.materials.empty()) {
+        assign_material_ids();
+        slot.materials = materials;
+        slot.ground_material = ground_instance.material_id;
+    } else {
+        materials = slot.materials;
+        ground_instance.material_id = slot.ground_material;
+    }
+    upload_materials();
+
+    shown_scene = index;
+    slot.last_shown = ++scenes_shown;
+
+    lock_guard<mutex> lock(reload_mutex);
+    loaded_mesh_files.clear();
+    for (map<string, Object>::iterator obj_iter = objects.begin();
+                                    obj_iter != objects.end(); obj_iter++) {
+        loaded_mesh_files[obj_iter->first] = obj_iter->second.filename;
+    }
+    loaded_scene_files.assign(scene.scene_files.begin(), scene.scene_files.end());
+}
+
+/* 'switch_scene' function:
+ *
+ * Shows the scene in the given slot, reading it again first if it was
+ * evicted, and evicts others if that goes over the budget.
+ */
+void switch_scene(int index)
+{
+    if (index < 0 || index >= (int) scene_slots.size() || index == shown_scene) {
+        return;
+    }
+    Scene_Slot &slot = scene_slots[index];
+    if (!slot.scene) {
+        unique_ptr<Scene_Data> scene(new Scene_Data());
+        try {
+            read_scene_file(slot.filename, *scene, map<string, string>(), false);
+        } catch (const exception &error) {
+            cerr << "Could not read " << slot.filename << ": " << error.what() << "\n";
+            return;
+        }
+        add_scene_meshes(*scene);
+        slot.scene = move(scene);
+        slot.materials.clear();
+    }
+    show_scene(index, false);
+    enforce_scene_budget();
+    cout << "Showing scene " << index + 1 << ": " << slot.filename << "\n";
+    request_redraw();
+}
+
+/* 'release_unused_meshes' function:
+ *
+ * Releases and forgets every mesh in 'objects' that no resident scene
+ * uses.
+ */
+void release_unused_meshes()
+{
+    for (map<string, Object>::iterator obj_iter = objects.begin();
+                                    obj_iter != objects.end(); ) {
+        bool used = false;
+        for (size_t i = 0; i < scene_slots.size() && !used; ++i) {
+            used = scene_slots[i].scene && scene_slots[i].scene->objects.count(string_view(obj_iter->first));
+        }
+        if (used) {
+            obj_iter++;
+            continue;
+        }
+        release_object(obj_iter->second);
+        obj_iter = objects.erase(obj_iter);
+    }
+}
+
+/* 'enforce_scene_budget' function:
+ *
+ * Evicts the resident scenes shown longest ago, other than the shown one,
+ * until the uploaded meshes and the instances of the resident scenes fit
+ * in 'scene_budget'. Meshes still being read count once they arrive, so
+ * this is checked again then.
+ */
+void enforce_scene_budget()
+{
+    while (true) {
+        size_t bytes = 0;
+        for (map<string, Object>::iterator obj_iter = objects.begin();
+                                        obj_iter != objects.end(); obj_iter++) {
+            bytes += mesh_bytes(obj_iter->second);
+        }
+        int oldest = -1;
+        for (size_t i = 0; i < scene_slots.size(); ++i) {
+            if (!scene_slots[i].scene) {
+                continue;
+            }
+            const Scene_Objects &scene_objects = scene_slots[i].scene->objects;
+            for (Scene_Objects::const_iterator obj_iter = scene_objects.begin();
+                                                     obj_iter != scene_objects.end(); obj_iter++) {
+                bytes += obj_iter->second.instance_count * sizeof(Instance);
+            }
+            bytes += scene_graph_bytes(scene_slots[i].scene->graph);
+            if ((int) i != shown_scene
+                && (oldest < 0 || scene_slots[i].last_shown < scene_slots[oldest].last_shown)) {
+                oldest = i;
+            }
+        }
+        if (bytes <= scene_budget || oldest < 0) {
+            return;
+        }
+
+        cout << "Evicting scene " << oldest + 1 << ": " << scene_slots[oldest].filename
+             << " (" << bytes / 1048576.0 << " MB resident)\n";
+        scene_slots[oldest].scene.reset();
+        scene_slots[oldest].materials.clear();
+        release_unused_meshes();
+    }
+}
+
+/* 'mesh_bytes' function:
+ *
+ * Returns how many bytes of OpenGL buffers the object's mesh takes up.
+ * Chunked meshes are left out; they have a budget of their own.
+ */
+size_t mesh_bytes(const Object &obj)
+{
+    if (obj.vertex_vbo == 0) {
+        return 0;
+    }
+    return (obj.vertex_buffer.size() + obj.normal_buffer.size()) * sizeof(Triple)
+           + (obj.edge_buffer.size() + obj.meshlet_indices.size()) * sizeof(GLuint);
+}
+
+/* 'start_watching' function:
+ *
+ * Starts the background thread that reloads the scene when the scene file
+ * or its OBJ files change, and the timer that checks for reloaded scenes.
+ * The thread is stopped when the program exits.
+ */
+void start_watching()
+{
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    watch_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (inotify_fd < 0 || watch_stop_fd < 0) {
+        cerr << "Could not watch the scene files for changes\n";
+        if (inotify_fd >= 0) {
+            close(inotify_fd);
+        }
+        return;
+    }
+    watcher = thread(watch_scene, inotify_fd);
+    atexit(stop_watching);
+    glutTimerFunc(reload_check_ms, check_reload, 0);
+}
+
+/* 'watch_scene' function:
+ *
+ * What the background reload thread runs. inotify watches directories
+ * rather than the files themselves, since many editors save by writing a
+ * new file and renaming it over the old one. When a watched file is
+ * written, we wait until the directory has been quiet for a moment (an
+ * editor may save in several steps), parse the scene again, and leave it
+ * in 'pending_scene' for the main thread. Returns, closing 'inotify_fd',
+ * once 'stop_watching' is called.
+ */
+void watch_scene(int inotify_fd)
+{
+    map<int, string> watched_dirs;
+    set<string> watched_files;
+
+    /* Starts watching 'filename' and, if needed, its directory */
+    auto watch_file = [&](const string &filename) {
+        watched_files.insert(filename);
+        size_t slash = filename.find_last_of('/');
+        string dir = slash == string::npos ? "" : filename.substr(0, slash + 1);
+        for (map<int, string>::iterator it = watched_dirs.begin();
+                                        it != watched_dirs.end(); it++) {
+            if (it->second == dir) {
+                return;
+            }
+        }
+        int wd = inotify_add_watch(inotify_fd, dir.empty() ? "." : dir.c_str(),
+                                   IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd >= 0) {
+            watched_dirs[wd] = dir;
+        }
+    };
+
+    watch_file(scene_filename);
+    {
+        lock_guard<mutex> lock(reload_mutex);
+        for (size_t i = 0; i < loaded_scene_files.size(); ++i) {
+            watch_file(loaded_scene_files[i]);
+        }
+        for (map<string, string>::iterator it = loaded_mesh_files.begin();
+                                           it != loaded_mesh_files.end(); it++) {
+            watch_file(it->second);
+        }
+    }
+
+    vector<char> events(64 * 1024);
+    while (true) {
+        /* Waits for a change to one of our files, then for things to settle */
+        bool changed = false;
+        int timeout = -1;
+        while (true) {
+            pollfd waiting[2] = {{inotify_fd, POLLIN, 0}, {watch_stop_fd, POLLIN, 0}};
+            if (poll(waiting, 2, timeout) <= 0) {
+                break;
+            }
+            ssize_t length = -1;
+            if (waiting[1].revents == 0) {
+                length = read(inotify_fd, events.data(), events.size());
+            }
+            if (length <= 0) {
+                close(inotify_fd);
+                return;
+            }
+            for (char *p = events.data(); p < events.data() + length; ) {
+                inotify_event *event = (inotify_event *) p;
+                map<int, string>::iterator dir = watched_dirs.find(event->wd);
+                if (event->len > 0 && dir != watched_dirs.end()
+                    && watched_files.count(dir->second + event->name)) {
+                    changed = true;
+                }
+                p += sizeof(inotify_event) + event->len;
+            }
+            if (changed) {
+                timeout = 100;
+            }
+        }
+        if (!changed) {
+            continue;
+        }
+
+        map<string, string> loaded_meshes;
+        {
+            lock_guard<mutex> lock(reload_mutex);
+            loaded_meshes = loaded_mesh_files;
+        }
+        unique_ptr<Scene_Data> scene(new Scene_Data());
+        try {
+            read_scene_file(scene_filename, *scene, loaded_meshes, true);
+        } catch (const exception &error) {
+            cerr << "Could not reload " << scene_filename << ": " << error.what() << "\n";
+            continue;
+        }
+        for (size_t i = 0; i < scene->scene_files.size(); ++i) {
+            watch_file(string(scene->scene_files[i]));
+        }
+        for (Scene_Objects::iterator obj_iter = scene->objects.begin();
+                                        obj_iter != scene->objects.end(); obj_iter++) {
+            watch_file(obj_iter->second.filename);
+        }
+
+        lock_guard<mutex> lock(reload_mutex);
+        pending_scene = move(scene);
+    }
+}
+
+/* 'stop_watching' function:
+ *
+ * Wakes the background reload thread, waits for it to finish any reload
+ * it is in the middle of, and ends it.
+ */
+void stop_watching()
+{
+    uint64_t stop = 1;
+    if (write(watch_stop_fd, &stop, sizeof(stop)) == sizeof(stop)) {
+        watcher.join();
+    } else {
+        /* It cannot be woken, so it ends with the program */
+        watcher.detach();
+    }
+    close(watch_stop_fd);
+    watch_stop_fd = -1;
+}
+
+/* 'check_reload' function:
+ *
+ * Called by GLUT every 'reload_check_ms' milliseconds in '-watch' mode.
+ * Swaps in a scene the background thread reloaded, if there is one.
+ */
+void check_reload(int value)
+{
+    unique_ptr<Scene_Data> scene;
+    {
+        lock_guard<mutex> lock(reload_mutex);
+        scene = move(pending_scene);
+    }
+    if (scene) {
+        int uploads = swap_in_scene(move(scene));
+        cout << "Reloaded " << scene_filename << " (" << uploads
+             << " mesh(es) read again)\n";
+        request_redraw();
+    }
+    glutTimerFunc(reload_check_ms, check_reload, 0);
+}
+
+/* 'create_placeholder_box' function:
+ *
+ * Fills the given object with the corners of a cube from -1 to 1 and the
+ * 12 edges between them, which is all 'draw_object' uses to draw a
+ * placeholder. The normals point out of the corners so the box is lit.
+ */
+void create_placeholder_box(Object &obj)
+{
+    obj.vertex_buffer.clear();
+    obj.normal_buffer.clear();
+    obj.edge_buffer.clear();
+    float n = 1.0f / sqrt(3.0f);
+    for (int i = 0; i < 8; ++i) {
+        float x = (i & 1) ? 1.0f : -1.0f;
+        float y = (i & 2) ? 1.0f : -1.0f;
+        float z = (i & 4) ? 1.0f : -1.0f;
+        obj.vertex_buffer.push_back((Triple) {x, y, z});
+        obj.normal_buffer.push_back((Triple) {x * n, y * n, z * n});
+    }
+    /* Corners whose indices differ in one bit share an edge */
+    for (GLuint i = 0; i < 8; ++i) {
+        for (GLuint bit = 1; bit < 8; bit <<= 1) {
+            if ((i & bit) == 0) {
+                obj.edge_buffer.push_back(i);
+                obj.edge_buffer.push_back(i | bit);
+            }
+        }
+    }
+}
+
+/* 'load_mesh_async' function:
+ *
+ * Queues the OBJ file of the object with the given 'mesh_key' to be read
+ * by a loader thread, starting another loader if there are fewer than one
+ * per core. The first loader has them all stopped when the program exits.
+ */
+void load_mesh_async(const string &key, const Object &obj)
+{
+    Mesh_Load request;
+    request.key = key;
+    request.mesh.filename = obj.filename;
+    request.mesh.mesh_key = obj.mesh_key;
+    {
+        lock_guard<mutex> lock(load_mutex);
+        mesh_requests.push_back(move(request));
+        if ((int) loaders.size() < max(1, (int) thread::hardware_concurrency())) {
+            if (loaders.empty()) {
+                atexit(stop_loaders);
+            }
+            loaders.push_back(thread(load_meshes));
+        }
+    }
+    mesh_requested.notify_one();
+    ++meshes_loading;
+
+    /* Batch export waits for every mesh in 'finish_loading' instead */
+    if (!offscreen_mode && !load_timer_pending) {
+        load_timer_pending = true;
+        glutTimerFunc(load_check_ms, check_loads, 0);
+    }
+}
+
+/* 'load_meshes' function:
+ *
+ * What each loader thread runs: it reads queued OBJ files (and builds their
+ * wireframe edges) until 'stop_loaders' is called. Nothing here touches
+ * OpenGL, which may only be used from the main thread.
+ */
+void load_meshes()
+{
+    while (true) {
+        Mesh_Load load;
         {
-            int num_instances = obj.instances.size();
-            
-            /* The loop tells OpenGL to modify our modelview matrix with the
-             * desired geometric transformations for this object. Remember
-             * though that our 'transform_sets' struct assumes that transformations
-             * are conveniently given in sets of translation -> rotate -> scaling;
-             * and THIS IS NOT THE CASE FOR YOUR SCENE FILES. DO NOT BLINDLY
-             * COPY THE FOLLOWING CODE.
-             *
-             * To explain how to correctly transform your objects, consider the
-             * following example. Suppose our object has the following desired
-             * transformations:
-             *
-             *    scale by 2, 2, 2
-             *    translate by 2, 0, 5
-             *    rotate about 0, 1, 0.5 and by angle = 0.6 radians
-             *
-             * Obviously, we cannot use the following loop for this, because the order
-             * is not translate -> rotate -> scale. Instead, we need to make the following
-             * calls in this exact order:
-             *
-             *    glRotatef(0.6 * 180.0 / M_PI, 0, 1, 0.5);
-             *    glTranslatef(2, 0, 5);
-             *    glScalef(2, 2, 2);
-             *
-             * We make the calls in the REVERSE order of how the transformations are specified
-             * because OpenGL edits our modelview matrix using post-multiplication (see above
-             * at the notes regarding the camera transforms in display()).
-             *
-             * Keep all this in mind to come up with an appropriate way to store and apply
-             * geometric transformations for each object in your scenes.
-             */
-            for (int instanceIdx = 0; instanceIdx < num_instances; ++instanceIdx)
-            {
-                Instance &inst = obj.instances[instanceIdx];
-                int num_transforms = inst.transforms.size();
-
-                /* Applies the transformations in REVERSE order because OpenGL uses
-                 * post matrix multiplication. */
-                for (int transformIdx = num_transforms - 1; transformIdx >= 0; --transformIdx)
-                {
-                    switch(inst.transforms[transformIdx].type) {
-                        case translation :
-                            glTranslatef(inst.transforms[transformIdx].data[0],
-                                    inst.transforms[transformIdx].data[1],
-                                    inst.transforms[transformIdx].data[2]);
-                            break;
-                        case rotation :
-                            glRotatef(inst.transforms[transformIdx].data[3],
-                                    inst.transforms[transformIdx].data[0],
-                                    inst.transforms[transformIdx].data[1],
-                                    inst.transforms[transformIdx].data[2]);
-                            break;
-                        case scaling :
-                            glScalef(inst.transforms[transformIdx].data[0],
-                                    inst.transforms[transformIdx].data[1],
-                                    inst.transforms[transformIdx].data[2]);
-                    }
-                }
-            
-                /* The 'glMaterialfv' and 'glMaterialf' functions tell OpenGL
-                * the material properties of the surface we want to render.
-                * The parameters for 'glMaterialfv' are (in the following order):
-                *
-                * - enum face: Options are 'GL_FRONT' for front-face rendering,
-                *              'GL_BACK' for back-face rendering, and
-                *              'GL_FRONT_AND_BACK' for rendering both sides.
-                * - enum property: this varies on what you are setting up
-                *                  e.g. 'GL_AMBIENT' for ambient reflectance
-                * - float* values: a set of values for the specified property
-                *                  e.g. an array of RGB values for the reflectance
-                *
-                * The 'glMaterialf' function is the same, except the third
-                * parameter is only a single float value instead of an array of
-                * values. 'glMaterialf' is used to set the shininess property.
-                */
-                glMaterialfv(GL_FRONT, GL_AMBIENT, inst.ambient_reflect);
-                glMaterialfv(GL_FRONT, GL_DIFFUSE, inst.diffuse_reflect);
-                glMaterialfv(GL_FRONT, GL_SPECULAR, inst.specular_reflect);
-                glMaterialf(GL_FRONT, GL_SHININESS, inst.shininess);
-            
-                /* The next few lines of code are how we tell OpenGL to render
-                * geometry for us. First, let us look at the 'glVertexPointer'
-                * function.
-                * 
-                * 'glVertexPointer' tells OpenGL the specifications for our
-                * "vertex array". As a recap of the comments from the 'Object'
-                * struct, the "vertex array" stores all the faces of the surface
-                * we want to render. The faces are stored in the array as
-                * consecutive points. For instance, if our surface were a cube,
-                * then our "vertex array" could be the following:
-                *
-                * [face1vertex1, face1vertex2, face1vertex3, face1vertex4,
-                *  face2vertex1, face2vertex2, face2vertex3, face2vertex4,
-                *  face3vertex1, face3vertex2, face3vertex3, face3vertex4,
-                *  face4vertex1, face4vertex2, face4vertex3, face4vertex4,
-                *  face5vertex1, face5vertex2, face5vertex3, face5vertex4,
-                *  face6vertex1, face6vertex2, face6vertex3, face6vertex4]
-                * 
-                * Obviously to us, some of the vertices in the array are repeats.
-                * However, the repeats cannot be avoided since OpenGL requires
-                * this explicit specification of the faces.
-                *
-                * The parameters to the 'glVertexPointer' function are as
-                * follows:
-                *
-                * - int num_points_per_face: this is the parameter that tells
-                *                            OpenGL where the breaks between
-                *                            faces are in the vertex array.
-                *                            Below, we set this parameter to 3,
-                *                            which tells OpenGL to treat every
-                *                            set of 3 consecutive vertices in
-                *                            the vertex array as 1 face. So
-                *                            here, our vertex array is an array
-                *                            of triangle faces.
-                *                            If we were using the example vertex
-                *                            array above, we would have set this
-                *                            parameter to 4 instead of 3.
-                * - enum type_of_coordinates: this parameter tells OpenGL whether
-                *                             our vertex coordinates are ints,
-                *                             floats, doubles, etc. In our case,
-                *                             we are using floats, hence 'GL_FLOAT'.
-                * - sizei stride: this parameter specifies the number of bytes
-                *                 between consecutive vertices in the array.
-                *                 Most often, you will set this parameter to 0
-                *                 (i.e. no offset between consecutive vertices).
-                * - void* pointer_to_array: this parameter is the pointer to
-                *                           our vertex array.
-                */
-                glVertexPointer(3, GL_FLOAT, 0, &obj.vertex_buffer[0]);
-                /* The "normal array" is the equivalent array for normals.
-                * Each normal in the normal array corresponds to the vertex
-                * of the same index in the vertex array.
-                *
-                * The 'glNormalPointer' function has the following parameters:
-                *
-                * - enum type_of_normals: e.g. int, float, double, etc
-                * - sizei stride: same as the stride parameter in 'glVertexPointer'
-                * - void* pointer_to_array: the pointer to the normal array
-                */
-                glNormalPointer(GL_FLOAT, 0, &obj.normal_buffer[0]);
-                
-                int buffer_size = obj.vertex_buffer.size();
-                
-                if(!wireframe_mode)
-                    /* Finally, we tell OpenGL to render everything with the
-                    * 'glDrawArrays' function. The parameters are:
-                    * 
-                    * - enum mode: in our case, we want to render triangles,
-                    *              so we specify 'GL_TRIANGLES'. If we wanted
-                    *              to render squares, then we would use
-                    *              'GL_QUADS' (for quadrilaterals).
-                    * - int start_index: the index of the first vertex
-                    *                    we want to render in our array
-                    * - int num_vertices: number of vertices to render
-                    *
-                    * As OpenGL renders all the faces, it automatically takes
-                    * into account all the specifications we have given it to
-                    * do all the lighting calculations for us. It also applies
-                    * the Modelview and Projection matrix transformations to
-                    * the vertices and converts everything to screen coordinates
-                    * using our Viewport specification. Everything is rendered
-                    * onto the off-screen buffer.
-                    */
-                    glDrawArrays(GL_TRIANGLES, 0, buffer_size);
-                else
-                    /* If we are in "wireframe mode" (see the 'key_pressed'
-                    * function for more information), then we want to render
-                    * lines instead of triangle surfaces. To render lines,
-                    * we use the 'GL_LINE_LOOP' enum for the mode parameter.
-                    * However, we need to draw each face frame one at a time
-                    * to render the wireframe correctly. We can do so with a
-                    * for loop:
-                    */
-                    for(int j = 0; j < buffer_size; j += 3)
-                        glDrawArrays(GL_LINE_LOOP, j, 3);
-            }
-        }
-        /* As discussed before, we use 'glPopMatrix' to get back the
-         * version of the Modelview Matrix that we had before we specified
-         * the object transformations above. We then move on in our loop
-         * to the next object we want to render.
-         */
-        glPopMatrix();
+            unique_lock<mutex> lock(load_mutex);
+            mesh_requested.wait(lock, [] {
+                return !mesh_requests.empty() || loaders_stopping;
+            });
+            if (loaders_stopping) {
+                return;
+            }
+            load = move(mesh_requests.front());
+            mesh_requests.pop_front();
+        }
+        try {
+            load_mesh_file(load.mesh.filename, load.mesh);
+        } catch (const exception &error) {
+            load.error = error.what();
+        }
+        {
+            lock_guard<mutex> lock(load_mutex);
+            loaded_meshes.push_back(move(load));
+        }
+        mesh_loaded.notify_one();
     }
-    
-    
-    /* The following code segment uses OpenGL's built-in sphere rendering
-     * function to render the blue-ground that you are walking on when
-     * you run the program. The blue-ground is just the surface of a big
-     * sphere of radius 100.
-     */
-    glPushMatrix();
+}
+
+/* 'stop_loaders' function:
+ *
+ * Drops the meshes still queued, waits for the loader threads to finish
+ * the ones they are reading, and ends them.
+ */
+void stop_loaders()
+{
+    {
+        lock_guard<mutex> lock(load_mutex);
+        loaders_stopping = true;
+        mesh_requests.clear();
+    }
+    mesh_requested.notify_all();
+    for (thread &loader : loaders) {
+        loader.join();
+    }
+    loaders.clear();
+}
+
+/* 'upload_loaded_meshes' function:
+ *
+ * Uploads the meshes the loader threads have finished and gives them to
+ * their objects, keeping the objects' instances. A mesh whose object was
+ * removed by the time it arrives (because its file changed and so did its
+ * 'mesh_key', say) is dropped.
+ *
+ * Returns how many meshes were swapped in.
+ */
+int upload_loaded_meshes()
+{
+    vector<Mesh_Load> loads;
     {
-        glTranslatef(0, -103, 0);
-        glutSolidSphere(100, 100, 100);
+        lock_guard<mutex> lock(load_mutex);
+        loads.swap(loaded_meshes);
+    }
+
+    int uploads = 0;
+    for (size_t i = 0; i < loads.size(); ++i) {
+        --meshes_loading;
+        if (!loads[i].error.empty()) {
+            cerr << loads[i].error << "\n";
+            continue;
+        }
+        map<string, Object>::iterator found = objects.find(loads[i].key);
+        if (found == objects.end() || mesh_ready(found->second)) {
+            continue;
+        }
+        Object &obj = found->second;
+        loads[i].mesh.instances = obj.instances;
+        loads[i].mesh.instance_count = obj.instance_count;
+        obj = move(loads[i].mesh);
+        upload_object(obj);
+        ++uploads;
+    }
+    return uploads;
+}
+
+/* 'check_loads' function:
+ *
+ * Called by GLUT every 'load_check_ms' milliseconds while meshes are being
+ * read, to show each one as soon as it is ready.
+ */
+void check_loads(int value)
+{
+    if (upload_loaded_meshes() > 0) {
+        enforce_scene_budget();
+        request_redraw();
+    } else if (meshes_loading == 0) {
+        request_redraw();
+    }
+    if (meshes_loading > 0) {
+        glutTimerFunc(load_check_ms, check_loads, 0);
+    } else {
+        load_timer_pending = false;
+    }
+}
+
+/* 'finish_loading' function:
+ *
+ * Waits until every queued mesh is read and uploaded. Used when rendering
+ * to image files, where placeholders are of no use.
+ */
+void finish_loading()
+{
+    while (meshes_loading > 0) {
+        {
+            unique_lock<mutex> lock(load_mutex);
+            mesh_loaded.wait(lock, [] { return !loaded_meshes.empty(); });
+        }
+        upload_loaded_meshes();
+    }
+}
+
+/* 'log_load_times' function:
+ *
+ * Called after each frame; prints how long after 'init' started the first
+ * frame was drawn, and the first frame with every mesh loaded.
+ */
+void log_load_times()
+{
+    if (!first_frame_logged) {
+        first_frame_logged = true;
+        cout << "First frame after " << (now_seconds() - load_start) * 1000.0 << " ms\n";
+    }
+    if (!full_scene_logged && meshes_loading == 0) {
+        full_scene_logged = true;
+        cout << "Full scene after " << (now_seconds() - load_start) * 1000.0 << " ms\n";
+        load_peak_rss = peak_rss_bytes();
+        if (!offscreen_mode) {
+            print_memory_report();
+        }
     }
-    glPopMatrix();
 }
 
 /* 'mouse_pressed' function:
@@ -1206,7 +6075,7 @@ void mouse_moved(int x, int y)
         /* Tell OpenGL that it needs to re-render our scene with the new camera
          * angles.
          */
-        glutPostRedisplay();
+        request_redraw();
     }
 }
 
@@ -1249,6 +6118,56 @@ void key_pressed(unsigned char key, int x, int y)
     {
         exit(0);
     }
+    /* If 'i' is pressed, print how much work the last frame took.
+     */
+    else if (key == 'i')
+    {
+        print_render_stats();
+    }
+    /* If 'm' is pressed, print how much memory the scenes take up.
+     */
+    else if (key == 'm')
+    {
+        print_memory_report();
+    }
+    /* If 'g' is pressed, switch between per-vertex Gouraud shading done by
+     * fixed-function OpenGL and per-pixel Phong shading done by our shader.
+     */
+    else if (key == 'g')
+    {
+        if (phong_program != 0) {
+            phong_mode = !phong_mode;
+            request_redraw();
+        }
+    }
+    /* If 'c' is pressed, switch culling of triangle clusters on or off, to
+     * compare how many triangles reach OpenGL with and without it.
+     */
+    else if (key == 'c')
+    {
+        cluster_culling = !cluster_culling;
+        request_redraw();
+    }
+    /* If 'o' is pressed, switch occlusion culling of instances on or off.
+     */
+    else if (key == 'o')
+    {
+        occlusion_culling = !occlusion_culling;
+        request_redraw();
+    }
+    /* The number keys show the scenes listed on the command line, '1' the
+     * first and '0' the tenth, and '[' and ']' step back and forth through
+     * all of them.
+     */
+    else if (key >= '0' && key <= '9')
+    {
+        switch_scene(key == '0' ? 9 : key - '1');
+    }
+    else if (key == '[' || key == ']')
+    {
+        int count = scene_slots.size();
+        switch_scene((shown_scene + (key == ']' ? 1 : count - 1)) % count);
+    }
     /* If 't' is pressed, toggle our 'wireframe_mode' boolean to make OpenGL
      * render our cubes as surfaces of wireframes.
      */
@@ -1258,7 +6177,7 @@ void key_pressed(unsigned char key, int x, int y)
         /* Tell OpenGL that it needs to re-render our scene with the cubes
          * now as wireframes (or surfaces if they were wireframes before).
          */
-        glutPostRedisplay();
+        request_redraw();
     }
     else
     {
@@ -1284,7 +6203,7 @@ void key_pressed(unsigned char key, int x, int y)
         {
             cam_position[0] += step_size * sin(x_view_rad);
             cam_position[2] -= step_size * cos(x_view_rad);
-            glutPostRedisplay();
+            request_redraw();
         }
         /* 'a' for step left
          */
@@ -1292,7 +6211,7 @@ void key_pressed(unsigned char key, int x, int y)
         {
             cam_position[0] -= step_size * cos(x_view_rad);
             cam_position[2] -= step_size * sin(x_view_rad);
-            glutPostRedisplay();
+            request_redraw();
         }
         /* 's' for step backward
          */
@@ -1300,7 +6219,7 @@ void key_pressed(unsigned char key, int x, int y)
         {
             cam_position[0] -= step_size * sin(x_view_rad);
             cam_position[2] += step_size * cos(x_view_rad);
-            glutPostRedisplay();
+            request_redraw();
         }
         /* 'd' for step right
          */
@@ -1308,281 +6227,1283 @@ void key_pressed(unsigned char key, int x, int y)
         {
             cam_position[0] += step_size * cos(x_view_rad);
             cam_position[2] += step_size * sin(x_view_rad);
-            glutPostRedisplay();
+            request_redraw();
+        }
+    }
+}
+
+
+/* 'parse_obj_index' function:
+ *
+ * Reads one index of an OBJ face corner. Positive indices count from 1 at
+ * the start of the file and negative ones from -1 at the last element read
+ * so far; 'count' is how many elements were read, and the result is an
+ * index into a list with a placeholder at 0, or 0 if the index is invalid.
+ */
+int parse_obj_index(string_view field, int count)
+{
+    long index = 0;
+    from_chars_result read = from_chars(field.data(), field.data() + field.size(), index);
+    if (field.empty() || read.ec != errc() || read.ptr != field.data() + field.size()) {
+        return 0;
+    }
+    if (index < 0) {
+        index += count + 1;
+    }
+    return (index >= 1 && index <= count) ? index : 0;
+}
+
+/* 'parseObjFile' function:
+ *
+ * Appends the triangles of an OBJ file to the object's vertex and normal
+ * arrays. Faces may give their corners as "v", "v/vt", "v//vn" or
+ * "v/vt/vn", with negative indices counting back from the latest vertex,
+ * and faces with more than 3 corners are split into a fan of triangles
+ * around their first corner. Corners without a normal get one from
+ * 'generate_normals'. Texture coordinates and other records are skipped.
+ *
+ * @throws invalid_argument if it fails to read the file, a coordinate or a
+ *         face in it
+ */
+void parseObjFile(string filename, Object &obj)
+{
+    if (filename.find(".obj") == -1) {
+        throw invalid_argument("File " + filename + " needs to be a .obj file.");
+    }
+    
+    string buffer;
+    ifstream file;
+    file.open(filename.c_str(), ifstream::in);
+    if (file.fail()) {
+        string msg = "Could not read obj file '" + filename + "'.";
+        throw invalid_argument(msg);
+    }
+
+    /* Growing the arrays as we go would copy them over and over, and for
+     * a while hold both the old and the new copy. Counting first lets us
+     * give every array its final size up front.
+     */
+    Obj_Counts counts;
+    count_obj_records(file, counts);
+
+    vector<Triple> vertexSet;
+    vector<Triple> normalSet;
+    vertexSet.reserve(counts.positions + 1);
+    normalSet.reserve(counts.normals + 1);
+    Triple zeroPlaceHolder = {0.0f, 0.0f, 0.0f};
+    vertexSet.push_back(zeroPlaceHolder);
+    normalSet.push_back(zeroPlaceHolder);
+
+    size_t first_corner = obj.vertex_buffer.size();
+    obj.vertex_buffer.reserve(first_corner + counts.corners);
+    obj.normal_buffer.reserve(first_corner + counts.corners);
+
+    /* If some corners have no normal, then for every corner appended, its
+     * index into 'vertexSet' and whether the file gave it a normal, for
+     * 'generate_normals'.
+     */
+    bool find_normals = !counts.all_normals;
+    vector<GLuint> corner_vertices;
+    vector<char> has_normal;
+    if (find_normals) {
+        corner_vertices.reserve(counts.corners);
+        has_normal.reserve(counts.corners);
+    }
+
+    /* The fields of each line point into 'buffer', and the lists are
+     * reused from line to line, so reading a line allocates nothing.
+     */
+    vector<string_view> element;
+    vector<int> face_vertices, face_normals;
+    int line_number = 0;
+    while (getline(file, buffer)) {
+        ++line_number;
+        element.clear();
+        const char *p = buffer.c_str(), *line_end = p + buffer.size();
+        while (p < line_end) {
+            while (p < line_end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+                ++p;
+            }
+            const char *field = p;
+            while (p < line_end && *p != ' ' && *p != '\t' && *p != '\r') {
+                ++p;
+            }
+            if (p > field) {
+                element.push_back(string_view(field, p - field));
+            }
+        }
+        if (element.empty() || element[0][0] == '#') {
+            continue;
+        }
+
+        if (element[0] == "v" || element[0] == "vn") {
+            if (element.size() < 4) {
+                throw invalid_argument("Bad " + string(element[0]) + " record in obj file '"
+                                       + filename + "' on line " + to_string(line_number) + ".");
+            }
+            float xyz[3];
+            for (int i = 0; i < 3; ++i) {
+                const char *field = element[i + 1].data();
+                const char *field_end = field + element[i + 1].size();
+                if (parse_short_float(field, field_end, xyz[i])) {
+                    continue;
+                }
+                from_chars_result read = from_chars(field, field_end, xyz[i]);
+                if (read.ec != errc() || read.ptr != field_end) {
+                    throw invalid_argument("Bad number '" + string(element[i + 1])
+                                           + "' in obj file '" + filename + "' on line "
+                                           + to_string(line_number) + ".");
+                }
+            }
+            Triple value = {xyz[0], xyz[1], xyz[2]};
+            (element[0] == "v" ? vertexSet : normalSet).push_back(value);
+            continue;
+        } else if (element[0] != "f") {
+            continue;
+        }
+
+        /* Splits each corner at its slashes. The position is required; the
+         * normal is the third field if there is one.
+         */
+        face_vertices.clear();
+        face_normals.clear();
+        for (size_t i = 1; i < element.size(); ++i) {
+            string_view corner = element[i];
+            size_t slash = corner.find('/');
+            int v = parse_obj_index(corner.substr(0, slash), vertexSet.size() - 1);
+            int n = -1;
+            if (slash != string::npos) {
+                size_t second = corner.find('/', slash + 1);
+                if (second != string::npos) {
+                    n = parse_obj_index(corner.substr(second + 1), normalSet.size() - 1);
+                }
+            }
+            if (v == 0 || n == 0) {
+                throw invalid_argument("Bad face corner '" + string(corner) + "' in obj file '"
+                                       + filename + "' on line " + to_string(line_number) + ".");
+            }
+            face_vertices.push_back(v);
+            face_normals.push_back(n);
+        }
+        if (face_vertices.size() < 3) {
+            throw invalid_argument("Face with fewer than 3 corners in obj file '"
+                                   + filename + "' on line " + to_string(line_number) + ".");
+        }
+
+        for (size_t k = 1; k + 1 < face_vertices.size(); ++k) {
+            size_t corners[3] = {0, k, k + 1};
+            for (int c = 0; c < 3; ++c) {
+                int v = face_vertices[corners[c]], n = face_normals[corners[c]];
+                obj.vertex_buffer.push_back(vertexSet[v]);
+                obj.normal_buffer.push_back(n > 0 ? normalSet[n] : zeroPlaceHolder);
+                if (find_normals) {
+                    corner_vertices.push_back(v);
+                    has_normal.push_back(n > 0);
+                }
+            }
+        }
+    }
+
+    file.close();
+
+    size_t scratch = (vertexSet.capacity() + normalSet.capacity()) * sizeof(Triple)
+                     + corner_vertices.capacity() * sizeof(GLuint) + has_normal.capacity();
+    {
+        lock_guard<mutex> lock(parse_scratch_mutex);
+        parse_scratch_peak = max(parse_scratch_peak, scratch);
+    }
+
+    /* The positions and normals as the file lists them are not needed any
+     * more, so they are freed before 'generate_normals' needs memory of its
+     * own.
+     */
+    int num_vertices = vertexSet.size();
+    vector<Triple>().swap(vertexSet);
+    vector<Triple>().swap(normalSet);
+
+    if (find_normals) {
+        generate_normals(obj, first_corner, corner_vertices, num_vertices, has_normal);
+    }
+}
+
+/* 'count_obj_records' function:
+ *
+ * Reads an OBJ file from start to end without parsing any numbers and
+ * fills in 'counts', then rewinds the file. The file is read in large
+ * blocks, so this takes a small part of the time parsing it does.
+ */
+void count_obj_records(ifstream &file, Obj_Counts &counts)
+{
+    vector<char> block(1 << 20);
+    size_t kept = 0;
+    bool done = false;
+    while (!done) {
+        /* A line longer than the block needs a bigger block */
+        if (kept == block.size()) {
+            block.resize(2 * block.size());
+        }
+        file.read(block.data() + kept, block.size() - kept);
+        size_t filled = kept + file.gcount();
+        done = filled < block.size();
+
+        const char *p = block.data(), *end = p + filled;
+        while (p < end) {
+            const char *line_end = (const char *) memchr(p, '\n', end - p);
+            if (line_end == NULL) {
+                /* The rest of the line is in the next block */
+                if (!done) {
+                    break;
+                }
+                line_end = end;
+            }
+
+            /* The first field says what the line is */
+            while (p < line_end && (*p == ' ' || *p == '\t')) {
+                ++p;
+            }
+            const char *q = p;
+            while (q < line_end && *q != ' ' && *q != '\t' && *q != '\r') {
+                ++q;
+            }
+            if (q - p == 1 && *p == 'v') {
+                ++counts.positions;
+            } else if (q - p == 2 && p[0] == 'v' && p[1] == 'n') {
+                ++counts.normals;
+            } else if (q - p == 1 && *p == 'f') {
+                /* A corner gives a normal as "v//vn" or "v/vt/vn" */
+                size_t fields = 0;
+                bool normals = true;
+                while (q < line_end) {
+                    if (*q == ' ' || *q == '\t' || *q == '\r') {
+                        ++q;
+                        continue;
+                    }
+                    int slashes = 0;
+                    for (; q < line_end && *q != ' ' && *q != '\t' && *q != '\r'; ++q) {
+                        slashes += *q == '/';
+                    }
+                    ++fields;
+                    normals = normals && slashes == 2;
+                }
+                if (fields >= 3) {
+                    counts.corners += 3 * (fields - 2);
+                    counts.all_normals = counts.all_normals && normals;
+                }
+            }
+            p = line_end + 1;
+        }
+        kept = p < end ? end - p : 0;
+        memmove(block.data(), end - kept, kept);
+    }
+    file.clear();
+    file.seekg(0);
+}
+
+/* 'generate_normals' function:
+ *
+ * Fills in the normals of the corners appended to the object from
+ * 'first_corner' on that 'has_normal' marks as missing. 'corner_vertices'
+ * gives the position each of these corners was read from, out of
+ * 'num_vertices'.
+ *
+ * A corner's normal is the sum of the normals of the faces around its
+ * position, each weighted by the face's area and by its angle at the
+ * position, so that long thin triangles and finely split faces do not pull
+ * the normal their way. Faces bent more than 'crease_angle' away from the
+ * corner's own face are left out, which keeps the edges of boxes sharp
+ * while curved surfaces come out smooth.
+ *
+ * The faces around every position are found by sorting the corners by
+ * position. Then every thread weights the faces of a share of the
+ * triangles, and every thread sums the normals of a share of the positions.
+ */
+void generate_normals(Object &obj, size_t first_corner, const vector<GLuint> &corner_vertices,
+                      int num_vertices, const vector<char> &has_normal)
+{
+    const float crease_angle = 60.0f;
+    float min_dot = cos(deg2rad(crease_angle));
+    const Triple *verts = &obj.vertex_buffer[first_corner];
+    Triple *normals = &obj.normal_buffer[first_corner];
+    int num_corners = corner_vertices.size();
+    int num_triangles = num_corners / 3;
+
+    /* The unit normal of every face, and every corner's weighted normal */
+    vector<Vector3f> face_normals(num_triangles);
+    vector<Vector3f> weighted(num_corners);
+    parallel_for(num_triangles, [&](int begin, int end) {
+        for (int t = begin; t < end; ++t) {
+            Vector3f p[3];
+            for (int c = 0; c < 3; ++c) {
+                p[c] = Vector3f(verts[3 * t + c].x, verts[3 * t + c].y, verts[3 * t + c].z);
+            }
+            /* The cross product's length is twice the area */
+            Vector3f n = (p[1] - p[0]).cross(p[2] - p[0]);
+            face_normals[t] = n.norm() > 0 ? n.normalized() : Vector3f::Zero();
+            for (int c = 0; c < 3; ++c) {
+                Vector3f a = p[(c + 1) % 3] - p[c], b = p[(c + 2) % 3] - p[c];
+                float lengths = a.norm() * b.norm();
+                float angle = lengths > 0 ? acos(max(-1.0f, min(1.0f, a.dot(b) / lengths))) : 0;
+                weighted[3 * t + c] = n * angle;
+            }
+        }
+    });
+
+    /* Lists the corners of every position together, like a counting sort */
+    vector<int> first(num_vertices + 1, 0);
+    for (int i = 0; i < num_corners; ++i) {
+        ++first[corner_vertices[i] + 1];
+    }
+    for (int v = 0; v < num_vertices; ++v) {
+        first[v + 1] += first[v];
+    }
+    vector<int> sorted(num_corners);
+    vector<int> next(first.begin(), first.end() - 1);
+    for (int i = 0; i < num_corners; ++i) {
+        sorted[next[corner_vertices[i]]++] = i;
+    }
+
+    parallel_for(num_vertices, [&](int begin, int end) {
+        for (int v = begin; v < end; ++v) {
+            for (int i = first[v]; i < first[v + 1]; ++i) {
+                int corner = sorted[i];
+                if (has_normal[corner]) {
+                    continue;
+                }
+                const Vector3f &own = face_normals[corner / 3];
+                Vector3f sum = Vector3f::Zero();
+                for (int j = first[v]; j < first[v + 1]; ++j) {
+                    if (face_normals[sorted[j] / 3].dot(own) >= min_dot) {
+                        sum += weighted[sorted[j]];
+                    }
+                }
+                if (sum.norm() > 0) {
+                    sum.normalize();
+                } else {
+                    sum = own;
+                }
+                Triple n = {sum[0], sum[1], sum[2]};
+                normals[corner] = n;
+            }
+        }
+    });
+}
+
+/* 'map_file' function:
+ *
+ * Maps a whole file into memory for reading from start to end. If
+ * 'writable', the mapping can also be written to; pages that are written
+ * get private copies, and the file itself is never changed. Returns false
+ * if the file cannot be read.
+ */
+bool map_file(const string &filename, Mapped_File &file, bool writable)
+{
+    file.fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (file.fd < 0 || fstat(file.fd, &info) != 0) {
+        return false;
+    }
+    file.size = info.st_size;
+    if (file.size == 0) {
+        return true;
+    }
+    int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *data = mmap(NULL, file.size, protection, MAP_PRIVATE, file.fd, 0);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, file.size, MADV_SEQUENTIAL);
+    file.data = (char *) data;
+    return true;
+}
+
+/* 'read_file' function:
+ *
+ * Reads a whole file into 'text'. Unlike 'map_file', it is safe for files
+ * that an editor may truncate while we read them (reading a mapped page past
+ * the new end of a file raises SIGBUS); we just get what the file held at
+ * the time. Returns false if the file cannot be read.
+ */
+bool read_file(const string &filename, string &text)
+{
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    text.resize(max((off_t) 4096, info.st_size + 1));
+    size_t length = 0;
+    while (true) {
+        if (length == text.size()) {
+            text.resize(2 * text.size());
+        }
+        ssize_t count = read(fd, &text[length], text.size() - length);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            close(fd);
+            text.resize(length);
+            return count == 0;
+        }
+        length += count;
+    }
+}
+
+/* 'next_scene_line' function:
+ *
+ * Splits the line starting at 'pos' into fields separated by spaces, tabs
+ * or commas, and moves 'pos' to the start of the next line. Everything
+ * after a '#' is a comment. Returns false at the end of the file.
+ */
+bool next_scene_line(const string &filename, const char *&pos, const char *end,
+                     Scene_Line &line)
+{
+    if (pos >= end) {
+        return false;
+    }
+    const char *line_end = (const char *) memchr(pos, '\n', end - pos);
+    if (line_end == NULL) {
+        line_end = end;
+    }
+    line.start = pos;
+    line.end = (line_end > pos && line_end[-1] == '\r') ? line_end - 1 : line_end;
+    ++line.number;
+    line.count = 0;
+
+    /* 1 for characters that separate fields, 2 for the comment mark */
+    static const struct Separators {
+        unsigned char kind[256] = {};
+        Separators() { kind[' '] = kind['\t'] = kind[','] = kind['\r'] = 1; kind['#'] = 2; }
+    } separators;
+
+    const char *p = pos;
+    while (p < line.end) {
+        unsigned char kind = separators.kind[(unsigned char) *p];
+        if (kind == 2) {
+            break;
+        } else if (kind == 1) {
+            ++p;
+            continue;
+        }
+        const char *field = p;
+        while (p < line.end && separators.kind[(unsigned char) *p] == 0) {
+            ++p;
+        }
+        line.fields[line.count] = field;
+        line.lengths[line.count] = p - field;
+        if (++line.count > max_scene_fields) {
+            scene_error(filename, line, max_scene_fields, "too many fields");
         }
     }
+    pos = line_end + 1;
+    return true;
 }
 
-
-void splitBySpace(string s, vector<string> &split)
+/* 'field_is' function:
+ *
+ * Returns whether field 'i' of the line is the given word.
+ */
+bool field_is(const Scene_Line &line, int i, const char *word)
 {
-    stringstream stream(s);
-
-    string buffer;
-    while(getline(stream, buffer, ' ')) {
-        split.push_back(buffer);
-    }
+    return i < line.count && (size_t) line.lengths[i] == strlen(word)
+           && memcmp(line.fields[i], word, line.lengths[i]) == 0;
 }
 
+/* 'scene_error' function:
+ *
+ * Throws an error about field 'i' of a scene file line, or about the end of
+ * the line if it has no such field, as "file:line:column: message".
+ *
+ * @throws invalid_argument always
+ */
+void scene_error(const string &filename, const Scene_Line &line, int i, const string &msg)
+{
+    const char *at = (i < line.count) ? line.fields[i] : line.end;
+    throw invalid_argument(filename + ":" + to_string(line.number) + ":"
+                           + to_string(at - line.start + 1) + ": " + msg);
+}
 
-void parseObjFile(string filename, Object &obj)
+/* 'parse_short_float' function:
+ *
+ * Reads a number written with at most 7 digits and no exponent, like most
+ * numbers in scene files, returning false for any other text. Such a
+ * number and the power of ten it is divided by are exact as floats, so the
+ * single division rounds exactly like 'from_chars' would.
+ */
+bool parse_short_float(const char *p, const char *end, float &value)
 {
-    if (filename.find(".obj") == -1) {
-        throw invalid_argument("File " + filename + " needs to be a .obj file.");
+    bool negative = (p < end && *p == '-');
+    p += negative;
+    uint32_t digits = 0;
+    int num_digits = 0, decimals = 0;
+    bool point = false;
+    for (; p < end; ++p) {
+        if (*p >= '0' && *p <= '9') {
+            digits = 10 * digits + (*p - '0');
+            ++num_digits;
+            decimals += point;
+        } else if (*p == '.' && !point) {
+            point = true;
+        } else {
+            return false;
+        }
     }
-    
-    string buffer;
-    ifstream file;
-    file.open(filename.c_str(), ifstream::in);
-    if (file.fail()) {
-        string msg = "Could not read obj file '" + filename + "'.";
-        throw invalid_argument(msg);
+    if (num_digits == 0 || num_digits > 7) {
+        return false;
     }
+    static const float powers[8] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f};
+    value = (float) digits / powers[decimals];
+    if (negative) {
+        value = -value;
+    }
+    return true;
+}
 
-    vector<Triple> vertexSet;
-    vector<Triple> normalSet;
-    Triple zeroPlaceHolder = {0.0f, 0.0f, 0.0f};
-    vertexSet.push_back(zeroPlaceHolder);
-    normalSet.push_back(zeroPlaceHolder);
-
-    vector<string> element;
-    while (getline(file, buffer)) {
-        element.clear();
-        splitBySpace(buffer, element);
-        if (element[0] == "v") {
-            Triple vertex = {stof(element[1]), stof(element[2]), stof(element[3])};
-            vertexSet.push_back(vertex);
-            continue;
-        } else if (element[0] == "vn") {
-            Triple normal = {stof(element[1]), stof(element[2]), stof(element[3])};
-            normalSet.push_back(normal);
+/* 'read_floats' function:
+ *
+ * Reads fields 1 to 'count' of the line as numbers into 'values'. The line
+ * must have no other fields.
+ *
+ * @throws invalid_argument if a field is missing or not a number
+ */
+void read_floats(const string &filename, const Scene_Line &line, int count, float *values)
+{
+    for (int i = 1; i <= count; ++i) {
+        if (i >= line.count) {
+            scene_error(filename, line, i, "expected " + to_string(count) + " numbers after '"
+                        + string(line.fields[0], line.lengths[0]) + "'");
+        }
+        const char *field_end = line.fields[i] + line.lengths[i];
+        if (parse_short_float(line.fields[i], field_end, values[i - 1])) {
             continue;
         }
-
-        /* If not a vertex or a normal, treats it as a face */
-        string element_str;
-
-        /* Vertex of First Face */
-        element_str = element[1];
-        element[1].erase(element[1].find("//"));
-        Triple v1 = vertexSet[stoi(element[1])];
-        /* Normal of First Face */
-        element_str.erase(0, element_str.find("//") + 2);
-        Triple sn1 = normalSet[stoi(element_str)];
-        /* Adds First Face Vertex and Normal to their Buffers */
-        obj.vertex_buffer.push_back(v1);
-        obj.normal_buffer.push_back(sn1);
-
-        /* Vertex of Second Face */
-        element_str = element[2];
-        element[2].erase(element[2].find("//"));
-        Triple v2 = vertexSet[stoi(element[2])];
-        /* Normal of Second Face */
-        element_str.erase(0, element_str.find("//") + 2);
-        Triple sn2 = normalSet[stoi(element_str)];
-        /* Adds Second Face Vertex and Normal to their Buffers */
-        obj.vertex_buffer.push_back(v2);
-        obj.normal_buffer.push_back(sn2);
-
-        /* Vertex of Third Face */
-        element_str = element[3];
-        element[3].erase(element[3].find("//"));
-        Triple v3 = vertexSet[stoi(element[3])];
-        /* Normal of Third Face */
-        element_str.erase(0, element_str.find("//") + 2);
-        Triple sn3 = normalSet[stoi(element_str)];
-        /* Adds Third Face Vertex and Normal to their Buffers */
-        obj.vertex_buffer.push_back(v3);
-        obj.normal_buffer.push_back(sn3);
+        from_chars_result result = from_chars(line.fields[i], field_end, values[i - 1]);
+        if (result.ec != errc() || result.ptr != field_end) {
+            scene_error(filename, line, i, "'" + string(line.fields[i], line.lengths[i])
+                        + "' is not a number");
+        }
+    }
+    if (line.count > count + 1) {
+        scene_error(filename, line, count + 1, "unexpected field");
     }
-
-    file.close();
 }
 
 /** 
- * Populates all global fields not already filled with information extracted 
- * by parsing the format file that was entered in the command line.
+ * Fills 'scene' with the information extracted by parsing the format file
+ * that was entered in the command line.
+ *
+ * The file is mapped into memory and read in one pass, one line at a time.
+ * Sections are told apart by what their lines say rather than by the blank
+ * lines between them: "camera:" starts the camera, "light" lines are
+ * lights, "objects:" starts the list of objects, and after it a line with
+ * just an object's name starts an instance of that object. Anything else
+ * is an error naming the line and column it was found at.
+ *
+ * A scene can also be put together from other scene files. A line
+ * "include file.txt" adds the lights and instances of that scene (but not
+ * its camera), and a line "library file.txt" lets this file use the
+ * objects listed in that one by name; see 'parse_scene_text'. However many
+ * names in however many files refer to the same mesh, the scene has one
+ * object for it, kept by 'mesh_key', so the mesh is read and uploaded once.
+ *
+ * Meshes listed in 'loaded_meshes' by their 'mesh_key' are not read again;
+ * their objects are left without a mesh, and 'swap_in_scene' gives them the
+ * mesh that is already loaded. If 'read_meshes' is false no OBJ files are
+ * read at all, and 'swap_in_scene' has them read in the background.
  * 
  * @param filename, the filename entered in the command line
- * @throws invalid_argument if it fails to read the file
+ * @throws invalid_argument if it fails to read or understand the file
  */ 
-void parseFormatFile(string filename)
+void parseFormatFile(string filename, Scene_Data &scene,
+                     const map<string, string> &loaded_meshes, bool read_meshes)
+{
+    Scene_Parse parse;
+    parse.scene = &scene;
+    parse.loaded_meshes = &loaded_meshes;
+    parse.read_meshes = read_meshes;
+    Object_Names names(&parse.scratch);
+    Node_Names nodes(&parse.scratch);
+    parse_scene_text(filename, parse, names, nodes, false);
+
+    /* Groups the instances by object, keeping each object's instances in
+     * the order the files list them. The scene's table is allocated once,
+     * at its final size, from the scene's arena; the parse's scratch memory
+     * goes away when we return. The instances under nodes keep their own
+     * transformations, as parsed, for the scene graph.
+     */
+    scene.instance_table.resize(parse.instances.size());
+    size_t next = 0;
+    for (Scene_Objects::iterator it = scene.objects.begin(); it != scene.objects.end(); ++it) {
+        it->second.instances = scene.instance_table.data() + next;
+        next += it->second.instance_count;
+        it->second.instance_count = 0;
+    }
+    vector<Node_Instance> attached;
+    for (size_t i = 0; i < parse.owners.size(); ++i) {
+        Object *owner = parse.owners[i];
+        Instance &inst = owner->instances[owner->instance_count++];
+        inst = parse.instances[i];
+        if (parse.instance_nodes[i] >= 0) {
+            Node_Instance placed;
+            placed.node = parse.instance_nodes[i];
+            placed.inst = &inst;
+            copy(inst.model, inst.model + 16, placed.local);
+            attached.push_back(placed);
+        }
+    }
+    build_scene_graph(parse.nodes, attached, scene.graph);
+}
+
+/* 'parse_scene_text' function:
+ *
+ * Reads one text scene file for 'parseFormatFile', looking up the objects
+ * its instances name in 'names' and the nodes they are placed under in
+ * 'nodes'. Only the first file's camera is used; the camera sections of
+ * included files are skipped.
+ *
+ * "include" and "library" lines read the named file (relative to this one)
+ * right away. An included scene has names of its own, so it can use a name
+ * this file uses for another mesh. A library adds the objects it lists to
+ * this file's 'names' and may list nothing else ('library' is true while
+ * reading one). A name may be listed twice only for the same mesh, so two
+ * libraries can both list a mesh they share.
+ *
+ * After the objects, a line "node name" or "node name parent" starts a node
+ * of the scene graph, under the named parent node if one is given. Since
+ * "node cube.obj" can also name an object, nodes are only read once the
+ * list of objects has ended, either at the first instance or at a line
+ * "nodes:" that ends it before any instance. Like an
+ * instance, it is followed by its transformations, and it may also have a
+ * line "spin x y z speed" to keep turning about the axis (x, y, z), in its
+ * own frame, at 'speed' radians per second. A line "parent name" in an
+ * instance places the instance under that node, so its transformations are
+ * relative to the node. Nodes must be listed before the nodes and instances
+ * under them.
+ *
+ * @throws invalid_argument if it fails to read or understand a file, or if
+ *         a file includes itself
+ */
+void parse_scene_text(const string &filename, Scene_Parse &parse, Object_Names &names,
+                      Node_Names &nodes, bool library)
 {
     if (filename.find(".txt") == -1) {
         throw invalid_argument("File " + filename + " needs to be a .txt file.");
     }
 
-    string buffer;
-    ifstream file;
-    file.open(filename.c_str(), ifstream::in);
-    if (file.fail()) {
+    /* Read rather than mapped, since '-watch' reloads the file while it may
+     * still be being written
+     */
+    string text;
+    if (!read_file(filename, text)) {
         throw invalid_argument("Could not read format file '" + filename + "'.");
     }
 
+    string canonical = filename;
+    char *resolved = realpath(filename.c_str(), NULL);
+    if (resolved != NULL) {
+        canonical = resolved;
+        free(resolved);
+    }
+    if (find(parse.open_files.begin(), parse.open_files.end(), canonical)
+        != parse.open_files.end()) {
+        throw invalid_argument("Scene file '" + filename + "' includes itself.");
+    }
+    parse.open_files.push_back(canonical);
+    bool top = parse.open_files.size() == 1;
+    Scene_Data &scene = *parse.scene;
+    scene.scene_files.emplace_back(filename.data(), filename.size());
+
     /* Saves the directory where scene file and its obj files are stored */
     string directory = filename;
     directory.erase(directory.find_last_of('/') + 1);
 
-    vector<string> line;
-
-    /* Reads in camera and perspective parameters */
-    while (getline(file, buffer)) {
-        line.clear();
-        splitBySpace(buffer, line);
+    enum { camera_section, objects_section, instances_section } section = camera_section;
 
-        if (line.size() == 0) {
-            break;
-        } else if (line[0] == "position") {
-            cam_position[0] = stof(line[1]);
-            cam_position[1] = stof(line[2]);
-            cam_position[2] = stof(line[3]);
-        } else if (line[0] == "orientation") {
-            cam_orientation_axis[0] = stof(line[1]);
-            cam_orientation_axis[1] = stof(line[2]);
-            cam_orientation_axis[2] = stof(line[3]);
-            cam_orientation_angle = rad2deg(stof(line[4]));
-        } else if (line[0] == "near") {
-            near_param = stof(line[1]);
-        } else if (line[0] == "far") {
-            far_param = stof(line[1]);
-        } else if (line[0] == "left") {
-            left_param = stof(line[1]);
-        } else if (line[0] == "right") {
-            right_param = stof(line[1]);
-        } else if (line[0] == "top") {
-            top_param = stof(line[1]);
-        } else if (line[0] == "bottom") {
-            bottom_param = stof(line[1]);
-        }
-    }
-
-    /* Reads in all point light sources */
-    while (getline(file, buffer)) {
-        line.clear();
-        splitBySpace(buffer, line);
+    /* The instance or node whose lines are being read */
+    Instance *inst = NULL;
+    int node = -1;
+    vector<Transform> transforms;
+    auto end_record = [&]() {
+        if (inst != NULL) {
+            bake_transforms(transforms, *inst);
+        } else if (node >= 0) {
+            bake_transforms(transforms, parse.nodes[node].local);
+        }
+        inst = NULL;
+        node = -1;
+        transforms.clear();
+    };
 
-        if (line.size() == 0) {
-            break;
+    Scene_Line line;
+    const char *pos = text.data(), *end = text.data() + text.size();
+    while (next_scene_line(filename, pos, end, line)) {
+        if (line.count == 0) {
+            continue;
         }
 
-        Point_Light light;
+        if ((field_is(line, 0, "include") || field_is(line, 0, "library")) && line.count == 2) {
+            bool include = field_is(line, 0, "include");
+            if (library && include) {
+                scene_error(filename, line, 0, "a library can only list objects");
+            }
 
-        light.position[0] = stof(line[1]);
-        light.position[1] = stof(line[2]);
-        light.position[2] = stof(line[3]);
-        light.position[3] = 1;
+            /* The included instances go into the table after this file's
+             * instance, which may move it, so its transformations are
+             * baked first and the instance ends here.
+             */
+            end_record();
+            string path = scene_path(directory, string(line.fields[1], line.lengths[1]));
+            if (include) {
+                Object_Names included_names(&parse.scratch);
+                Node_Names included_nodes(&parse.scratch);
+                parse_scene_text(path, parse, included_names, included_nodes, false);
+            } else {
+                parse_scene_text(path, parse, names, nodes, true);
+            }
+            continue;
+        }
 
-        light.color[0] = stof(line[5]);
-        light.color[1] = stof(line[6]);
-        light.color[2] = stof(line[7]);
+        if (section != objects_section && field_is(line, 0, "node")
+            && (line.count == 2 || line.count == 3)) {
+            if (library) {
+                scene_error(filename, line, 0, "a library can only list objects");
+            }
+            if (section == camera_section) {
+                scene_error(filename, line, 0, "nodes must come after 'objects:'");
+            }
+            end_record();
 
-        light.attenuation_k = stof(line[9]);
-        
-        lights.push_back(light);
-    }
+            Parsed_Node parsed;
+            if (line.count == 3) {
+                Node_Names::iterator parent = nodes.find(string_view(line.fields[2], line.lengths[2]));
+                if (parent == nodes.end()) {
+                    scene_error(filename, line, 2, "unknown node '"
+                                + string(line.fields[2], line.lengths[2]) + "'");
+                }
+                parsed.parent = parent->second;
+            }
+            if (!nodes.emplace(string_view(line.fields[1], line.lengths[1]),
+                               (int) parse.nodes.size()).second) {
+                scene_error(filename, line, 1, "node '" + string(line.fields[1], line.lengths[1])
+                            + "' is listed twice");
+            }
+            parse.nodes.push_back(parsed);
+            node = parse.nodes.size() - 1;
+            continue;
+        }
 
-    /* Reads in all objects storing them in the objects map */
-    while (getline(file, buffer)) {
-        line.clear();
-        splitBySpace(buffer, line);
+        if (field_is(line, 0, "light")) {
+            if (library) {
+                scene_error(filename, line, 0, "a library can only list objects");
+            }
+            if (section != camera_section) {
+                scene_error(filename, line, 0, "lights must come before 'objects:'");
+            }
+            float values[7];
+            read_floats(filename, line, 7, values);
+            Point_Light light;
+            light.position[0] = values[0];
+            light.position[1] = values[1];
+            light.position[2] = values[2];
+            light.position[3] = 1;
+            light.color[0] = values[3];
+            light.color[1] = values[4];
+            light.color[2] = values[5];
+            light.attenuation_k = values[6];
+            scene.lights.push_back(light);
+            continue;
+        }
 
-        if (line.size() == 0) {
-            break;
+        if (section == camera_section) {
+            /* Reads in camera and perspective parameters */
+            if (field_is(line, 0, "objects:") && line.count == 1) {
+                section = objects_section;
+                continue;
+            }
+            if (library) {
+                scene_error(filename, line, 0, "a library can only list objects");
+            }
+            if (!top) {
+                continue;
+            }
+            scene.camera_text.append(line.start, line.end);
+            scene.camera_text += "\n";
+            float values[4];
+            if (field_is(line, 0, "camera:") && line.count == 1) {
+                continue;
+            } else if (field_is(line, 0, "position")) {
+                read_floats(filename, line, 3, scene.cam_position);
+            } else if (field_is(line, 0, "orientation")) {
+                read_floats(filename, line, 4, values);
+                copy(values, values + 3, scene.cam_orientation_axis);
+                scene.cam_orientation_angle = rad2deg(values[3]);
+            } else if (field_is(line, 0, "near")) {
+                read_floats(filename, line, 1, &scene.near_param);
+            } else if (field_is(line, 0, "far")) {
+                read_floats(filename, line, 1, &scene.far_param);
+            } else if (field_is(line, 0, "left")) {
+                read_floats(filename, line, 1, &scene.left_param);
+            } else if (field_is(line, 0, "right")) {
+                read_floats(filename, line, 1, &scene.right_param);
+            } else if (field_is(line, 0, "top")) {
+                read_floats(filename, line, 1, &scene.top_param);
+            } else if (field_is(line, 0, "bottom")) {
+                read_floats(filename, line, 1, &scene.bottom_param);
+            } else {
+                scene_error(filename, line, 0, "unknown camera parameter '"
+                            + string(line.fields[0], line.lengths[0]) + "'");
+            }
+            continue;
         }
 
-        if (line[0] == "objects:") {
+        if (section == objects_section && field_is(line, 0, "nodes:") && line.count == 1) {
+            if (library) {
+                scene_error(filename, line, 0, "a library can only list objects");
+            }
+            section = instances_section;
             continue;
         }
 
-        /* Reinitializes obj for each new object we need */
-        Object obj;
-        parseObjFile(directory + line[1], obj);
-        objects.insert(pair<string, Object>(line[0], obj));
-    }
+        if (section == objects_section && line.count == 2) {
+            /* Reads in an object, or finds the one already read for the
+             * same mesh, and names it
+             */
+            Object &obj = read_scene_object(
+                scene_path(directory, string(line.fields[1], line.lengths[1])),
+                scene, *parse.loaded_meshes, parse.read_meshes);
+            pair<Object_Names::iterator, bool> named =
+                names.emplace(string_view(line.fields[0], line.lengths[0]), &obj);
+            if (!named.second && named.first->second != &obj) {
+                scene_error(filename, line, 0, "object '" + string(named.first->first)
+                            + "' is listed twice");
+            }
+            continue;
+        }
 
-    /* Reads in all objects instances */
-    Object *currObj = NULL;
-    int instanceIdx;
-    while (getline(file, buffer)) {
-        line.clear();
-        splitBySpace(buffer, line);
+        if (library) {
+            scene_error(filename, line, 0, "a library can only list objects");
+        }
+        section = instances_section;
 
-        /* If the current object is empty, we are ready to read in a instance.
+        /* Instances go into the instance table in the order the file lists
+         * them, remembering whose they are. Their transformations are kept
+         * in 'transforms' until the next instance starts, and then baked.
+         */
 
-         * In our scene, each object (in objects map) only acts as a template
+        /* In our scene, each object (in objects map) only acts as a template
          * and uses instances to describe specific modifications of itself
-         * that actually get rendered to the screen.
-         * 
-         * In the format file, the start of an instance is indicated via:
-         *      [object name] [object filename]
-         * We use [object name] to grab the object from the object map.
-         * We make a instance and set a new instanceIndex to prepare 
-         * for processing.
+         * that actually get rendered to the screen. A line holding just an
+         * object's name starts a new instance of it.
          */
-        if (currObj == NULL) {
-            currObj = &objects[line[0]];
-            instanceIdx = currObj->instances.size();
-            Instance inst;
-            currObj->instances.push_back(inst);
-            continue;
-        }
-
-        /* Reset the current object to empty if we've reached the end of a 
-         * instance description. */
-        if (line.size() == 0) {
-            currObj = NULL;
+        if (line.count == 1) {
+            Object_Names::iterator found = names.find(string_view(line.fields[0], line.lengths[0]));
+            if (found == names.end()) {
+                scene_error(filename, line, 0, "unknown object '"
+                            + string(line.fields[0], line.lengths[0]) + "'");
+            }
+            end_record();
+            parse.instances.push_back(Instance());
+            parse.owners.push_back(found->second);
+            parse.instance_nodes.push_back(-1);
+            inst = &parse.instances.back();
+            ++found->second->instance_count;
             continue;
         }
-
-        /* Processes the reflectance parameters for the transform set */
-        if (line[0] == "ambient") {
-            currObj->instances[instanceIdx].ambient_reflect[0] = stof(line[1]);
-            currObj->instances[instanceIdx].ambient_reflect[1] = stof(line[2]);
-            currObj->instances[instanceIdx].ambient_reflect[2] = stof(line[3]);
-            continue;
-        } else if (line[0] == "diffuse") {
-            currObj->instances[instanceIdx].diffuse_reflect[0] = stof(line[1]);
-            currObj->instances[instanceIdx].diffuse_reflect[1] = stof(line[2]);
-            currObj->instances[instanceIdx].diffuse_reflect[2] = stof(line[3]);
-            continue;
-        } else if (line[0] == "specular") {
-            currObj->instances[instanceIdx].specular_reflect[0] = stof(line[1]);
-            currObj->instances[instanceIdx].specular_reflect[1] = stof(line[2]);
-            currObj->instances[instanceIdx].specular_reflect[2] = stof(line[3]);
-            continue;
-        } else if (line[0] == "shininess") {
-            currObj->instances[instanceIdx].shininess = stof(line[1]);
-            continue;
+        if (inst == NULL && node < 0) {
+            scene_error(filename, line, 0, "expected an object name to start an instance");
         }
 
-        /* Processes one line of the file as a transform */
+        /* Processes the reflectance parameters and transforms of the
+         * instance, or the transforms and spin of the node
+         */
         Transform transformation;
-        transformation.data[0] = stof(line[1]);
-        transformation.data[1] = stof(line[2]);
-        transformation.data[2] = stof(line[3]);
-        if (line[0][0] == 't') {
+        bool transform_line = field_is(line, 0, "t") || field_is(line, 0, "s")
+                              || field_is(line, 0, "r");
+        if (node >= 0 && !transform_line) {
+            if (!field_is(line, 0, "spin")) {
+                scene_error(filename, line, 0, "unknown node parameter '"
+                            + string(line.fields[0], line.lengths[0]) + "'");
+            }
+            float *spin = parse.nodes[node].spin;
+            read_floats(filename, line, 4, spin);
+            if (spin[0] == 0 && spin[1] == 0 && spin[2] == 0) {
+                scene_error(filename, line, 1, "a spin needs a nonzero axis");
+            }
+        } else if (field_is(line, 0, "parent") && line.count == 2) {
+            Node_Names::iterator parent = nodes.find(string_view(line.fields[1], line.lengths[1]));
+            if (parent == nodes.end()) {
+                scene_error(filename, line, 1, "unknown node '"
+                            + string(line.fields[1], line.lengths[1]) + "'");
+            }
+            parse.instance_nodes.back() = parent->second;
+        } else if (field_is(line, 0, "ambient")) {
+            read_floats(filename, line, 3, inst->ambient_reflect);
+        } else if (field_is(line, 0, "diffuse")) {
+            read_floats(filename, line, 3, inst->diffuse_reflect);
+        } else if (field_is(line, 0, "specular")) {
+            read_floats(filename, line, 3, inst->specular_reflect);
+        } else if (field_is(line, 0, "shininess")) {
+            read_floats(filename, line, 1, &inst->shininess);
+        } else if (field_is(line, 0, "t")) {
             transformation.type = translation;
-        } else if (line[0][0] == 'r') {
+            read_floats(filename, line, 3, transformation.data);
+            transforms.push_back(transformation);
+        } else if (field_is(line, 0, "s")) {
+            transformation.type = scaling;
+            read_floats(filename, line, 3, transformation.data);
+            transforms.push_back(transformation);
+        } else if (field_is(line, 0, "r")) {
             transformation.type = rotation;
-            transformation.data[3] = rad2deg(stof(line[4])); 
+            read_floats(filename, line, 4, transformation.data);
+            transformation.data[3] = rad2deg(transformation.data[3]);
+            transforms.push_back(transformation);
         } else {
-            transformation.type = scaling;
+            scene_error(filename, line, 0, "unknown instance parameter '"
+                        + string(line.fields[0], line.lengths[0]) + "'");
         }
+    }
+    end_record();
+    parse.open_files.pop_back();
+}
 
-        /* Adds the transform to the object instance's list of tranforms */
-        currObj->instances[instanceIdx].transforms.push_back(transformation);
+/* Returns the file a scene file in 'directory' names with 'path', which is
+ * relative to the scene file unless it starts with a slash.
+ */
+string scene_path(const string &directory, const string &path)
+{
+    if (!path.empty() && path[0] == '/') {
+        return path;
     }
-   
-    file.close();
+    return directory + path;
+}
+
+/* 'mesh_key' function:
+ *
+ * Returns the key a mesh file's mesh is kept under: the file's canonical
+ * path followed by its size and modification time. Every path that leads
+ * to the file gives the same key, so the mesh is read and uploaded once
+ * however it is named, and a file that is written again gets a new key, so
+ * its old mesh is not mistaken for the new one.
+ *
+ * Only the file's metadata is looked at, so keying the meshes of a scene
+ * while it is parsed reads none of them; they are left for the loader
+ * threads. A file that cannot be read is keyed by the name it was given,
+ * and reading its mesh reports the error.
+ */
+string mesh_key(const string &filename)
+{
+    char *resolved = realpath(filename.c_str(), NULL);
+    struct stat info;
+    if (resolved == NULL || stat(resolved, &info) != 0) {
+        free(resolved);
+        return filename;
+    }
+    string canonical = resolved;
+    free(resolved);
+    int64_t time = (int64_t) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+
+    char key[64];
+    snprintf(key, sizeof(key), "#%llx@%llx", (unsigned long long) info.st_size,
+             (unsigned long long) time);
+    return canonical + key;
+}
+
+/* 'read_scene_object' function:
+ *
+ * Returns the object of 'scene' for the mesh in the given OBJ or ".chunks"
+ * file, adding it if the scene has none yet. A new object's mesh is read
+ * unless 'read_meshes' is false or 'loaded_meshes' already has it; see
+ * 'parseFormatFile'.
+ *
+ * @throws invalid_argument if it fails to read the mesh
+ */
+Object &read_scene_object(const string &filename, Scene_Data &scene,
+                          const map<string, string> &loaded_meshes, bool read_meshes)
+{
+    string key = mesh_key(filename);
+    Scene_Objects::iterator found = scene.objects.find(string_view(key));
+    if (found != scene.objects.end()) {
+        return found->second;
+    }
+    Object &obj = scene.objects[Scene_Objects::key_type(key, &scene.arena)];
+    obj.filename = filename;
+    obj.mesh_key = key;
+    if (read_meshes && loaded_meshes.count(key) == 0) {
+        load_mesh_file(obj.filename, obj);
+    }
+    return obj;
+}
+
+/* 'has_extension' function:
+ *
+ * Returns whether 'filename' ends with 'extension' (such as ".txt").
+ */
+bool has_extension(const string &filename, const string &extension)
+{
+    return filename.size() >= extension.size()
+           && filename.compare(filename.size() - extension.size(), extension.size(),
+                               extension) == 0;
+}
+
+/* 'read_scene_file' function:
+ *
+ * Reads a scene from a binary ".scene" file with 'open_binary_scene', or
+ * from a text scene file with 'parseFormatFile'.
+ *
+ * @throws invalid_argument if it fails to read the file
+ */
+void read_scene_file(string filename, Scene_Data &scene,
+                     const map<string, string> &loaded_meshes, bool read_meshes)
+{
+    if (has_extension(filename, ".scene")) {
+        open_binary_scene(filename, scene, loaded_meshes, read_meshes);
+    } else {
+        parseFormatFile(filename, scene, loaded_meshes, read_meshes);
+    }
+}
+
+/* 'open_binary_scene' function:
+ *
+ * Fills 'scene' from a binary ".scene" file written by 'convert_scene'.
+ * The file is mapped into memory and each object's instances point straight
+ * into it, so loading does no work per instance at all; their pages are
+ * read from disk the first time they are drawn. The mapping is private, so
+ * if an instance's material id ever has to change, only its page is copied.
+ * Meshes are read as in 'parseFormatFile'.
+ *
+ * @throws invalid_argument if it fails to read the file
+ */
+void open_binary_scene(string filename, Scene_Data &scene,
+                       const map<string, string> &loaded_meshes, bool read_meshes)
+{
+    shared_ptr<Mapped_File> file(new Mapped_File());
+    if (!map_file(filename, *file, true)) {
+        throw invalid_argument("Could not read scene file '" + filename + "'.");
+    }
+    /* The instances are drawn every frame rather than read once */
+    madvise(file->data, file->size, MADV_NORMAL);
+
+    /* Checks that every table and string lies inside the file */
+    string not_scene = "File " + filename + " is not a valid .scene file.";
+    const Scene_File_Header *header = (const Scene_File_Header *) file->data;
+    auto inside = [&file](uint64_t offset, uint64_t count, uint64_t size) {
+        return offset <= file->size && count <= (file->size - offset) / size;
+    };
+    if (file->size < sizeof(Scene_File_Header) || memcmp(header->magic, "SCENE1", 7) != 0
+        || !inside(header->camera_text_offset, header->camera_text_length, 1)
+        || !inside(header->lights_offset, header->light_count, sizeof(Point_Light))
+        || !inside(header->objects_offset, header->object_count, sizeof(Scene_File_Object))
+        || !inside(header->instances_offset, header->instance_count, sizeof(Instance))
+        || header->instances_offset % alignof(Instance) != 0) {
+        throw invalid_argument(not_scene);
+    }
+
+    scene.camera_text.assign(file->data + header->camera_text_offset, header->camera_text_length);
+    copy(header->cam_position, header->cam_position + 3, scene.cam_position);
+    copy(header->cam_orientation_axis, header->cam_orientation_axis + 3,
+         scene.cam_orientation_axis);
+    scene.cam_orientation_angle = header->cam_orientation_angle;
+    scene.near_param = header->near_param;
+    scene.far_param = header->far_param;
+    scene.left_param = header->left_param;
+    scene.right_param = header->right_param;
+    scene.top_param = header->top_param;
+    scene.bottom_param = header->bottom_param;
+
+    const Point_Light *lights = (const Point_Light *) (file->data + header->lights_offset);
+    scene.lights.assign(lights, lights + header->light_count);
+
+    string directory = filename;
+    directory.erase(directory.find_last_of('/') + 1);
+
+    const Scene_File_Object *table = (const Scene_File_Object *) (file->data + header->objects_offset);
+    Instance *instances = (Instance *) (file->data + header->instances_offset);
+    for (uint32_t i = 0; i < header->object_count; ++i) {
+        const Scene_File_Object &entry = table[i];
+        if (!inside(entry.name_offset, entry.name_length, 1)
+            || !inside(entry.path_offset, entry.path_length, 1)
+            || entry.first_instance > header->instance_count
+            || entry.instance_count > header->instance_count - entry.first_instance) {
+            throw invalid_argument(not_scene);
+        }
+        string path(file->data + entry.path_offset, entry.path_length);
+        Object &obj = read_scene_object(scene_path(directory, path), scene,
+                                        loaded_meshes, read_meshes);
+
+        /* Two entries can only share a mesh if their files were made the
+         * same after the scene was converted.
+         */
+        if (obj.instances != NULL) {
+            throw invalid_argument("File " + filename + " lists the mesh in " + path
+                                   + " twice; convert it again.");
+        }
+        obj.instances = instances + entry.first_instance;
+        obj.instance_count = entry.instance_count;
+    }
+    scene.scene_files.emplace_back(filename.data(), filename.size());
+    scene.binary_file = file;
 }
 
+/* 'convert_scene' function:
+ *
+ * Writes a text scene file as a binary ".scene" file that loads without
+ * being parsed; see 'open_binary_scene'. Material ids are numbered like
+ * 'assign_material_ids' numbers them, so loading does not change them.
+ *
+ * @throws invalid_argument if it fails to read or write a file
+ */
+void convert_scene(string text_filename, string binary_filename)
+{
+    Scene_Data scene;
+    parseFormatFile(text_filename, scene, map<string, string>(), false);
+
+    map<Material_Key, int> ids;
+    for (Scene_Objects::iterator it = scene.objects.begin(); it != scene.objects.end(); ++it) {
+        for (size_t i = 0; i < it->second.instance_count; ++i) {
+            number_material(ids, it->second.instances[i]);
+        }
+    }
+
+    /* The camera text and the names and paths of the objects go right after
+     * the header, then the tables.
+     */
+    string directory = text_filename;
+    directory.erase(directory.find_last_of('/') + 1);
+    string strings(scene.camera_text);
+    vector<Scene_File_Object> table;
+    uint64_t first_instance = 0;
+    for (Scene_Objects::iterator it = scene.objects.begin(); it != scene.objects.end(); ++it) {
+        Scene_File_Object entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.first_instance = first_instance;
+        entry.instance_count = it->second.instance_count;
+        first_instance += entry.instance_count;
+
+        string path = it->second.filename;
+        if (path.compare(0, directory.size(), directory) == 0) {
+            path.erase(0, directory.size());
+        }
+        entry.name_offset = sizeof(Scene_File_Header) + strings.size();
+        entry.name_length = it->first.size();
+        strings += it->first;
+        entry.path_offset = sizeof(Scene_File_Header) + strings.size();
+        entry.path_length = path.size();
+        strings += path;
+        table.push_back(entry);
+    }
+
+    Scene_File_Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "SCENE1", 7);
+    copy(scene.cam_position, scene.cam_position + 3, header.cam_position);
+    copy(scene.cam_orientation_axis, scene.cam_orientation_axis + 3, header.cam_orientation_axis);
+    header.cam_orientation_angle = scene.cam_orientation_angle;
+    header.near_param = scene.near_param;
+    header.far_param = scene.far_param;
+    header.left_param = scene.left_param;
+    header.right_param = scene.right_param;
+    header.top_param = scene.top_param;
+    header.bottom_param = scene.bottom_param;
+    header.camera_text_offset = sizeof(header);
+    header.camera_text_length = scene.camera_text.size();
+    header.light_count = scene.lights.size();
+    header.object_count = table.size();
+    header.instance_count = scene.instance_table.size();
+    const uint64_t align = 64;
+    header.lights_offset = (sizeof(header) + strings.size() + align - 1) / align * align;
+    header.objects_offset = (header.lights_offset + scene.lights.size() * sizeof(Point_Light)
+                             + align - 1) / align * align;
+    header.instances_offset = (header.objects_offset + table.size() * sizeof(Scene_File_Object)
+                               + align - 1) / align * align;
+
+    /* A viewer may have the old file mapped, and shrinking a mapped file
+     * makes reading its lost pages crash. So we write a new file and rename
+     * it over the old one, which readers keep as it was.
+     */
+    string temp_filename = binary_filename + ".tmp";
+    ofstream file(temp_filename, ios::binary);
+    if (file.fail()) {
+        throw invalid_argument("Could not write scene file '" + temp_filename + "'.");
+    }
+    file.write((const char *) &header, sizeof(header));
+    file.write(strings.data(), strings.size());
+    file.seekp(header.lights_offset);
+    file.write((const char *) scene.lights.data(), scene.lights.size() * sizeof(Point_Light));
+    file.seekp(header.objects_offset);
+    file.write((const char *) table.data(), table.size() * sizeof(Scene_File_Object));
+    file.seekp(header.instances_offset);
+    file.write((const char *) scene.instance_table.data(),
+               scene.instance_table.size() * sizeof(Instance));
+    file.close();
+    if (file.fail() || rename(temp_filename.c_str(), binary_filename.c_str()) != 0) {
+        remove(temp_filename.c_str());
+        throw invalid_argument("Could not write scene file '" + binary_filename + "'.");
+    }
+
+    cout << "Wrote " << table.size() << " objects and " << scene.instance_table.size()
+         << " instances to " << binary_filename << "\n";
+}
 
 void usage(void) {
-    cerr << "Enter input in the form: scene_description_file.txt xres yres\n\t"
-            "xres, yres must be positive integers\n";
+    cerr << "Enter input in the form: scene_description_file.txt [more.txt ...] xres yres [options]\n\t"
+            "xres, yres must be positive integers; keys 1-9, 0, [ and ] switch between scenes\n"
+            "or: -convert mesh.obj mesh.chunks\n\t"
+            "to write a mesh in chunks that are streamed in as they come into view\n"
+            "or: -convert scene.txt scene.scene\n\t"
+            "to write a scene in a binary form that loads without parsing\n"
+            "or: -bench results.json [-warmup n] [-repetitions n] scene.txt [more.txt ...]\n\t"
+            "to time loading and drawing the scenes without a window (defaults 3 and 20)\n"
+            "Options:\n\t"
+            "-light_cutoff c   fraction of a light's color below which it is ignored\n\t"
+            "                  (0 < c < 1, default 1/256)\n\t"
+            "-refresh hz       most frames drawn per second (hz > 0, default 60)\n\t"
+            "-benchmark        redraw continuously as fast as possible\n\t"
+            "-render prefix    render without a window to prefix_0000.ppm, ... and exit\n\t"
+            "-orientations f   with -render, one image per 'x y z angle' line of f\n\t"
+            "-turntable n      with -render, n images turning the scene about the y-axis\n\t"
+            "-format ppm|png   with -render, the image file format (default ppm)\n\t"
+            "-watch            reload the scene when its files change\n\t"
+            "-chunk_budget mb  megabytes of .chunks meshes kept uploaded (default 256)\n\t"
+            "-scene_budget mb  megabytes of meshes and instances of the scenes kept loaded\n\t"
+            "                  (default 1024)\n";
     exit(1);
 }
 
+/* 'int_argument' function:
+ *
+ * Reads a whole command line argument as an integer, calling 'usage' if it
+ * is anything else.
+ */
+int int_argument(const char *text)
+{
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno != 0 || value < INT_MIN || value > INT_MAX) {
+        usage();
+    }
+    return value;
+}
+
+/* 'float_argument' function:
+ *
+ * Reads a whole command line argument as a number, calling 'usage' if it
+ * is anything else.
+ */
+double float_argument(const char *text)
+{
+    char *end;
+    errno = 0;
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || errno != 0) {
+        usage();
+    }
+    return value;
+}
+
 
 /* The 'main' function:
  *
@@ -1593,15 +7514,125 @@ int main(int argc, char* argv[])
     /* Checks that the user inputted the right parameters into the command line
      * and stores xres, yres, and filename to their respective fields
      */
-    if (argc != 4) {
+    if (argc == 4 && string(argv[1]) == "-convert") {
+        string input = argv[2];
+        if (has_extension(input, ".txt")) {
+            convert_scene(input, argv[3]);
+        } else {
+            convert_to_chunks(input, argv[3]);
+        }
+        return 0;
+    }
+    if (argc >= 3 && string(argv[1]) == "-bench") {
+        vector<string> filenames;
+        for (int i = 3; i < argc; ++i) {
+            string option = argv[i];
+            if (option == "-warmup" && i + 1 < argc) {
+                bench_warmup = int_argument(argv[++i]);
+            } else if (option == "-repetitions" && i + 1 < argc) {
+                bench_repetitions = int_argument(argv[++i]);
+            } else if (option[0] != '-') {
+                filenames.push_back(option);
+            } else {
+                usage();
+            }
+        }
+        if (filenames.empty() || bench_warmup < 0 || bench_repetitions <= 0) {
+            usage();
+        }
+        start_offscreen();
+        run_benchmarks(argv[2], filenames);
+        return 0;
+    }
+    /* The scene files come first, up to the resolution. They are told apart
+     * by their extension, since a scene file's name may start with a digit.
+     */
+    vector<string> filenames;
+    int first = 1;
+    while (first < argc && (has_extension(argv[first], ".txt")
+                            || has_extension(argv[first], ".scene"))) {
+        filenames.push_back(argv[first++]);
+    }
+    if (filenames.empty() || first + 2 > argc) {
         usage();
     }
-    int xres = stoi(argv[2]);
-    int yres = stoi(argv[3]);
+    int xres = int_argument(argv[first]);
+    int yres = int_argument(argv[first + 1]);
     if (xres <= 0 || yres <= 0) {
         usage();
     }
 
+    /* Any optional settings come after the required parameters */
+    for (int i = first + 2; i < argc; ++i) {
+        string option = argv[i];
+        if (option == "-light_cutoff" && i + 1 < argc) {
+            light_cutoff = float_argument(argv[++i]);
+            if (light_cutoff <= 0 || light_cutoff >= 1) {
+                usage();
+            }
+        } else if (option == "-refresh" && i + 1 < argc) {
+            refresh_rate = float_argument(argv[++i]);
+            if (refresh_rate <= 0) {
+                usage();
+            }
+        } else if (option == "-benchmark") {
+            benchmark_mode = true;
+        } else if (option == "-render" && i + 1 < argc) {
+            offscreen_mode = true;
+            render_prefix = argv[++i];
+        } else if (option == "-orientations" && i + 1 < argc) {
+            orientations_file = argv[++i];
+        } else if (option == "-turntable" && i + 1 < argc) {
+            turntable_frames = int_argument(argv[++i]);
+            if (turntable_frames <= 0) {
+                usage();
+            }
+        } else if (option == "-format" && i + 1 < argc) {
+            string format = argv[++i];
+            if (format != "ppm" && format != "png") {
+                usage();
+            }
+            png_format = format == "png";
+        } else if (option == "-watch") {
+            watch_mode = true;
+        } else if (option == "-chunk_budget" && i + 1 < argc) {
+            int megabytes = int_argument(argv[++i]);
+            if (megabytes <= 0) {
+                usage();
+            }
+            chunk_budget = (size_t) megabytes << 20;
+        } else if (option == "-scene_budget" && i + 1 < argc) {
+            int megabytes = int_argument(argv[++i]);
+            if (megabytes <= 0) {
+                usage();
+            }
+            scene_budget = (size_t) megabytes << 20;
+        } else {
+            usage();
+        }
+    }
+
+    if ((!orientations_file.empty() || turntable_frames > 0 || png_format)
+        && !offscreen_mode) {
+        usage();
+    }
+    if (!orientations_file.empty() && turntable_frames > 0) {
+        usage();
+    }
+    if (watch_mode && offscreen_mode) {
+        usage();
+    }
+    if (filenames.size() > 1 && (watch_mode || offscreen_mode)) {
+        usage();
+    }
+
+    /* Rendering to image files needs no window, so GLUT is not used at all */
+    if (offscreen_mode) {
+        start_offscreen();
+        render_offscreen(filenames[0], xres, yres);
+        return 0;
+    }
+
     /* 'glutInit' intializes the GLUT (Graphics Library Utility Toolkit) library.
      * This is necessary, since a lot of the functions we used above and below
      * are from the GLUT library.
@@ -1626,10 +7657,18 @@ int main(int argc, char* argv[])
     /* The following line tells OpenGL to name the program window "Test".
      */
     glutCreateWindow("Assignment 3 - Open GL");
+    /* GLEW loads the buffer object functions we use to store our meshes. It
+     * needs the context that 'glutCreateWindow' just made current.
+     */
+    GLenum glew_status = glewInit();
+    if (glew_status != GLEW_OK) {
+        cerr << "Could not initialize GLEW: " << glewGetErrorString(glew_status) << "\n";
+        exit(1);
+    }
     
     /* Call our 'init' function...
      */
-    init(argv[1]);
+    init(filenames);
     /* Specify to OpenGL our display function.
      */
     glutDisplayFunc(display);
@@ -1645,6 +7684,20 @@ int main(int argc, char* argv[])
     /* Specify to OpenGL our function for handling key presses.
      */
     glutKeyboardFunc(key_pressed);
+    /* In benchmark mode we redraw whenever GLUT is idle and do not wait for
+     * the display refresh to swap buffers. Otherwise swaps are synced to the
+     * refresh and frames are only drawn when 'request_redraw' asks for them.
+     */
+    if (benchmark_mode) {
+        set_swap_interval(0);
+        glutIdleFunc(benchmark_idle);
+    } else {
+        set_swap_interval(1);
+    }
+    /* Starts reloading the scene when its files change, if asked to */
+    if (watch_mode) {
+        start_watching();
+    }
     /* The following line tells OpenGL to start the "event processing loop". This
      * is an infinite loop where OpenGL will continuously use our display, reshape,
      * mouse, and keyboard functions to essentially run our program.